@@ -0,0 +1,448 @@
+#include "LibAio.h"
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// the file the requests go to, and how
+static int file_fd = -1;
+static int engine;
+static int depth;
+static int in_flight;
+
+// the io_uring engine: the rings the kernel shares with us
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned pending;   // entries queued but not yet handed to the kernel
+} ring = { -1 };
+
+// the thread engine: submitted requests wait on 'queue' for a worker,
+// finished ones wait on 'finished' for Aio_Reap()
+static struct {
+    pthread_t* threads;
+    int count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    Aio_Request *queue, *queue_tail;
+    Aio_Request *finished, *finished_tail;
+    int nfinished;
+} pool = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// account for 'res' bytes (or -errno) moved by one attempt at 'req'.
+// Returns 1 when the request is complete, 0 if the rest of it has to be
+// issued again (short transfers can happen, e.g. on signals)
+static int progress(Aio_Request* req, ssize_t res)
+{
+    if(res < 0) {
+	if(res == -EINTR || res == -EAGAIN)
+	    return 0;
+	req->result = res;
+	return 1;
+    }
+    req->done += res;
+    if(res == 0 || req->done == req->len) { // done, or end of the file
+	req->result = req->done;
+	return 1;
+    }
+    return 0;
+}
+
+#ifdef __NR_io_uring_setup
+
+static void uring_close()
+{
+    if(ring.sqes != NULL)
+	munmap(ring.sqes, ring.sqes_len);
+    if(ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr)
+	munmap(ring.cq_ptr, ring.cq_len);
+    if(ring.sq_ptr != NULL)
+	munmap(ring.sq_ptr, ring.sq_len);
+    if(ring.fd >= 0)
+	close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+// set up a ring of 'entries' submission slots and map its queues.
+// Returns -1 if the kernel has no io_uring or does not let us use it
+static int uring_open(int entries)
+{
+    struct io_uring_params p;
+    char* sq;
+    char* cq;
+
+    memset(&p, 0, sizeof(p));
+    if((ring.fd = (int) syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+	ring.fd = -1;
+	return -1;
+    }
+
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) { // one mapping holds both rings
+	if(ring.cq_len > ring.sq_len)
+	    ring.sq_len = ring.cq_len;
+	ring.cq_len = ring.sq_len;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       ring.fd, IORING_OFF_SQ_RING);
+    if(ring.sq_ptr == MAP_FAILED) {
+	ring.sq_ptr = NULL;
+	uring_close();
+	return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+	ring.cq_ptr = ring.sq_ptr;
+    else {
+	ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ring.fd, IORING_OFF_CQ_RING);
+	if(ring.cq_ptr == MAP_FAILED) {
+	    ring.cq_ptr = NULL;
+	    uring_close();
+	    return -1;
+	}
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED) {
+	ring.sqes = NULL;
+	uring_close();
+	return -1;
+    }
+
+    sq = (char*) ring.sq_ptr;
+    cq = (char*) ring.cq_ptr;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring.pending = 0;
+    return 0;
+}
+
+// put (the rest of) 'req' on the submission queue; the kernel sees it
+// on the next io_uring_enter(). READV/WRITEV work on every kernel that
+// has io_uring at all
+static void uring_queue(Aio_Request* req)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+
+    req->iov.iov_base = req->buffer + req->done;
+    req->iov.iov_len = req->len - req->done;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = file_fd;
+    sqe->off = (uint64_t)(req->offset + req->done);
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+}
+
+// hand the queued entries to the kernel and collect completions until
+// at least 'min' requests are done; completions are read straight off
+// the ring, so polling with 'min' 0 costs no system call when nothing
+// is queued
+static int uring_reap(Aio_Request** done, int max, int min)
+{
+    int n = 0;
+
+    for(;;) {
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail && n < max) {
+	    struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+	    Aio_Request* req = (Aio_Request*)(uintptr_t) cqe->user_data;
+	    head++;
+	    if(progress(req, cqe->res))
+		done[n++] = req;
+	    else
+		uring_queue(req);
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	if(n >= min && ring.pending == 0)
+	    return n;
+	unsigned wait = n >= min ? 0 : min - n;
+	int rc = (int) syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait,
+			       wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if(rc < 0) {
+	    if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		continue;
+	    return -1;
+	}
+	ring.pending -= rc;
+	if(n >= min && ring.pending == 0)
+	    return n;
+    }
+}
+
+#else // no io_uring in the system headers
+
+static void uring_close() { }
+static int uring_open(int entries) { return -1; }
+static void uring_queue(Aio_Request* req) { }
+static int uring_reap(Aio_Request** done, int max, int min) { return -1; }
+
+#endif
+
+// one worker of the thread engine: blocking pread/pwrite, one request
+// at a time
+static void* worker(void* arg)
+{
+    pthread_mutex_lock(&pool.lock);
+    for(;;) {
+	while(!pool.stop && pool.queue == NULL)
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	if(pool.stop)
+	    break;
+	Aio_Request* req = pool.queue;
+	if((pool.queue = req->next) == NULL)
+	    pool.queue_tail = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	ssize_t res;
+	do {
+	    char* at = req->buffer + req->done;
+	    off_t offset = req->offset + req->done;
+	    res = req->write ? pwrite(file_fd, at, req->len - req->done, offset) :
+		pread(file_fd, at, req->len - req->done, offset);
+	} while(!progress(req, res < 0 ? -errno : res));
+
+	pthread_mutex_lock(&pool.lock);
+	req->next = NULL;
+	if(pool.finished_tail != NULL)
+	    pool.finished_tail->next = req;
+	else
+	    pool.finished = req;
+	pool.finished_tail = req;
+	pool.nfinished++;
+	pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void threads_close()
+{
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for(i = 0; i < pool.count; i++)
+	pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.count = 0;
+    pool.stop = 0;
+    pool.queue = pool.queue_tail = NULL;
+    pool.finished = pool.finished_tail = NULL;
+    pool.nfinished = 0;
+}
+
+// start one worker per slot of the queue
+static int threads_open(int count)
+{
+    if((pool.threads = (pthread_t *) calloc(count, sizeof(pthread_t))) == NULL)
+	return -1;
+    for(pool.count = 0; pool.count < count; pool.count++) {
+	if(pthread_create(&pool.threads[pool.count], NULL, worker, NULL) != 0) {
+	    threads_close();
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static void threads_queue(Aio_Request* req)
+{
+    pthread_mutex_lock(&pool.lock);
+    req->next = NULL;
+    if(pool.queue_tail != NULL)
+	pool.queue_tail->next = req;
+    else
+	pool.queue = req;
+    pool.queue_tail = req;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static int threads_reap(Aio_Request** done, int max, int min)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.nfinished < min)
+	pthread_cond_wait(&pool.done, &pool.lock);
+    while(n < max && pool.finished != NULL) {
+	done[n++] = pool.finished;
+	if((pool.finished = pool.finished->next) == NULL)
+	    pool.finished_tail = NULL;
+	pool.nfinished--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return n;
+}
+
+/*
+ * Aio_Open
+ *
+ * Starts sending requests to the file 'fd' with up to 'queue_depth'
+ * (AIO_DEFAULT_DEPTH if not positive) in flight. AIO_AUTO tries io_uring
+ * first and falls back to threads. Returns the engine in use, -1 if the
+ * one asked for is not available. Any previous setup is closed.
+ */
+int Aio_Open(int fd, int which, int queue_depth)
+{
+    Aio_Close();
+    if(queue_depth <= 0)
+	queue_depth = AIO_DEFAULT_DEPTH;
+    if(queue_depth > AIO_MAX_DEPTH)
+	queue_depth = AIO_MAX_DEPTH;
+
+    file_fd = fd;
+    depth = queue_depth;
+    in_flight = 0;
+    if(which != AIO_THREADS && uring_open(depth) == 0)
+	engine = AIO_URING;
+    else if(which != AIO_URING && threads_open(depth) == 0)
+	engine = AIO_THREADS;
+    else {
+	file_fd = -1;
+	return -1;
+    }
+    return engine;
+}
+
+/*
+ * Aio_Close
+ *
+ * Tears the engine down. Requests still in flight are abandoned, so
+ * reap them first.
+ */
+void Aio_Close()
+{
+    if(engine == AIO_URING)
+	uring_close();
+    else if(engine == AIO_THREADS)
+	threads_close();
+    engine = 0;
+    file_fd = -1;
+    in_flight = 0;
+}
+
+/*
+ * Aio_Engine
+ *
+ * Returns AIO_URING or AIO_THREADS, 0 when nothing is open.
+ */
+int Aio_Engine()
+{
+    return engine;
+}
+
+/*
+ * Aio_Submit
+ *
+ * Queues a request. With io_uring it only reaches the kernel on the
+ * next Aio_Reap(), so several submissions cost one system call.
+ */
+int Aio_Submit(Aio_Request* req)
+{
+    if(engine == 0 || req == NULL || in_flight >= depth) {
+	errno = engine == 0 || req == NULL ? EINVAL : EAGAIN;
+	return -1;
+    }
+    req->done = 0;
+    req->result = 0;
+    in_flight++;
+    if(engine == AIO_URING)
+	uring_queue(req);
+    else
+	threads_queue(req);
+    return 0;
+}
+
+/*
+ * Aio_Reap
+ *
+ * Waits until at least 'min' requests are complete (0 just polls) and
+ * stores up to 'max' of them in 'done'. Returns how many, -1 on error.
+ */
+int Aio_Reap(Aio_Request** done, int max, int min)
+{
+    int n;
+
+    if(min > max)
+	min = max;
+    if(min > in_flight)
+	min = in_flight;
+    n = engine == AIO_URING ? uring_reap(done, max, min) : threads_reap(done, max, min);
+    if(n > 0)
+	in_flight -= n;
+    return n;
+}
+
+/*
+ * Aio_InFlight
+ *
+ * Returns the number of requests submitted and not reaped yet.
+ */
+int Aio_InFlight()
+{
+    return in_flight;
+}
+
+/*
+ * Aio_Run
+ *
+ * Moves a batch of requests, refilling the queue as they complete.
+ * Returns 0 if every request moved all its bytes, -1 otherwise (each
+ * request's 'result' tells which).
+ */
+int Aio_Run(Aio_Request* reqs, int n)
+{
+    Aio_Request* done[AIO_MAX_DEPTH];
+    int next = 0, left = n, rc = 0, got, i;
+
+    while(left > 0) {
+	while(next < n && in_flight < depth) {
+	    if(Aio_Submit(&reqs[next]) == -1)
+		return -1;
+	    next++;
+	}
+	if((got = Aio_Reap(done, AIO_MAX_DEPTH, 1)) < 0)
+	    return -1;
+	for(i = 0; i < got; i++) {
+	    if(done[i]->result != (ssize_t) done[i]->len)
+		rc = -1;
+	}
+	left -= got;
+    }
+    return rc;
+}
@@ -0,0 +1,56 @@
+//
+// Aio.h
+//
+// Asynchronous reads and writes of one open file, used by LibDisk's
+// file backend. Requests go through io_uring when the kernel allows it
+// (set up with the raw system calls, no liburing needed) and through a
+// pool of pread/pwrite threads otherwise. At most 'depth' requests are
+// in flight at a time.
+//
+// Only one thread may use the module at a time (LibDisk is called under
+// LibCache's lock).
+//
+
+#ifndef __Aio_H__
+#define __Aio_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// engines
+#define AIO_AUTO    0  // io_uring if it can be set up, threads otherwise
+#define AIO_URING   1
+#define AIO_THREADS 2
+
+#define AIO_DEFAULT_DEPTH 32
+#define AIO_MAX_DEPTH     256
+
+typedef struct aio_request {
+    int write;          // 1 to write 'buffer' to the file, 0 to read into it
+    off_t offset;       // where in the file
+    size_t len;         // bytes to move
+    char* buffer;
+    ssize_t result;     // once complete: bytes moved, or -errno
+
+    // private to the engines
+    size_t done;
+    struct iovec iov;
+    struct aio_request* next;
+} Aio_Request;
+
+int Aio_Open(int fd, int engine, int depth);
+void Aio_Close();
+int Aio_Engine();
+
+// asynchronous interface: Aio_Submit() fails with -1 when 'depth'
+// requests are already in flight, Aio_Reap() waits for at least 'min'
+// of them to complete and returns up to 'max' of those
+int Aio_Submit(Aio_Request* req);
+int Aio_Reap(Aio_Request** done, int max, int min);
+int Aio_InFlight();
+
+// runs 'n' requests, keeping as many in flight as the depth allows, and
+// waits for all of them
+int Aio_Run(Aio_Request* reqs, int n);
+
+#endif // __Aio_H__
@@ -0,0 +1,605 @@
+#include "LibCache.h"
+#include <string.h>
+#include <pthread.h>
+
+// bookkeeping for one buffer of the pool
+typedef struct buffer {
+    sector_t sector; // sector held by this buffer (-1 when unused)
+    int pins;     // outstanding Cache_Get() calls
+    int dirty;    // 1 if the buffer differs from the disk
+    int ref;      // CLOCK reference bit
+    int prefetched; // 1 if Cache_Prefetch() brought it in and nobody read it yet
+    int next;     // next buffer in the same hash chain (-1 ends it)
+} Buffer;
+
+// the buffer pool and its hash table (static makes them private to the file)
+static Sector* pool;
+static Buffer* buffers;
+static int* buckets;
+static int num_buffers;
+static int num_buckets;
+static int clock_hand;
+
+// used for statistics
+static Cache_Stats stats;
+
+// dirty buffers Cache_Flush() hands to the disk in one call, and
+// uncached runs read with one call by Cache_ReadV() and Cache_Prefetch()
+#define FLUSH_BATCH 64
+
+// one lock covers the pool, the hash table, the statistics and every
+// call into LibDisk made on the cache's behalf. The contents of a pinned
+// buffer are not covered: LibFS serializes access to them with its own
+// inode and bitmap locks
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// set the dirty flag of buffer 'b', keeping stats.dirty
+static void set_dirty(int b, int dirty)
+{
+    stats.dirty += dirty - buffers[b].dirty;
+    buffers[b].dirty = dirty;
+}
+
+// count the first use of a buffer Cache_Prefetch() brought in
+static void used(int b)
+{
+    if(buffers[b].prefetched) {
+	buffers[b].prefetched = 0;
+	stats.prefetch_hits++;
+    }
+}
+
+static int hash_sector(sector_t sector)
+{
+    return (int)(((uint64_t)sector * 0x9E3779B97F4A7C15ull) >> 32) & (num_buckets - 1);
+}
+
+// returns the buffer index holding 'sector', -1 if it is not cached
+static int lookup(sector_t sector)
+{
+    int b;
+    for(b = buckets[hash_sector(sector)]; b != -1; b = buffers[b].next) {
+	if(buffers[b].sector == sector)
+	    return b;
+    }
+    return -1;
+}
+
+static void hash_insert(int b)
+{
+    int h = hash_sector(buffers[b].sector);
+    buffers[b].next = buckets[h];
+    buckets[h] = b;
+}
+
+static void hash_remove(int b)
+{
+    int* link = &buckets[hash_sector(buffers[b].sector)];
+    while(*link != b)
+	link = &buffers[*link].next;
+    *link = buffers[b].next;
+}
+
+// pick a buffer to recycle with the CLOCK algorithm, writing it back
+// first if it is dirty. Returns -1 if every buffer is pinned.
+static int evict()
+{
+    int scanned;
+    for(scanned = 0; scanned < 2 * num_buffers; scanned++) {
+	int b = clock_hand;
+	clock_hand = (clock_hand + 1) % num_buffers;
+
+	if(buffers[b].pins > 0)
+	    continue;
+	if(buffers[b].sector == -1)
+	    return b;
+	if(buffers[b].ref) { // second chance
+	    buffers[b].ref = 0;
+	    continue;
+	}
+
+	if(buffers[b].dirty) {
+	    if(Disk_Write(buffers[b].sector, pool[b].data) < 0)
+		return -1;
+	    set_dirty(b, 0);
+	    stats.writebacks++;
+	}
+	if(buffers[b].prefetched)
+	    stats.prefetch_unused++;
+	buffers[b].prefetched = 0;
+	hash_remove(b);
+	buffers[b].sector = -1;
+	stats.evictions++;
+	return b;
+    }
+    diskErrno = E_MEM_OP;
+    return -1;
+}
+
+// pin the buffer for 'sector', bringing it in from the disk when 'load'
+// is set and zero-filling it otherwise
+static char* grab(sector_t sector, int load)
+{
+    int b;
+
+    if((sector < 0) || (sector >= Disk_Sectors())) {
+	diskErrno = E_INVALID_PARAM;
+	return NULL;
+    }
+
+    b = lookup(sector);
+    if(b != -1) {
+	stats.hits++;
+	used(b);
+	if(!load)
+	    memset(pool[b].data, 0, SECTOR_SIZE);
+    }
+    else {
+	stats.misses++;
+	if((b = evict()) < 0)
+	    return NULL;
+	if(load) {
+	    if(Disk_Read(sector, pool[b].data) < 0)
+		return NULL;
+	}
+	else
+	    memset(pool[b].data, 0, SECTOR_SIZE);
+	buffers[b].sector = sector;
+	set_dirty(b, 0);
+	hash_insert(b);
+    }
+
+    buffers[b].pins++;
+    buffers[b].ref = 1;
+    return pool[b].data;
+}
+
+/*
+ * Cache_Init
+ *
+ * Sets up a cache of 'capacity' sectors (CACHE_DEFAULT_SECTORS if it is
+ * not positive). Any previous cache is dropped without being written
+ * back, so this must be called again whenever the disk is reloaded.
+ */
+int Cache_Init(int capacity)
+{
+    int b;
+
+    Cache_Shutdown();
+    if(capacity <= 0)
+	capacity = CACHE_DEFAULT_SECTORS;
+
+    for(num_buckets = 1; num_buckets < 2 * capacity; num_buckets <<= 1);
+
+    pool = (Sector *) calloc(capacity, sizeof(Sector));
+    buffers = (Buffer *) calloc(capacity, sizeof(Buffer));
+    buckets = (int *) malloc(num_buckets * sizeof(int));
+    if(pool == NULL || buffers == NULL || buckets == NULL) {
+	Cache_Shutdown();
+	diskErrno = E_MEM_OP;
+	return -1;
+    }
+
+    num_buffers = capacity;
+    for(b = 0; b < num_buffers; b++)
+	buffers[b].sector = -1;
+    for(b = 0; b < num_buckets; b++)
+	buckets[b] = -1;
+    clock_hand = 0;
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+}
+
+/*
+ * Cache_Shutdown
+ *
+ * Releases the buffer pool. Dirty buffers are discarded, call
+ * Cache_Flush() first to keep them.
+ */
+void Cache_Shutdown()
+{
+    free(pool);
+    free(buffers);
+    free(buckets);
+    pool = NULL;
+    buffers = NULL;
+    buckets = NULL;
+    num_buffers = 0;
+}
+
+/*
+ * Cache_Get
+ *
+ * Pins a sector in the cache and returns its buffer. Changes made
+ * through the pointer are kept as long as Cache_Put() is told the
+ * buffer is dirty.
+ */
+char* Cache_Get(sector_t sector)
+{
+    pthread_mutex_lock(&cache_lock);
+    char* data = grab(sector, 1);
+    pthread_mutex_unlock(&cache_lock);
+    return data;
+}
+
+/*
+ * Cache_GetNew
+ *
+ * Like Cache_Get() but for a sector whose old contents do not matter
+ * (e.g. one that was just allocated): the disk is not read and the
+ * buffer comes back zero-filled.
+ */
+char* Cache_GetNew(sector_t sector)
+{
+    pthread_mutex_lock(&cache_lock);
+    char* data = grab(sector, 0);
+    pthread_mutex_unlock(&cache_lock);
+    return data;
+}
+
+/*
+ * Cache_Peek
+ *
+ * Pins and returns the buffer of a sector only if it is already cached,
+ * NULL otherwise; the disk is never read.
+ */
+char* Cache_Peek(sector_t sector)
+{
+    char* data = NULL;
+    int b;
+
+    pthread_mutex_lock(&cache_lock);
+    if((b = lookup(sector)) != -1) {
+	buffers[b].pins++;
+	buffers[b].ref = 1;
+	data = pool[b].data;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return data;
+}
+
+/*
+ * Cache_Sector
+ *
+ * Returns the sector a pinned buffer holds.
+ */
+sector_t Cache_Sector(char* buffer)
+{
+    return buffers[(Sector *) buffer - pool].sector;
+}
+
+/*
+ * Cache_Put
+ *
+ * Unpins a buffer returned by Cache_Get()/Cache_GetNew().
+ */
+void Cache_Put(char* buffer, int dirty)
+{
+    int b = (int)((Sector *) buffer - pool);
+
+    pthread_mutex_lock(&cache_lock);
+    if(dirty)
+	set_dirty(b, 1);
+    buffers[b].pins--;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Cache_Read
+ *
+ * Reads a single sector through the cache into a buffer provided by
+ * the user.
+ */
+int Cache_Read(sector_t sector, char* buffer)
+{
+    char* data;
+
+    if(buffer == NULL) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    if((data = Cache_Get(sector)) == NULL)
+	return -1;
+    memcpy(buffer, data, SECTOR_SIZE);
+    Cache_Put(data, 0);
+    return 0;
+}
+
+/*
+ * Cache_Write
+ *
+ * Overwrites a whole sector in the cache. The disk only sees the new
+ * contents once the buffer is evicted or flushed.
+ */
+int Cache_Write(sector_t sector, char* buffer)
+{
+    char* data;
+
+    if(buffer == NULL) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    if((data = Cache_GetNew(sector)) == NULL)
+	return -1;
+    memcpy(data, buffer, SECTOR_SIZE);
+    Cache_Put(data, 1);
+    return 0;
+}
+
+// read the segments, copying the sectors that are cached and reading
+// the runs that are not from the disk, FLUSH_BATCH runs per call; called
+// with cache_lock held
+static int read_segments(const Disk_Segment* segs, int nsegs)
+{
+    Disk_Segment runs[FLUSH_BATCH];
+    int s, i, j, b, n = 0;
+
+    for(s = 0; s < nsegs; s++) {
+	if(segs[s].count < 0 || segs[s].sector < 0 || segs[s].count > Disk_Sectors() - segs[s].sector) {
+	    diskErrno = E_INVALID_PARAM;
+	    return -1;
+	}
+	for(i = 0; i < segs[s].count; i = j) {
+	    if((b = lookup(segs[s].sector + i)) != -1) {
+		memcpy(segs[s].buffer + i * SECTOR_SIZE, pool[b].data, SECTOR_SIZE);
+		used(b);
+		j = i + 1;
+		continue;
+	    }
+	    for(j = i + 1; j < segs[s].count && lookup(segs[s].sector + j) == -1; j++);
+	    if(n == FLUSH_BATCH) {
+		if(Disk_ReadV(runs, n) < 0)
+		    return -1;
+		n = 0;
+	    }
+	    runs[n++] = (Disk_Segment){ segs[s].sector + i, j - i, segs[s].buffer + i * SECTOR_SIZE };
+	}
+    }
+    return n > 0 ? Disk_ReadV(runs, n) : 0;
+}
+
+/*
+ * Cache_ReadRange
+ *
+ * Reads 'count' consecutive sectors: cached ones are copied from the
+ * cache, the rest come from the disk with a single transfer per run.
+ */
+int Cache_ReadRange(sector_t sector, int count, char* buffer)
+{
+    Disk_Segment seg = { sector, count, buffer };
+
+    if(buffer == NULL) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    return Cache_ReadV(&seg, 1);
+}
+
+/*
+ * Cache_WriteRange
+ *
+ * Writes 'count' consecutive sectors with a single disk transfer. Cached
+ * copies of those sectors are refreshed and become clean.
+ */
+int Cache_WriteRange(sector_t sector, int count, char* buffer)
+{
+    int i, b, rc = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if(Disk_WriteRange(sector, count, buffer) == 0) {
+	for(i = 0; i < count; i++) {
+	    if((b = lookup(sector + i)) != -1) {
+		memcpy(pool[b].data, buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+		set_dirty(b, 0);
+	    }
+	}
+	rc = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+/*
+ * Cache_ReadV
+ *
+ * Scatter read of several runs of sectors: cached sectors are copied
+ * from the cache, the others are read from the disk together.
+ */
+int Cache_ReadV(const Disk_Segment* segs, int nsegs)
+{
+    int rc;
+
+    pthread_mutex_lock(&cache_lock);
+    rc = read_segments(segs, nsegs);
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+/*
+ * Cache_WriteV
+ *
+ * Gather write of several runs of sectors with a single disk call.
+ * Cached copies of those sectors are refreshed and become clean.
+ */
+int Cache_WriteV(const Disk_Segment* segs, int nsegs)
+{
+    int s, i, b, rc = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if(Disk_WriteV(segs, nsegs) == 0) {
+	for(s = 0; s < nsegs; s++) {
+	    for(i = 0; i < segs[s].count; i++) {
+		if((b = lookup(segs[s].sector + i)) != -1) {
+		    memcpy(pool[b].data, segs[s].buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+		    set_dirty(b, 0);
+		}
+	    }
+	}
+	rc = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+/*
+ * Cache_Prefetch
+ *
+ * Reads 'count' sectors from 'sector' on into the cache ahead of use,
+ * those that are not cached yet, with one disk read per run of up to
+ * FLUSH_BATCH of them. The buffers are not pinned and have no reference
+ * bit, so the CLOCK hand takes them first if nobody reads them. At most
+ * half the cache is filled by one call. Returns the number of sectors
+ * read, or -1.
+ */
+int Cache_Prefetch(sector_t sector, int count)
+{
+    char run[FLUSH_BATCH * SECTOR_SIZE];
+    int i, j, n, b, rc = 0, loaded = 0;
+
+    if(sector < 0 || count < 0 || count > Disk_Sectors() - sector) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if(count > num_buffers / 2)
+	count = num_buffers / 2;
+    for(i = 0; i < count && rc == 0; i += n) {
+	n = 1;
+	if(lookup(sector + i) != -1)
+	    continue;
+	while(i + n < count && n < FLUSH_BATCH && lookup(sector + i + n) == -1)
+	    n++;
+	if(Disk_ReadRange(sector + i, n, run) < 0) {
+	    rc = -1;
+	    break;
+	}
+	for(j = 0; j < n; j++) {
+	    if((b = evict()) < 0) {
+		rc = -1;
+		break;
+	    }
+	    memcpy(pool[b].data, run + j * SECTOR_SIZE, SECTOR_SIZE);
+	    buffers[b].sector = sector + i + j;
+	    buffers[b].ref = 0;
+	    buffers[b].prefetched = 1;
+	    set_dirty(b, 0);
+	    hash_insert(b);
+	}
+	loaded += j;
+    }
+    stats.prefetched += loaded;
+    pthread_mutex_unlock(&cache_lock);
+    return rc == 0 ? loaded : -1;
+}
+
+/*
+ * Cache_Discard
+ *
+ * Drops the cached copy of a sector that was freed, so a stale dirty
+ * buffer can never overwrite the sector's next owner.
+ */
+void Cache_Discard(sector_t sector)
+{
+    int b;
+
+    pthread_mutex_lock(&cache_lock);
+    if((b = lookup(sector)) != -1 && buffers[b].pins == 0) {
+	if(buffers[b].prefetched)
+	    stats.prefetch_unused++;
+	buffers[b].prefetched = 0;
+	hash_remove(b);
+	buffers[b].sector = -1;
+	set_dirty(b, 0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// write every dirty buffer back to the disk, FLUSH_BATCH at a time;
+// called with cache_lock held
+static int flush()
+{
+    Disk_Segment segs[FLUSH_BATCH];
+    int batch[FLUSH_BATCH];
+    int b, i, n = 0;
+
+    for(b = 0; b <= num_buffers; b++) {
+	if(b < num_buffers && buffers[b].sector != -1 && buffers[b].dirty) {
+	    segs[n] = (Disk_Segment){ buffers[b].sector, 1, pool[b].data };
+	    batch[n++] = b;
+	}
+	if(n == 0 || (n < FLUSH_BATCH && b < num_buffers))
+	    continue;
+	if(Disk_WriteV(segs, n) < 0)
+	    return -1;
+	for(i = 0; i < n; i++)
+	    set_dirty(batch[i], 0);
+	stats.writebacks += n;
+	n = 0;
+    }
+    return 0;
+}
+
+/*
+ * Cache_Flush
+ *
+ * Writes every dirty buffer back to the disk. Buffers stay cached. The
+ * writes go out FLUSH_BATCH at a time as one Disk_WriteV(), so a disk
+ * that does asynchronous I/O has them all in flight together.
+ */
+int Cache_Flush()
+{
+    int rc;
+
+    pthread_mutex_lock(&cache_lock);
+    rc = flush();
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+/*
+ * Cache_Writeback
+ *
+ * Brings the disk image up to date in the background: writes the dirty
+ * buffers back to the disk and stages up to about 'max' sectors the
+ * image lacks (see Disk_Stage()), then writes those to the image with
+ * the cache unlocked, so other threads only wait for the copies.
+ * Returns the number of sectors written to the image, or -1.
+ */
+sector_t Cache_Writeback(sector_t max)
+{
+    sector_t staged = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if(flush() == 0)
+	staged = Disk_Stage(max);
+    pthread_mutex_unlock(&cache_lock);
+    if(staged < 0 || Disk_WriteStaged() < 0)
+	return -1;
+    return staged;
+}
+
+/*
+ * Cache_Unsaved
+ *
+ * Returns how many sectors the disk image lacks: dirty buffers plus
+ * sectors written to the disk since it was last saved.
+ */
+sector_t Cache_Unsaved()
+{
+    pthread_mutex_lock(&cache_lock);
+    sector_t unsaved = stats.dirty + Disk_Dirty();
+    pthread_mutex_unlock(&cache_lock);
+    return unsaved;
+}
+
+/*
+ * Cache_GetStats
+ *
+ * Copies the hit/miss/eviction counters into 'out'.
+ */
+void Cache_GetStats(Cache_Stats* out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,61 @@
+//
+// Cache.h
+//
+// Write-back sector buffer cache sitting between LibFS and LibDisk.
+// Sectors live in a fixed pool of buffers that are found through a
+// hash table and evicted with the CLOCK algorithm. Dirty buffers only
+// reach the disk when they are evicted or on Cache_Flush().
+//
+// Every call except Cache_Init()/Cache_Shutdown() may be made from any
+// thread; callers that share a buffer must still agree on who changes
+// its contents.
+//
+
+#ifndef __Cache_H__
+#define __Cache_H__
+
+#include "LibDisk.h"
+
+// default number of sectors held by the cache
+#define CACHE_DEFAULT_SECTORS 256
+
+typedef struct cache_stats {
+    long hits;        // lookups served from the pool
+    long misses;      // lookups that had to go to the disk
+    long evictions;   // buffers recycled by the CLOCK hand
+    long writebacks;  // dirty buffers written to the disk
+    long dirty;       // buffers not written back yet
+    long prefetched;  // sectors Cache_Prefetch() read ahead of use
+    long prefetch_hits;   // ... that were then read
+    long prefetch_unused; // ... that were dropped without being read
+} Cache_Stats;
+
+int Cache_Init(int capacity);
+void Cache_Shutdown();
+
+// pinned access: the returned buffer stays valid until Cache_Put()
+char* Cache_Get(sector_t sector);
+char* Cache_GetNew(sector_t sector);
+void Cache_Put(char* buffer, int dirty);
+char* Cache_Peek(sector_t sector);
+sector_t Cache_Sector(char* buffer);
+
+// copying access, same semantics as Disk_Read() / Disk_Write()
+int Cache_Read(sector_t sector, char* buffer);
+int Cache_Write(sector_t sector, char* buffer);
+
+// multi-sector and scatter/gather transfers that go straight to the disk but stay coherent
+// with whatever copies of those sectors are cached (reads take those copies instead)
+int Cache_ReadRange(sector_t sector, int count, char* buffer);
+int Cache_WriteRange(sector_t sector, int count, char* buffer);
+int Cache_ReadV(const Disk_Segment* segs, int nsegs);
+int Cache_WriteV(const Disk_Segment* segs, int nsegs);
+
+int Cache_Prefetch(sector_t sector, int count);
+void Cache_Discard(sector_t sector);
+int Cache_Flush();
+sector_t Cache_Writeback(sector_t max);
+sector_t Cache_Unsaved();
+void Cache_GetStats(Cache_Stats* stats);
+
+#endif // __Cache_H__
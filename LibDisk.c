@@ -1,20 +1,537 @@
 #include "LibDisk.h"
+#include "LibAio.h"
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 
-// the disk in memory (static makes it private to the file)
+// the disk in memory (static makes it private to the file); with the
+// DISK_BACKEND_MMAP backend it is a MAP_SHARED mapping of the image
 static Sector* disk;
+static sector_t num_sectors;       // size of 'disk'
+static sector_t init_sectors = NUM_SECTORS; // size Disk_Init() gives it
+static int mapped;
+static int backend = DISK_BACKEND_MEMORY;
+
+// with DISK_BACKEND_FILE 'disk' is NULL and the sectors are read and
+// written in the image file 'image_fd' through LibAio
+static int image_fd = -1;
+static int aio_engine = DISK_AIO_AUTO;
+static int aio_depth = AIO_DEFAULT_DEPTH;
+
+// sectors changed since the image file was last loaded or saved, one
+// bit each, and the name of that file ("" when there is none yet)
+static uint64_t* dirty;
+static sector_t num_dirty;
+static char image[1024];
+
+// sectors Disk_Save() must leave out of the image for now (NULL when
+// there are none); they stay dirty until Disk_ReleaseHolds()
+static uint64_t* held;
+
+// clean runs shorter than this between two dirty ones are written along
+// with them, one larger write being cheaper than two small ones
+#define SAVE_GAP 8
+
+// runs of sectors Disk_Stage() took out of the dirty bitmap for
+// Disk_WriteStaged() to write; with the in-memory backend their contents
+// are copied to 'stage_buf'. If writing them fails they are marked dirty
+// again by the next Disk_Stage() or Disk_Save()
+static Disk_Segment* staged;
+static int num_staged, staged_cap, restage;
+static char* stage_buf;
+static size_t stage_size;
+
+// held from the start of a Disk_Save() to its end, and from
+// Disk_Stage() to Disk_WriteStaged(), so saves reach the image in order
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sync_mode; // read and written with save_lock held
+
+// added to every call that moves sectors, standing in for the request
+// latency of a real device (Disk_SetDelay())
+static int delay_us;
 
 // used to see what happened w/ disk ops
-Disk_Error_t diskErrno; 
+_Thread_local Disk_Error_t diskErrno;
+
+// the timing model (Disk_SetModel()) and where the head of the modelled
+// disk is: the sector after the last request. Requests are costed one
+// at a time under model_lock; with no model only the seeks are counted
+static Disk_Model model;
+static int model_on;               // model.type != DISK_MODEL_NONE, read without the lock
+static sector_t last_sector;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+static Disk_Stats stats;
+
+#define DIRTY_WORDS(sectors) (((sectors) + 63) / 64)
+
+static void delay(long us)
+{
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    if(us > 0)
+	nanosleep(&ts, NULL);
+}
+
+// requests a scatter/gather list stands for: one per run of consecutive
+// sectors, however many segments it is split into
+static int segment_runs(const Disk_Segment* segs, int nsegs)
+{
+    int i, runs = 0;
+
+    for(i = 0; i < nsegs; i++) {
+	if(i == 0 || segs[i].sector != segs[i-1].sector + segs[i-1].count)
+	    runs++;
+    }
+    return runs;
+}
+
+static long segment_sectors(const Disk_Segment* segs, int nsegs)
+{
+    int i;
+    long sectors = 0;
+
+    for(i = 0; i < nsegs; i++)
+	sectors += segs[i].count;
+    return sectors;
+}
+
+// time the model says a run of 'count' sectors from 'sector' on takes,
+// in ns, moving the head to its end; called with model_lock held
+static double model_run(int write, sector_t sector, int count)
+{
+    double ns = count * (double)SECTOR_SIZE * 1000 / model.transfer_mb_s;
+    sector_t last = __atomic_load_n(&last_sector, __ATOMIC_RELAXED);
+    sector_t distance = sector > last ? sector - last : last - sector;
+
+    if(model.type == DISK_MODEL_HDD && distance > 0) {
+	sector_t size = num_sectors > 0 ? num_sectors : init_sectors;
+	ns += 1000 * (model.seek_min_us + (model.seek_max_us - model.seek_min_us) * sqrt((double)distance / size));
+	ns += 30e9 / model.rpm;
+    }
+    else if(model.type == DISK_MODEL_SSD)
+	ns += 1000 * (write ? model.write_us : model.read_us);
+    __atomic_store_n(&last_sector, sector + count, __ATOMIC_RELAXED);
+    return ns;
+}
+
+// count the requests of a call moving the sectors of 'segs' (one per run
+// of consecutive sectors) and the seeks between them, then wait for them
+// as long as Disk_SetDelay() and the timing model say. Any thread may be
+// moving sectors, so the counters are updated atomically
+static void request(int write, const Disk_Segment* segs, int nsegs)
+{
+    int runs = segment_runs(segs, nsegs);
+    long sectors = segment_sectors(segs, nsegs);
+    long seeks = 0, seek_sectors = 0;
+    double ns = 0;
+
+    __atomic_add_fetch(write ? &stats.writes : &stats.reads, runs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(write ? &stats.sectors_written : &stats.sectors_read, sectors, __ATOMIC_RELAXED);
+    int locked = __atomic_load_n(&model_on, __ATOMIC_RELAXED);
+    if(locked)
+	pthread_mutex_lock(&model_lock);
+    int modelled = locked && model.type != DISK_MODEL_NONE; // not turned off meanwhile
+    for(int i = 0, n; i < nsegs; i += n) {
+	sector_t start = segs[i].sector, end = start + segs[i].count;
+	for(n = 1; i + n < nsegs && segs[i + n].sector == end; n++)
+	    end += segs[i + n].count;
+	sector_t from = modelled ? __atomic_load_n(&last_sector, __ATOMIC_RELAXED) :
+	    __atomic_exchange_n(&last_sector, end, __ATOMIC_RELAXED);
+	if(from != start) {
+	    seeks++;
+	    seek_sectors += start > from ? start - from : from - start;
+	}
+	if(modelled)
+	    ns += model_run(write, start, (int)(end - start));
+    }
+    if(modelled && model.type == DISK_MODEL_SSD && model.channels > 1) {
+	// the runs' latencies overlap, 'channels' at a time
+	double latency = 1000 * (write ? model.write_us : model.read_us);
+	ns -= latency * (runs - (runs + model.channels - 1) / model.channels);
+    }
+    int sleep = modelled && model.sleep;
+    if(locked)
+	pthread_mutex_unlock(&model_lock);
+
+    __atomic_add_fetch(&stats.seeks, seeks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.seek_sectors, seek_sectors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.model_ns, (long)ns, __ATOMIC_RELAXED);
+    delay((long)delay_us * runs + (sleep ? (long)(ns / 1000) : 0));
+}
+
+// request() for 'count' sectors from 'sector' on
+static void request_range(int write, sector_t sector, int count)
+{
+    Disk_Segment seg = { sector, count, NULL };
+    request(write, &seg, 1);
+}
+
+// set or clear the bits 'bits' of dirty word 'w', keeping num_dirty
+static void set_bits(sector_t w, uint64_t bits, int on)
+{
+    if(on) {
+	num_dirty += __builtin_popcountll(bits & ~dirty[w]);
+	dirty[w] |= bits;
+    }
+    else {
+	num_dirty -= __builtin_popcountll(bits & dirty[w]);
+	dirty[w] &= ~bits;
+    }
+}
+
+// mark 'count' sectors from 'sector' on dirty (on = 1) or clean
+static void set_dirty(sector_t sector, sector_t count, int on)
+{
+    for(; count > 0 && sector % 64 != 0; sector++, count--)
+	set_bits(sector / 64, 1ULL << (sector % 64), on);
+    for(; count >= 64; sector += 64, count -= 64)
+	set_bits(sector / 64, ~0ULL, on);
+    for(; count > 0; sector++, count--)
+	set_bits(sector / 64, 1ULL << (sector % 64), on);
+}
+
+static void mark_dirty(sector_t sector, int count)
+{
+    set_dirty(sector, count, 1);
+}
+
+// forget which sectors the image lacks, except the held ones
+static void clear_dirty()
+{
+    sector_t w;
+
+    if(held == NULL) {
+	memset(dirty, 0, DIRTY_WORDS(num_sectors) * sizeof(uint64_t));
+	num_dirty = 0;
+    }
+    else {
+	for(w = 0; w < DIRTY_WORDS(num_sectors); w++)
+	    set_bits(w, ~held[w], 0);
+    }
+}
+
+// first dirty sector at or after 'sector' that is not held, num_sectors
+// if there is none
+static sector_t next_dirty(sector_t sector)
+{
+    while(sector < num_sectors) {
+	uint64_t bits = dirty[sector / 64];
+	if(held != NULL)
+	    bits &= ~held[sector / 64];
+	bits >>= sector % 64;
+	if(bits != 0)
+	    return sector + __builtin_ctzll(bits);
+	sector = (sector / 64 + 1) * 64;
+    }
+    return num_sectors;
+}
+
+// 1 if a sector from 'from' up to 'to' is held
+static int any_held(sector_t from, sector_t to)
+{
+    for(; held != NULL && from < to; from++) {
+	if(held[from / 64] & (1ULL << (from % 64)))
+	    return 1;
+    }
+    return 0;
+}
+
+// end of the run of sectors to write that starts at the dirty sector
+// 'start': it takes in the dirty sectors after it and clean gaps of up
+// to SAVE_GAP sectors, but never a held sector. *next gets the first
+// dirty sector past the run
+static sector_t run_end(sector_t start, sector_t* next)
+{
+    sector_t end = start + 1;
+    while((*next = next_dirty(end)) < num_sectors && *next - end <= SAVE_GAP && !any_held(end, *next))
+	end = *next + 1;
+    return end;
+}
+
+// mark the runs of a failed Disk_WriteStaged() dirty again
+static void restore_staged()
+{
+    int i;
+
+    for(i = 0; restage && i < num_staged; i++)
+	set_dirty(staged[i].sector, staged[i].count, 1);
+    num_staged = restage = 0;
+}
+
+// make room in the dirty bitmap for a disk of 'sectors' sectors, all
+// of them clean
+static int set_size(sector_t sectors)
+{
+    uint64_t* bits = (uint64_t *) calloc(DIRTY_WORDS(sectors), sizeof(uint64_t));
+    if(bits == NULL) {
+	diskErrno = E_MEM_OP;
+	return -1;
+    }
+    free(dirty);
+    free(held);
+    dirty = bits;
+    held = NULL;
+    num_sectors = sectors;
+    num_staged = restage = 0;
+    num_dirty = 0;
+    return 0;
+}
+
+// drop the current disk, whichever way it is held
+static void release_disk()
+{
+    if(mapped)
+	munmap(disk, (size_t)num_sectors * SECTOR_SIZE);
+    else
+	free(disk);
+    if(image_fd >= 0) {
+	Aio_Close();
+	close(image_fd);
+    }
+    disk = NULL;
+    mapped = 0;
+    image_fd = -1;
+}
+
+// make the disk a shared mapping of the image 'file', whose size gives
+// the number of sectors. Returns -1 if the file cannot be opened and -2
+// if it cannot be mapped (not a whole number of sectors, no mmap
+// support), in which case the current disk is left alone
+static int map_image(char* file)
+{
+    struct stat st;
+    void* p;
+    int fd;
+
+    if((fd = open(file, O_RDWR)) < 0) {
+	diskErrno = E_OPENING_FILE;
+	return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size % SECTOR_SIZE != 0) {
+	close(fd);
+	return -2;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if(p == MAP_FAILED)
+	return -2;
+
+    release_disk();
+    if(set_size(st.st_size / SECTOR_SIZE) == -1) {
+	munmap(p, st.st_size);
+	return -1;
+    }
+    disk = (Sector *) p;
+    mapped = 1;
+    return 0;
+}
+
+// leave the disk in the image 'file' and start an I/O engine on it.
+// Returns -1 if the file cannot be opened and -2 if it is not a whole
+// number of sectors or no engine can be started, in which case the
+// current disk is left alone
+static int open_image(char* file)
+{
+    struct stat st;
+    int fd;
+
+    if((fd = open(file, O_RDWR)) < 0) {
+	diskErrno = E_OPENING_FILE;
+	return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size % SECTOR_SIZE != 0) {
+	close(fd);
+	return -2;
+    }
+
+    release_disk();
+    if(set_size(st.st_size / SECTOR_SIZE) == -1) {
+	close(fd);
+	return -1;
+    }
+    if(Aio_Open(fd, aio_engine, aio_depth) == -1) {
+	close(fd);
+	return -2;
+    }
+    image_fd = fd;
+    return 0;
+}
+
+// move 'count' sectors from 'sector' between the image file and
+// 'buffer', as one request
+static int file_io(int write, sector_t sector, int count, char* buffer)
+{
+    Aio_Request req;
+
+    req.write = write;
+    req.offset = (off_t)sector * SECTOR_SIZE;
+    req.len = (size_t)count * SECTOR_SIZE;
+    req.buffer = buffer;
+    if(Aio_Run(&req, 1) != 0) {
+	diskErrno = write ? E_WRITING_FILE : E_READING_FILE;
+	return -1;
+    }
+    return 0;
+}
+
+// the same for a list of segments, which are all in flight together
+// (up to the queue depth), so they must not overlap
+static int file_iov(int write, const Disk_Segment* segs, int nsegs)
+{
+    Aio_Request reqs[AIO_MAX_DEPTH];
+    int i, n;
+
+    while(nsegs > 0) {
+	n = nsegs < AIO_MAX_DEPTH ? nsegs : AIO_MAX_DEPTH;
+	for(i = 0; i < n; i++) {
+	    reqs[i].write = write;
+	    reqs[i].offset = (off_t)segs[i].sector * SECTOR_SIZE;
+	    reqs[i].len = (size_t)segs[i].count * SECTOR_SIZE;
+	    reqs[i].buffer = segs[i].buffer;
+	}
+	if(Aio_Run(reqs, n) != 0) {
+	    diskErrno = write ? E_WRITING_FILE : E_READING_FILE;
+	    return -1;
+	}
+	segs += n;
+	nsegs -= n;
+    }
+    return 0;
+}
+
+// copy the image file behind the disk to 'file', replacing whatever it
+// held
+static int save_copy(char* file)
+{
+    static char chunk[256 * SECTOR_SIZE];
+    sector_t done, count;
+    int fd;
+
+    if((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	diskErrno = E_OPENING_FILE;
+	return -1;
+    }
+    for(done = 0; done < num_sectors; done += count) {
+	count = num_sectors - done < 256 ? num_sectors - done : 256;
+	if(file_io(0, done, (int)count, chunk) == -1 ||
+	   pwrite(fd, chunk, count * SECTOR_SIZE, (off_t)done * SECTOR_SIZE) != count * SECTOR_SIZE) {
+	    close(fd);
+	    diskErrno = E_WRITING_FILE;
+	    return -1;
+	}
+    }
+    if(((sync_mode & DISK_SYNC_FSYNC) && fdatasync(fd) != 0) || close(fd) != 0) {
+	diskErrno = E_WRITING_FILE;
+	return -1;
+    }
+    __atomic_add_fetch(&stats.full_saves, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.sectors_saved, num_sectors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.save_writes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// schedule the dirty sectors of the mapped image for writeback, or wait
+// for them with DISK_SYNC_FSYNC; DISK_SYNC_FULL covers the whole mapping
+static int save_mapped()
+{
+    long page = sysconf(_SC_PAGESIZE);
+    int flags = (sync_mode & DISK_SYNC_FSYNC) ? MS_SYNC : MS_ASYNC;
+    sector_t start = (sync_mode & DISK_SYNC_FULL) ? 0 : next_dirty(0);
+
+    while(start < num_sectors) {
+	sector_t end, next;
+	if(sync_mode & DISK_SYNC_FULL)
+	    end = next = num_sectors;
+	else
+	    end = run_end(start, &next);
+
+	// msync wants a page-aligned address
+	size_t from = (size_t)start * SECTOR_SIZE / page * page;
+	size_t to = (size_t)end * SECTOR_SIZE;
+	if(msync((char*)disk + from, to - from, flags) != 0) {
+	    diskErrno = E_WRITING_FILE;
+	    return -1;
+	}
+	__atomic_add_fetch(&stats.sectors_saved, end - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.save_writes, 1, __ATOMIC_RELAXED);
+	start = next;
+    }
+    return 0;
+}
+
+// write the whole disk to 'file', replacing whatever it held
+static int save_full(char* file)
+{
+    FILE* diskFile;
+    
+    // open the diskFile
+    if ((diskFile = fopen(file, "w")) == NULL) {
+	diskErrno = E_OPENING_FILE;
+	return -1;
+    }
+    
+    // actually write the disk image to a file
+    if ((fwrite(disk, sizeof(Sector), num_sectors, diskFile)) != (size_t)num_sectors) {
+	fclose(diskFile);
+	diskErrno = E_WRITING_FILE;
+	return -1;
+    }
+    if ((sync_mode & DISK_SYNC_FSYNC) &&
+	(fflush(diskFile) != 0 || fdatasync(fileno(diskFile)) != 0)) {
+	fclose(diskFile);
+	diskErrno = E_WRITING_FILE;
+	return -1;
+    }
+    
+    // clean up and return
+    if (fclose(diskFile) != 0) {
+	diskErrno = E_WRITING_FILE;
+	return -1;
+    }
+    __atomic_add_fetch(&stats.full_saves, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.sectors_saved, num_sectors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.save_writes, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// write only the dirty sectors into the image file 'fd', which already
+// holds everything else
+static int save_dirty(int fd)
+{
+    sector_t start = next_dirty(0);
+
+    while(start < num_sectors) {
+	// extend the run over dirty sectors and short clean gaps
+	sector_t next, end = run_end(start, &next);
+
+	size_t len = (size_t)(end - start) * SECTOR_SIZE;
+	if(pwrite(fd, disk + start, len, (off_t)start * SECTOR_SIZE) != (ssize_t)len) {
+	    diskErrno = E_WRITING_FILE;
+	    return -1;
+	}
+	__atomic_add_fetch(&stats.sectors_saved, end - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.save_writes, 1, __ATOMIC_RELAXED);
+	start = next;
+    }
+    if((sync_mode & DISK_SYNC_FSYNC) && fdatasync(fd) != 0) {
+	diskErrno = E_WRITING_FILE;
+	return -1;
+    }
+    return 0;
+}
 
 /*
  * Disk_Init
  *
- * Initializes the disk area (really just some memory for now).
+ * Initializes the disk area (really just some memory for now) with the
+ * number of sectors last given to Disk_SetSectors().
  *
  * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
  *
@@ -22,70 +539,168 @@ Disk_Error_t diskErrno;
 int Disk_Init()
 {
     // create the disk image and fill every sector with zeroes
-    disk = (Sector *) calloc(NUM_SECTORS, sizeof(Sector));
+    release_disk();
+    if(set_size(init_sectors) == -1)
+	return -1;
+    disk = (Sector *) calloc(num_sectors, sizeof(Sector));
     if(disk == NULL) {
 	diskErrno = E_MEM_OP;
 	return -1;
     }
+
+    // no image file matches this disk yet
+    image[0] = '\0';
     return 0;
 }
 
+/*
+ * Disk_SetSectors
+ *
+ * Sets the number of sectors of the disks made by Disk_Init() from now
+ * on. Disk_Load() always takes the size of the image it loads.
+ */
+int Disk_SetSectors(sector_t count)
+{
+    if(count <= 0 || count > (sector_t)(SIZE_MAX / SECTOR_SIZE)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    init_sectors = count;
+    return 0;
+}
+
+/*
+ * Disk_Sectors
+ *
+ * Returns the number of sectors of the current disk.
+ */
+sector_t Disk_Sectors()
+{
+    return num_sectors;
+}
+
 /*
  * Disk_Save
  *
  * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * will overwrite an existing file with the same name so be careful.
+ * When 'file' is the image last loaded or saved, only the sectors
+ * written since then are rewritten, in place, leaving out any held
+ * with Disk_Hold().
  */
 int Disk_Save(char* file) {
-    FILE* diskFile;
+    struct stat st;
+    int fd, rc;
     
     // error check
     if (file == NULL) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
-    
-    // open the diskFile
-    if ((diskFile = fopen(file, "w")) == NULL) {
-	diskErrno = E_OPENING_FILE;
-	return -1;
+    pthread_mutex_lock(&save_lock);
+    restore_staged();
+
+    // a mapped image only needs its changed pages pushed out, anything
+    // but the known, complete image gets a full copy
+    if (mapped && strcmp(file, image) == 0) {
+	rc = save_mapped();
     }
-    
-    // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
-	fclose(diskFile);
-	diskErrno = E_WRITING_FILE;
-	return -1;
+    else if (image_fd >= 0 && strcmp(file, image) == 0) {
+	// every write already went to the image
+	rc = 0;
+	if ((sync_mode & DISK_SYNC_FSYNC) && fdatasync(image_fd) != 0) {
+	    diskErrno = E_WRITING_FILE;
+	    rc = -1;
+	}
     }
-    
-    // clean up and return
-    fclose(diskFile);
-    return 0;
+    else if (image_fd >= 0) {
+	rc = save_copy(file);
+	if (rc == 0)
+	    open_image(file);
+    }
+    else if (((sync_mode & DISK_SYNC_FULL) && held == NULL) || strcmp(file, image) != 0 ||
+	(fd = open(file, O_WRONLY)) < 0) {
+	rc = save_full(file);
+	// from now on work on the file just written
+	if (rc == 0 && backend == DISK_BACKEND_MMAP)
+	    map_image(file);
+	else if (rc == 0 && backend == DISK_BACKEND_FILE)
+	    open_image(file);
+    }
+    else {
+	if (fstat(fd, &st) != 0 || st.st_size != (off_t)num_sectors * SECTOR_SIZE)
+	    rc = -2;
+	else
+	    rc = save_dirty(fd);
+	if (close(fd) != 0 && rc == 0) {
+	    diskErrno = E_WRITING_FILE;
+	    rc = -1;
+	}
+	if (rc == -2)
+	    rc = save_full(file);
+    }
+    if (rc == 0) {
+	strncpy(image, file, sizeof(image) - 1);
+	clear_dirty();
+	__atomic_add_fetch(&stats.saves, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&save_lock);
+    return rc == 0 ? 0 : -1;
 }
 
 /*
  * Disk_Load
  *
  * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * the disk be created first. The disk takes the size of the image.
  */
 int Disk_Load(char* file) {
     FILE* diskFile;
+    struct stat st;
     
     // error check
     if (file == NULL) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
+
+    // map the image or leave it in its file instead of copying it when
+    // asked to; images that cannot be used that way are read in as usual
+    if (backend == DISK_BACKEND_MMAP || backend == DISK_BACKEND_FILE) {
+	int rc = backend == DISK_BACKEND_MMAP ? map_image(file) : open_image(file);
+	if (rc == -1)
+	    return -1;
+	if (rc == 0) {
+	    strncpy(image, file, sizeof(image) - 1);
+	    return 0;
+	}
+    }
     
     // open the diskFile
     if ((diskFile = fopen(file, "r")) == NULL) {
 	diskErrno = E_OPENING_FILE;
 	return -1;
     }
+    if (fstat(fileno(diskFile), &st) != 0 || st.st_size <= 0 || st.st_size % SECTOR_SIZE != 0) {
+	fclose(diskFile);
+	diskErrno = E_READING_FILE;
+	return -1;
+    }
+
+    // resize the disk to the image, never reading over a mapped image
+    if (mapped || image_fd >= 0 || num_sectors != st.st_size / SECTOR_SIZE) {
+	sector_t saved = init_sectors;
+	init_sectors = st.st_size / SECTOR_SIZE;
+	int rc = Disk_Init();
+	init_sectors = saved;
+	if (rc == -1) {
+	    fclose(diskFile);
+	    return -1;
+	}
+    }
     
     // actually read the disk image into memory
-    if ((fread(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
+    if ((fread(disk, sizeof(Sector), num_sectors, diskFile)) != (size_t)num_sectors) {
 	fclose(diskFile);
 	diskErrno = E_READING_FILE;
 	return -1;
@@ -93,6 +708,8 @@ int Disk_Load(char* file) {
     
     // clean up and return
     fclose(diskFile);
+    strncpy(image, file, sizeof(image) - 1);
+    clear_dirty();
     return 0;
 }
 
@@ -102,12 +719,15 @@ int Disk_Load(char* file) {
  * Reads a single sector from "disk" and puts it into a buffer provided
  * by the user.
  */
-int Disk_Read(int sector, char* buffer) {
+int Disk_Read(sector_t sector, char* buffer) {
     // quick error checks
-    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
+    if ((sector < 0) || (sector >= num_sectors) || (buffer == NULL)) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
+    request_range(0, sector, 1);
+    if (image_fd >= 0)
+	return file_io(0, sector, 1, buffer);
     
     // copy the memory for the user
     if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(Sector))) == NULL) {
@@ -123,19 +743,492 @@ int Disk_Read(int sector, char* buffer) {
  *
  * Writes a single sector from memory to "disk".
  */
-int Disk_Write(int sector, char* buffer) 
+int Disk_Write(sector_t sector, char* buffer) 
 {
     // quick error checks
-    if((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
+    if((sector < 0) || (sector >= num_sectors) || (buffer == NULL)) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
+    request_range(1, sector, 1);
+    if(image_fd >= 0)
+	return file_io(1, sector, 1, buffer);
     
     // copy the memory for the user
     if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(Sector))) == NULL) {
 	diskErrno = E_MEM_OP;
 	return -1;
     }
+    mark_dirty(sector, 1);
+    return 0;
+}
+
+/*
+ * Disk_ReadRange
+ *
+ * Reads 'count' consecutive sectors starting at 'sector' into a buffer
+ * provided by the user, in one copy.
+ */
+int Disk_ReadRange(sector_t sector, int count, char* buffer) {
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (count > num_sectors - sector) || (buffer == NULL)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    request_range(0, sector, count);
+    if (image_fd >= 0)
+	return file_io(0, sector, count, buffer);
+    
+    // copy the memory for the user
+    if((memcpy((void*)buffer, (void*)(disk + sector), (size_t)count * sizeof(Sector))) == NULL) {
+	diskErrno = E_MEM_OP;
+	return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Disk_WriteRange
+ *
+ * Writes 'count' consecutive sectors starting at 'sector' from memory
+ * to "disk", in one copy.
+ */
+int Disk_WriteRange(sector_t sector, int count, char* buffer) 
+{
+    // quick error checks
+    if((sector < 0) || (count < 0) || (count > num_sectors - sector) || (buffer == NULL)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    request_range(1, sector, count);
+    if(image_fd >= 0)
+	return file_io(1, sector, count, buffer);
+    
+    // copy the memory for the user
+    if((memcpy((void*)(disk + sector), (void*)buffer, (size_t)count * sizeof(Sector))) == NULL) {
+	diskErrno = E_MEM_OP;
+	return -1;
+    }
+    mark_dirty(sector, count);
+    return 0;
+}
+
+// 1 if every segment lies on the disk and has a buffer
+static int segments_valid(const Disk_Segment* segs, int nsegs)
+{
+    int i;
+
+    if((nsegs < 0) || (segs == NULL && nsegs > 0))
+	return 0;
+    for(i = 0; i < nsegs; i++) {
+	if((segs[i].sector < 0) || (segs[i].count < 0) ||
+	   (segs[i].count > num_sectors - segs[i].sector) || (segs[i].buffer == NULL))
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Scatter read: fills each segment's buffer with its run of sectors.
+ * Every segment is checked before anything is copied, so either all of
+ * them are read or none is.
+ */
+int Disk_ReadV(const Disk_Segment* segs, int nsegs)
+{
+    int i;
+
+    // quick error checks
+    if(!segments_valid(segs, nsegs)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    request(0, segs, nsegs);
+    if(image_fd >= 0)
+	return file_iov(0, segs, nsegs);
+
+    for(i = 0; i < nsegs; i++)
+	memcpy((void*)segs[i].buffer, (void*)(disk + segs[i].sector), (size_t)segs[i].count * sizeof(Sector));
+    return 0;
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Gather write: stores each segment's buffer in its run of sectors.
+ * Segments must not overlap (with DISK_BACKEND_FILE they are written
+ * concurrently). Like Disk_ReadV() it does nothing unless every segment
+ * is valid.
+ */
+int Disk_WriteV(const Disk_Segment* segs, int nsegs)
+{
+    int i;
+
+    // quick error checks
+    if(!segments_valid(segs, nsegs)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    request(1, segs, nsegs);
+    if(image_fd >= 0)
+	return file_iov(1, segs, nsegs);
+
+    for(i = 0; i < nsegs; i++) {
+	memcpy((void*)(disk + segs[i].sector), (void*)segs[i].buffer, (size_t)segs[i].count * sizeof(Sector));
+	mark_dirty(segs[i].sector, segs[i].count);
+    }
+    return 0;
+}
+
+/*
+ * Disk_View
+ *
+ * Returns where 'count' consecutive sectors starting at 'sector' live
+ * in memory, for callers that read them without copying. The pointer
+ * stays valid until the disk is initialized or loaded again. Returns
+ * NULL with DISK_BACKEND_FILE, where the sectors are not in memory.
+ */
+char* Disk_View(sector_t sector, int count)
+{
+    // quick error checks
+    if((sector < 0) || (count < 0) || (count > num_sectors - sector) || (image_fd >= 0)) {
+	diskErrno = E_INVALID_PARAM;
+	return NULL;
+    }
+    return (char*)(disk + sector);
+}
+
+/*
+ * Disk_SetSyncMode
+ *
+ * Chooses how Disk_Save() writes the image, see the DISK_SYNC_* flags.
+ * The default (0) writes only the changed sectors and leaves flushing
+ * them to stable storage to the operating system. A save in progress
+ * finishes with the mode it started with.
+ */
+void Disk_SetSyncMode(int flags)
+{
+    pthread_mutex_lock(&save_lock);
+    sync_mode = flags;
+    pthread_mutex_unlock(&save_lock);
+}
+
+/*
+ * Disk_SetDelay
+ *
+ * Makes every read or write request take 'us' microseconds longer, like
+ * a request to a slow device would. A call for one sector or a range is
+ * one request; a scatter/gather list is one per run of consecutive
+ * sectors in it. 0, the default, adds nothing.
+ */
+int Disk_SetDelay(int us)
+{
+    if(us < 0) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    delay_us = us;
     return 0;
 }
 
+/*
+ * Disk_SetModel
+ *
+ * Costs every request with a timing model, adding the time to the
+ * model_ns statistic and, with model->sleep, also taking it for real.
+ * DISK_MODEL_HDD charges a request that does not start where the last
+ * one ended a seek, growing with the square root of the distance, and
+ * half a revolution; DISK_MODEL_SSD a fixed latency per request, with
+ * the runs of one scatter/gather call overlapping 'channels' at a time.
+ * Both add the transfer time of the sectors. NULL or DISK_MODEL_NONE
+ * turns the model off. See Disk_ModelDefaults() for typical values.
+ */
+int Disk_SetModel(const Disk_Model* m)
+{
+    if(m != NULL && m->type != DISK_MODEL_NONE &&
+       ((m->type != DISK_MODEL_HDD && m->type != DISK_MODEL_SSD) || m->transfer_mb_s <= 0 ||
+	(m->type == DISK_MODEL_HDD && (m->rpm <= 0 || m->seek_min_us < 0 || m->seek_max_us < m->seek_min_us)) ||
+	(m->type == DISK_MODEL_SSD && (m->read_us < 0 || m->write_us < 0 || m->channels < 1)))) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    pthread_mutex_lock(&model_lock);
+    if(m == NULL)
+	memset(&model, 0, sizeof(model));
+    else
+	model = *m;
+    __atomic_store_n(&model_on, model.type != DISK_MODEL_NONE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&model_lock);
+    return 0;
+}
+
+/*
+ * Disk_ModelDefaults
+ *
+ * Fills 'm' with a model of a 7200 rpm SATA disk (DISK_MODEL_HDD) or a
+ * SATA flash disk (DISK_MODEL_SSD), without sleeping; anything else
+ * gives DISK_MODEL_NONE.
+ */
+void Disk_ModelDefaults(int type, Disk_Model* m)
+{
+    memset(m, 0, sizeof(*m));
+    if(type == DISK_MODEL_HDD) {
+	m->type = DISK_MODEL_HDD;
+	m->transfer_mb_s = 150;
+	m->seek_min_us = 500;
+	m->seek_max_us = 15000;
+	m->rpm = 7200;
+    }
+    else if(type == DISK_MODEL_SSD) {
+	m->type = DISK_MODEL_SSD;
+	m->transfer_mb_s = 500;
+	m->read_us = 80;
+	m->write_us = 30;
+	m->channels = 8;
+    }
+}
+
+/*
+ * Disk_SetBackend
+ *
+ * Chooses how the next Disk_Load() holds the disk: DISK_BACKEND_MEMORY
+ * reads the image into memory, DISK_BACKEND_MMAP maps it MAP_SHARED so
+ * loading costs the same whatever the image size and Disk_Save() only
+ * has to msync() the changed pages, DISK_BACKEND_FILE keeps it in the
+ * image file and does every read and write there (Disk_Save() then only
+ * has to fdatasync() it, if anything). Returns -1 for an unknown backend.
+ */
+int Disk_SetBackend(int which)
+{
+    if(which != DISK_BACKEND_MEMORY && which != DISK_BACKEND_MMAP && which != DISK_BACKEND_FILE) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    backend = which;
+    return 0;
+}
+
+/*
+ * Disk_SetAio
+ *
+ * Chooses the I/O engine (DISK_AIO_*) and queue depth DISK_BACKEND_FILE
+ * uses from the next Disk_Load() on; a depth that is not positive means
+ * the default. Returns -1 for an unknown engine.
+ */
+int Disk_SetAio(int engine, int depth)
+{
+    if(engine != DISK_AIO_AUTO && engine != DISK_AIO_URING && engine != DISK_AIO_THREADS) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    aio_engine = engine;
+    aio_depth = depth > 0 ? depth : AIO_DEFAULT_DEPTH;
+    return 0;
+}
+
+/*
+ * Disk_AioEngine
+ *
+ * Returns the engine moving the sectors of a DISK_BACKEND_FILE disk
+ * (DISK_AIO_URING or DISK_AIO_THREADS), 0 when the disk is in memory.
+ */
+int Disk_AioEngine()
+{
+    return image_fd >= 0 ? Aio_Engine() : 0;
+}
+
+/*
+ * Disk_Hold
+ *
+ * Keeps 'count' sectors from 'sector' out of the image: Disk_Save()
+ * skips them (they stay dirty) until Disk_ReleaseHolds(). This lets a
+ * journal get its copy of them to the image first. Only the in-memory
+ * backend can do this, since mmap and file backends write through;
+ * returns -1 there (a 'count' of 0 just asks).
+ */
+int Disk_Hold(sector_t sector, int count)
+{
+    // quick error checks
+    if((sector < 0) || (count < 0) || (count > num_sectors - sector) || mapped || (image_fd >= 0)) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    if(count == 0)
+	return 0;
+
+    if(held == NULL && (held = (uint64_t *) calloc(DIRTY_WORDS(num_sectors), sizeof(uint64_t))) == NULL) {
+	diskErrno = E_MEM_OP;
+	return -1;
+    }
+    for(; count > 0; sector++, count--)
+	held[sector / 64] |= 1ULL << (sector % 64);
+    return 0;
+}
+
+/*
+ * Disk_ReleaseHolds
+ *
+ * Lets the next Disk_Save() write every held sector that changed.
+ */
+void Disk_ReleaseHolds()
+{
+    free(held);
+    held = NULL;
+}
+
+/*
+ * Disk_Stage
+ *
+ * First half of a save made in the background: takes up to about 'max'
+ * of the sectors the image last loaded or saved lacks (never held ones)
+ * out of the dirty bitmap and, with the in-memory backend, copies them,
+ * so the disk can be written again while Disk_WriteStaged() writes
+ * them out. Call it with the same lock that covers Disk_Write(), and
+ * always follow it with Disk_WriteStaged(): Disk_Save() waits for that.
+ * Returns the number of sectors staged, or -1 (then Disk_WriteStaged()
+ * must not be called).
+ */
+sector_t Disk_Stage(sector_t max)
+{
+    sector_t start, end, next, total = 0;
+    int i;
+
+    if(max <= 0) {
+	diskErrno = E_INVALID_PARAM;
+	return -1;
+    }
+    pthread_mutex_lock(&save_lock);
+    restore_staged();
+
+    // the file backend has nothing to stage, and nothing can be saved
+    // in place before there is an image
+    if(image_fd >= 0 || image[0] == '\0')
+	return 0;
+
+    for(start = next_dirty(0); start < num_sectors && total < max; start = next) {
+	end = run_end(start, &next);
+	if(num_staged == staged_cap) {
+	    int cap = staged_cap ? 2 * staged_cap : 64;
+	    Disk_Segment* grown = (Disk_Segment *) realloc(staged, cap * sizeof(Disk_Segment));
+	    if(grown == NULL)
+		break;
+	    staged = grown;
+	    staged_cap = cap;
+	}
+	staged[num_staged++] = (Disk_Segment){ start, (int)(end - start), (char*)(disk + start) };
+	total += end - start;
+    }
+
+    // a mapping is written back from where it is, memory from a copy
+    if(!mapped && total > 0 && (size_t)total * SECTOR_SIZE > stage_size) {
+	char* grown = (char *) realloc(stage_buf, (size_t)total * SECTOR_SIZE);
+	if(grown == NULL) {
+	    num_staged = 0;
+	    pthread_mutex_unlock(&save_lock);
+	    diskErrno = E_MEM_OP;
+	    return -1;
+	}
+	stage_buf = grown;
+	stage_size = (size_t)total * SECTOR_SIZE;
+    }
+    for(i = 0, total = 0; i < num_staged; i++) {
+	if(!mapped) {
+	    memcpy(stage_buf + total * SECTOR_SIZE, staged[i].buffer, (size_t)staged[i].count * SECTOR_SIZE);
+	    staged[i].buffer = stage_buf + total * SECTOR_SIZE;
+	}
+	set_dirty(staged[i].sector, staged[i].count, 0);
+	total += staged[i].count;
+    }
+    return total;
+}
+
+/*
+ * Disk_WriteStaged
+ *
+ * Second half of a background save: writes what Disk_Stage() took to
+ * the image (msyncs it for a mapped one), adds an fdatasync with
+ * DISK_SYNC_FSYNC, and lets the next save go. Needs no lock. If it
+ * fails the staged sectors count as unsaved again.
+ */
+int Disk_WriteStaged()
+{
+    struct stat st;
+    int i, fd = -1, rc = 0;
+    long written = 0;
+
+    if(mapped) {
+	long page = sysconf(_SC_PAGESIZE);
+	int flags = (sync_mode & DISK_SYNC_FSYNC) ? MS_SYNC : MS_ASYNC;
+	for(i = 0; i < num_staged && rc == 0; i++) {
+	    size_t from = (size_t)(staged[i].buffer - (char*)disk) / page * page;
+	    size_t to = (size_t)(staged[i].sector + staged[i].count) * SECTOR_SIZE;
+	    rc = msync((char*)disk + from, to - from, flags);
+	}
+    }
+    else if(num_staged > 0) {
+	// the image must still be the one the dirty bitmap is about
+	if((fd = open(image, O_WRONLY)) < 0 || fstat(fd, &st) != 0 ||
+	   st.st_size != (off_t)num_sectors * SECTOR_SIZE)
+	    rc = -1;
+	for(i = 0; i < num_staged && rc == 0; i++) {
+	    size_t len = (size_t)staged[i].count * SECTOR_SIZE;
+	    if(pwrite(fd, staged[i].buffer, len, (off_t)staged[i].sector * SECTOR_SIZE) != (ssize_t)len)
+		rc = -1;
+	}
+	if(rc == 0 && (sync_mode & DISK_SYNC_FSYNC) && fdatasync(fd) != 0)
+	    rc = -1;
+	if(fd >= 0 && close(fd) != 0)
+	    rc = -1;
+    }
+    else if(image_fd >= 0 && (sync_mode & DISK_SYNC_FSYNC))
+	rc = fdatasync(image_fd);
+
+    if(rc == 0) {
+	for(i = 0; i < num_staged; i++)
+	    written += staged[i].count;
+	__atomic_add_fetch(&stats.sectors_saved, written, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.save_writes, num_staged, __ATOMIC_RELAXED);
+	num_staged = 0;
+    }
+    else {
+	restage = 1;
+	diskErrno = E_WRITING_FILE;
+    }
+    pthread_mutex_unlock(&save_lock);
+    return rc == 0 ? 0 : -1;
+}
+
+/*
+ * Disk_Dirty
+ *
+ * Returns how many sectors the image file lacks, those written since it
+ * was last loaded or saved. Call it with the lock that covers
+ * Disk_Write().
+ */
+sector_t Disk_Dirty()
+{
+    return num_dirty;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies the save, request and seek counters and the modelled time into
+ * 'out'.
+ */
+void Disk_GetStats(Disk_Stats* out)
+{
+    out->saves = __atomic_load_n(&stats.saves, __ATOMIC_RELAXED);
+    out->full_saves = __atomic_load_n(&stats.full_saves, __ATOMIC_RELAXED);
+    out->sectors_saved = __atomic_load_n(&stats.sectors_saved, __ATOMIC_RELAXED);
+    out->save_writes = __atomic_load_n(&stats.save_writes, __ATOMIC_RELAXED);
+    out->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    out->sectors_read = __atomic_load_n(&stats.sectors_read, __ATOMIC_RELAXED);
+    out->sectors_written = __atomic_load_n(&stats.sectors_written, __ATOMIC_RELAXED);
+    out->seeks = __atomic_load_n(&stats.seeks, __ATOMIC_RELAXED);
+    out->seek_sectors = __atomic_load_n(&stats.seek_sectors, __ATOMIC_RELAXED);
+    out->model_ns = __atomic_load_n(&stats.model_ns, __ATOMIC_RELAXED);
+}
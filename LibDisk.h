@@ -1,9 +1,18 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk. Allows user to read and write to the
+// disk just as if it was dealing with sectors. Requests take no time
+// unless Disk_SetDelay() adds a fixed latency or Disk_SetModel() picks a
+// timing model of a hard disk or an SSD
 //
+// The disk is normally held in memory (copied from the image or mapped).
+// DISK_BACKEND_FILE leaves it in the image file instead and moves the
+// sectors with asynchronous I/O (see LibAio.h), for images on real
+// storage.
+//
+// The disk itself takes no locks: LibCache serializes the calls made
+// while the file system is running.
 //
 
 #ifndef __Disk_H__
@@ -12,10 +21,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 
 // a few disk parameters
 #define SECTOR_SIZE  512
-#define NUM_SECTORS  10000 
+#define NUM_SECTORS  10000  // size of a disk made by Disk_Init() unless Disk_SetSectors() says otherwise
+
+// sector numbers are 64-bit so images can be larger than 2^31 bytes
+typedef int64_t sector_t;
 
 // disk errors
 typedef enum {
@@ -30,12 +43,86 @@ typedef struct sector {
   char data[SECTOR_SIZE];
 } Sector;
 
-extern Disk_Error_t diskErrno; // used to see what happened w/ disk ops
+// one piece of a scatter/gather transfer: 'count' sectors starting at
+// 'sector', to or from 'buffer'
+typedef struct disk_segment {
+  sector_t sector;
+  int count;
+  char* buffer;
+} Disk_Segment;
+
+// Disk_SetSyncMode() flags
+#define DISK_SYNC_FULL   1  // Disk_Save() always rewrites the whole image
+#define DISK_SYNC_FSYNC  2  // Disk_Save() waits for the data to reach stable storage
+
+// Disk_SetBackend() choices
+#define DISK_BACKEND_MEMORY 0  // the image is copied into memory (default)
+#define DISK_BACKEND_MMAP   1  // the image is mapped MAP_SHARED
+#define DISK_BACKEND_FILE   2  // the image stays in its file, io_uring or threads move the sectors
+
+// Disk_SetAio() engines, the same values as LibAio's AIO_*
+#define DISK_AIO_AUTO    0  // io_uring if the kernel allows it, a pread/pwrite thread pool otherwise
+#define DISK_AIO_URING   1
+#define DISK_AIO_THREADS 2
+
+// Disk_SetModel() timing models
+#define DISK_MODEL_NONE 0  // requests take no simulated time (default)
+#define DISK_MODEL_HDD  1  // seek over the distance from the last request, half a turn, transfer
+#define DISK_MODEL_SSD  2  // fixed latency per request, 'channels' of them served at once, transfer
+
+typedef struct disk_model {
+  int type;              // DISK_MODEL_*
+  int sleep;             // 1 makes every request also take its simulated time for real
+  double transfer_mb_s;  // media rate, both models
+  double seek_min_us;    // HDD: seek to a neighbouring track
+  double seek_max_us;    // ... across the whole disk, sqrt of the distance in between
+  int rpm;               // ... rotation speed, a request that seeks waits half a turn
+  double read_us;        // SSD: latency of a read request
+  double write_us;       // ... of a write request
+  int channels;          // ... requests of one call served in parallel
+} Disk_Model;
+
+// used for statistics
+typedef struct disk_stats {
+  long saves;          // Disk_Save() calls that succeeded
+  long full_saves;     // ... of which rewrote the whole image
+  long sectors_saved;  // sectors written to image files
+  long save_writes;    // write calls issued for them
+  long reads;          // read requests (a scatter/gather call makes one per run of consecutive sectors)
+  long writes;         // write requests
+  long sectors_read;
+  long sectors_written;
+  long seeks;          // requests not starting where the one before ended
+  long seek_sectors;   // distance they covered
+  long model_ns;       // time the requests took in the timing model
+} Disk_Stats;
+
+extern _Thread_local Disk_Error_t diskErrno; // used to see what happened w/ disk ops, one per thread
 
 int Disk_Init();
+int Disk_SetSectors(sector_t count);
+sector_t Disk_Sectors();
 int Disk_Save(char* file);
 int Disk_Load(char* file);
-int Disk_Write(int sector, char* buffer);
-int Disk_Read(int sector, char* buffer);
+int Disk_Write(sector_t sector, char* buffer);
+int Disk_Read(sector_t sector, char* buffer);
+int Disk_ReadRange(sector_t sector, int count, char* buffer);
+int Disk_WriteRange(sector_t sector, int count, char* buffer);
+int Disk_ReadV(const Disk_Segment* segs, int nsegs);
+int Disk_WriteV(const Disk_Segment* segs, int nsegs);
+char* Disk_View(sector_t sector, int count);
+void Disk_SetSyncMode(int flags);
+int Disk_SetDelay(int us);
+int Disk_SetModel(const Disk_Model* model);
+void Disk_ModelDefaults(int type, Disk_Model* model);
+int Disk_SetBackend(int which);
+int Disk_SetAio(int engine, int depth);
+sector_t Disk_Stage(sector_t max);
+int Disk_WriteStaged();
+sector_t Disk_Dirty();
+int Disk_Hold(sector_t sector, int count);
+void Disk_ReleaseHolds();
+int Disk_AioEngine();
+void Disk_GetStats(Disk_Stats* stats);
 
 #endif // __Disk_H__
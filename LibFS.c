@@ -1,5 +1,6 @@
 #include "LibFS.h"          // Include header file for virtual file system
 #include "LibDisk.h"        // Include header file for virtual disk
+#include "LibCache.h"       // Include header file for the sector buffer cache
 #include <stdio.h>          // Include standard input-output library for standard I/O operations
 #include <stdlib.h>         // Include standard library for memory allocation and other utilities
 #include <string.h>         // Include string library for string manipulation functions
@@ -7,52 +8,168 @@
 #include <math.h>           // Include math library for mathematical functions
 #include <assert.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // Define constants
 #define MAX_PATH 256
 #define MAX_NAME 16
-#define MAX_OPEN_FILES 256
-#define MAX_FILES 1000
-#define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
-#define MAX_SECTORS_PER_FILE 30
+#define MAX_OPEN_FILES (1 << 20)    // descriptors the open file table can grow to
+#define FD_CHUNK 1024               // descriptors added to the table at a time
+#define MAX_FILES 1000              // inodes of a newly formatted disk unless FS_OPT_INODES says otherwise
+#define MAX_SECTORS_PER_FILE 30     // sectors a linear directory can use for its entries
+#define NUM_DIRECT_EXTENTS 14       // extents held in a file's inode
+#define EXTENTS_PER_SECTOR (SECTOR_SIZE/sizeof(extent_t))   // extents in an indirect block
+#define POINTERS_PER_SECTOR (SECTOR_SIZE/sizeof(sector_t))  // indirect blocks a double-indirect block points at
+#define MAX_EXTENTS (NUM_DIRECT_EXTENTS + EXTENTS_PER_SECTOR + POINTERS_PER_SECTOR*EXTENTS_PER_SECTOR)
 #define MAGIC_NUMBER 7777 //predefined magic number
-
-//initializing all sectors predefined values
+#define FS_VERSION 6                // on-disk format version, bumped whenever the layout changes
+#define IO_SEGMENTS 64              // sector runs gathered into one scatter/gather disk call
+#define JOURNAL_MAGIC 0x4a524e4c    // header sector of the journal ("JRNL")
+#define JOURNAL_DESC 0x4a445343     // descriptor sector opening part of a transaction
+#define JOURNAL_COMMIT 0x4a434d54   // commit sector closing a transaction
+#define JOURNAL_HOMES ((SECTOR_SIZE - 24) / sizeof(sector_t)) // home sectors listed per descriptor
+#define JOURNAL_MIN_SECTORS 16      // smallest journal FS_OPT_JOURNAL_SECTORS accepts
+
+// the disk layout is worked out at FS_Boot() from the geometry in the
+// superblock (see layout_init()); these names read the result
 #define SUPERBLOCK_START_SECTOR 0                   // superblock containing magic number
 
-
 #define INODE_BITMAP_START_SECTOR 1                 //bitmap of inodes starting at sector 1
-#define INODE_BITMAP_SIZE ((MAX_FILES+7)/8)
-#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
-
-
-#define SECTOR_BITMAP_START_SECTOR (INODE_BITMAP_START_SECTOR+INODE_BITMAP_SECTORS)
-#define SECTOR_BITMAP_SIZE ((NUM_SECTORS+7)/8)    //gets ceil value of max bits required for sectors
-#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE) //total sectors for bitmap of sectors
+#define INODE_BITMAP_SECTORS (layout.inode_bitmap_sectors)
 
+#define SECTOR_BITMAP_START_SECTOR (layout.sector_bitmap_start)
+#define SECTOR_BITMAP_SECTORS (layout.sector_bitmap_sectors) //total sectors for bitmap of sectors
 
-#define INODE_TABLE_START_SECTOR (SECTOR_BITMAP_START_SECTOR+SECTOR_BITMAP_SECTORS) //start of inode sector
+#define INODE_TABLE_START_SECTOR (layout.inode_table_start) //start of inode sector
 #define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))
-#define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
+#define INODE_TABLE_SECTORS (layout.inode_table_sectors)
 
+#define JOURNAL_START_SECTOR (layout.journal_start)  // journal header, the log follows it
+#define JOURNAL_SECTORS (layout.journal_sectors)
 
-#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+#define DATABLOCK_START_SECTOR (layout.data_start)
 
 
 #define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
 
+#define DIR_SLOTS_PER_PAGE (SECTOR_SIZE/sizeof(sector_t))  // slots of a hashed directory's table in a sector
+#define DIR_DIRECT_PAGES 16         // table sectors held in a hashed directory's inode, the rest are indirect
+#define DIR_MAX_DEPTH 18            // a hashed directory's table stops doubling at 2^18 slots, full buckets then chain
+#define DIRENTS_PER_BUCKET ((SECTOR_SIZE-sizeof(sector_t)-sizeof(short)-2)/sizeof(dirent_t))
+
+#define ICACHE_CHUNK 512            // in-core inodes added to the table at a time
+#define ICACHE_MAX_CHUNKS (MAX_OPEN_FILES / ICACHE_CHUNK + 1) // enough for every descriptor open on a file of its own
+
+#define DCACHE_SIZE 1024            // path components remembered by follow_path()
+#define DCACHE_BUCKETS 2048         // hash buckets for the dentry cache
+
+#define READAHEAD_MIN 8             // sectors in the first readahead window of a stream
+#define READAHEAD_DEFAULT 64        // largest window when the disk is not in memory
+
+#define DELALLOC_DEFAULT 128        // blocks a file may keep unallocated unless FS_OPT_DELALLOC says otherwise
+
+// how much is traced, fixed when this file is compiled (make TRACE=n):
+// trace points above FS_TRACE_LEVEL are constant-false ifs that leave no
+// code behind, though their arguments are still type checked
+#define TRACE_ERRORS 1              // failures of the disk, the journal or a boot, as text on stdout
+#define TRACE_CALLS 2               // ... and every call as binary events, see FS_TraceSave()
+#define TRACE_STEPS 3               // ... and the steps inside the calls (FS_Event_t)
+#define TRACE_TEXT 4                // ... and text about everything the calls do
+#ifndef FS_TRACE_LEVEL
+#define FS_TRACE_LEVEL TRACE_ERRORS
+#endif
+#define TRACE_RING_EVENTS 8192      // binary events kept per thread, a power of two
+
+#define fs_log(level, ...) \
+    do { if((level) <= FS_TRACE_LEVEL) printf(__VA_ARGS__); } while(0)
+#define trace(level, phase, event, inode, sector, arg) \
+    do { if((level) <= FS_TRACE_LEVEL) trace_event(phase, event, inode, sector, arg); } while(0)
+
+static void trace_event(char phase, int event, int inode, long sector, long arg);
+
 //Global Variables
-int osErrno;
+_Thread_local int osErrno;
 static char filesys_name[1024];
+static int cache_sectors = CACHE_DEFAULT_SECTORS; // capacity of the buffer cache
+static int dcache_enabled = 1;                    // 0 makes follow_path() scan every directory
+static int dir_format = FS_DIR_HASHED;            // format given to new directories
+static int disk_sync_mode = 0;                    // DISK_SYNC_* flags used by FS_Sync()
+static int format_inodes = MAX_FILES;             // inodes given to a disk FS_Boot() formats
+static int format_journal = 0;                    // journal sectors given to a disk FS_Boot() formats
+static int disk_backend = FS_DISK_MEMORY;         // FS_OPT_DISK_BACKEND
+static int checkpoint_ms = 1000;                  // background checkpoint period, 0 for none
+static int writeback_ms = 0;                      // background writeback period, 0 for none
+static int writeback_dirty = 0;                   // percent of the disk unsaved that starts writeback, 0 for no limit
+static int readahead_max = -1;                    // largest readahead window in sectors, 0 for none, -1 to decide at boot
+static int readahead_window;                      // the one in use
+static int delalloc_max = DELALLOC_DEFAULT;       // blocks a file may keep unallocated, 0 for no delayed allocation
+static int delalloc_blocks;                       // the limit in use
+
+// locking, outermost first: fs_lock (shared by every call, exclusive for
+// FS_Boot() and FS_Sync()), then in-core inode locks (a directory before
+// the entries in it), then the leaf locks of the inode table, dentry
+// cache, open file table and bitmaps, and finally the buffer cache's
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 
 /*****************REQUIRED STRUCTURES************************/
 
+//structure for superblock
+typedef struct superblock {
+    int magic;        // MAGIC_NUMBER
+    int version;      // FS_VERSION of the code that formatted the disk
+    int sector_size;  // SECTOR_SIZE of the code that formatted the disk
+    int inodes;       // size of the inode table
+    sector_t sectors; // size of the disk
+    int journal_sectors; // size of the journal, 0 if the disk has none
+} superblock_t;
+
+// where everything lives on the mounted disk, derived from its geometry
+typedef struct layout {
+    sector_t sectors;               // disk size
+    int inodes;                     // inode table size
+    sector_t inode_bitmap_sectors;
+    sector_t sector_bitmap_start;
+    sector_t sector_bitmap_sectors;
+    sector_t inode_table_start;
+    sector_t inode_table_sectors;
+    sector_t journal_start;
+    sector_t journal_sectors;
+    sector_t data_start;            // first sector handed out to files and directories
+} layout_t;
+static layout_t layout;
+
+//run of consecutive sectors holding consecutive blocks of a file
+typedef struct extent {
+    sector_t start; // first sector of the run
+    int length;     // number of sectors in the run
+} extent_t;
+
 //structure for inode
 typedef struct inode {
     int size; // the size of the file or number of directory entries
-    int type; // 0 regular; 1 directory
-    int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
+    int type; // 0 regular; 1 linear directory (FS_DIR_LINEAR); 2 hashed directory (FS_DIR_HASHED)
+    union {
+        sector_t data[MAX_SECTORS_PER_FILE]; // linear directories: indices to sectors containing entries
+        struct {
+            int depth;          // the table has 2^depth slots
+            sector_t pages[DIR_DIRECT_PAGES]; // its first sectors; pages[0] is 0 until the first entry
+            sector_t indirect;  // sector of pointers to sectors of pointers to the pages after those
+        } hash;             // hashed directories: extendible hash table
+        struct {
+            int nextents;       // extents in use, counting those in indirect blocks
+            sector_t indirect;  // sector of EXTENTS_PER_SECTOR more extents (0 if none)
+            sector_t dindirect; // sector of pointers to further indirect blocks (0 if none)
+            extent_t extents[NUM_DIRECT_EXTENTS]; // first file blocks, in order
+        } map;              // regular files: block map
+    };
 } inode_t;
 
 
@@ -62,33 +179,195 @@ typedef struct dirent {
     int inode; // inode of the file
 } dirent_t;
 
+// bucket of a hashed directory, one sector
+typedef struct dir_bucket {
+    sector_t next; // overflow sector, only for buckets DIR_MAX_DEPTH deep; 0 ends the chain
+    short count;   // slots in use
+    char depth;    // local depth: every entry's hash ends in the same 'depth' bits
+    char free;     // no slot below this one is free
+    dirent_t entries[DIRENTS_PER_BUCKET]; // free slots have an empty name
+} dir_bucket_t;
+
+// in-core copy of an inode; 'd' must stay the first member so an
+// inode_t* handed out by get_inode() can be turned back into its entry
+typedef struct icache_entry {
+    inode_t d;   // the inode itself
+    int inum;    // inode number (-1 means entry not used)
+    int refs;    // get_inode() calls not yet matched by put_inode()
+    int dirty;   // 1 if 'd' differs from the inode table
+    int ref;     // CLOCK reference bit
+    int next;    // next entry in the same hash chain (-1 ends it)
+    unsigned int map_gen;  // bumped whenever the block map changes
+    int opens;             // descriptors open on the inode
+    pthread_rwlock_t lock; // held while 'd' is read or changed, see inode_lock()
+    char* delayed;         // contents of the file's last 'ndelayed' blocks, which have no sectors yet
+    int ndelayed;
+    int delayed_cap;       // blocks 'delayed' has room for
+} icache_entry_t;
+// the in-core inode table grows ICACHE_CHUNK entries at a time once
+// three quarters of it are pinned; chunks never move, so the inode_t*
+// handed out by get_inode() stay valid
+static icache_entry_t* icache_chunks[ICACHE_MAX_CHUNKS];
+static int icache_size;         // entries in the chunks
+static int icache_pinned;       // ... with refs > 0
+static int* icache_buckets;     // hash chains, a power of two of them
+static int icache_nbuckets;
+static int icache_hand;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER; // entries, chains and the hand, not 'd'
+
+// cached result of looking up 'name' in directory 'parent'; inode -1
+// is a negative entry (the name is known not to exist)
+typedef struct dcache_entry {
+    int parent;            // directory inode (-1 means entry not used)
+    char name[MAX_NAME];   // component name
+    int inode;             // child inode, or -1
+    int ref;               // CLOCK reference bit
+    int next;              // next entry in the same hash chain (-1 ends it)
+} dcache_entry_t;
+static dcache_entry_t dcache[DCACHE_SIZE];
+static int dcache_buckets[DCACHE_BUCKETS];
+static int dcache_hand;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// what an open file remembers of its last block-map lookup, so that
+// sequential access neither walks the map from the first extent nor
+// goes back to the buffer cache for the same indirect block
+typedef struct map_cursor {
+    int ext;         // extent used by the last lookup (-1 if none)
+    int first;       // file block that extent starts at
+    sector_t sector; // indirect block copied into 'extents' (-1 if none)
+    unsigned int gen; // map_gen of the inode when the above was filled in
+    extent_t* extents; // copy of 'sector', allocated on first use
+} map_cursor_t;
+
+// sequential readahead state of a descriptor, kept under its lock
+typedef struct readahead {
+    int next;   // file offset the last read ended at
+    int window; // sectors read ahead at a time, 0 while reads are random
+    int ahead;  // file blocks before this one have been read ahead
+} readahead_t;
+
 //structure for open file -> open file table
 typedef struct open_file {
     int inode; // pointing to the inode of the file (0 means entry not used)
     int size;
     int pos;   // read/write position
+    inode_t* ip; // in-core inode, pinned while the file is open
+    map_cursor_t map; // block-map lookup cache
+    readahead_t ra;
+    pthread_mutex_t lock; // 'pos', 'map' and 'ra', for threads sharing the descriptor
+    int next_free; // next unused entry (-1 ends the free list)
 } open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+
+// the open file table grows FD_CHUNK entries at a time; chunks never
+// move, so an entry can be used without fd_lock once it is handed out.
+// Unused entries are kept on a free list for O(1) open and close
+static open_file_t* fd_chunks[MAX_OPEN_FILES / FD_CHUNK];
+static int fd_nchunks;
+static int fd_free = -1; // first unused entry
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER; // the free list and the table size
+
+// in-memory copy of an on-disk bitmap. Item i is bit 63-(i%64) of
+// words[i/64], which matches the on-disk order (first item in the most
+// significant bit of the first byte) when words are read big-endian
+typedef struct bitmap {
+    uint64_t* words;
+    sector_t nbits;     // items tracked
+    sector_t nwords;
+    sector_t start;     // first disk sector of the on-disk bitmap
+    sector_t nsectors;  // disk sectors it spans
+    sector_t nfree;     // items still free
+    sector_t hint;      // next-fit: word the next scan starts from
+    unsigned char* dirty; // 1 for each bitmap sector changed since the last flush
+    uint64_t* held;     // items freed on disk but not reusable until the next journal checkpoint (NULL if none)
+    pthread_mutex_t lock; // taken by the alloc_*/free_* wrappers and bitmap_flush()
+} bitmap_t;
+static bitmap_t inode_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static bitmap_t sector_bitmap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static sector_t delalloc_reserved; // free data sectors promised to delayed blocks, under sector_bitmap.lock
+
+// the metadata journal: a header sector, then a circular log of
+// transactions. Each transaction is one or more descriptor sectors
+// (listing up to JOURNAL_HOMES home sectors) each followed by the new
+// contents of those sectors, then a commit sector with a checksum of it
+// all. Metadata sectors are noted as they change (meta_put()); FS_Sync()
+// logs all of them as one transaction and holds their home copies out
+// of the image (Disk_Hold()) until a checkpoint writes them in place
+typedef struct journal_header {
+    int magic;      // JOURNAL_MAGIC
+    int unused;
+    uint64_t seq;   // sequence number of the transaction at 'tail'
+    sector_t tail;  // oldest transaction still needed, relative to the log
+} journal_header_t;
+
+typedef struct journal_desc {
+    int magic;          // JOURNAL_DESC or JOURNAL_COMMIT
+    int count;          // descriptor: home sectors listed; commit: sectors in the transaction
+    uint64_t seq;       // transaction the sector belongs to
+    uint64_t checksum;  // commit: over every other sector of the transaction
+    sector_t homes[JOURNAL_HOMES];
+} journal_desc_t;
+
+typedef struct journal {
+    int active;         // 1 when FS_Sync() commits through the journal
+    sector_t size;      // sectors in the log
+    sector_t tail;      // oldest transaction still needed, relative to the log
+    sector_t used;      // log sectors from 'tail' on holding transactions
+    uint64_t seq;       // sequence number of the next transaction
+    uint64_t* changed;  // metadata sectors noted since the last commit, a bit each...
+    sector_t* list;     // ...and in the order they were noted
+    int count;
+    int cap;
+    uint64_t* logged;   // sectors logged since the last checkpoint
+    pthread_mutex_t lock; // 'changed' and 'list'
+    long commits;       // transactions written
+    long checkpoints;
+    long replayed;      // transactions replayed by the last FS_Boot()
+
+    // background checkpoints
+    pthread_t thread;
+    int running;
+    int stop;
+    int retimed;        // checkpoint_ms changed, start the wait again
+    pthread_mutex_t wake_lock; // also 'stop', 'retimed' and checkpoint_ms
+    pthread_cond_t wake;
+} journal_t;
+static journal_t journal = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                             .wake_lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// FS_Sync() callers share commits: whoever finds one running waits for
+// the next, which then covers everything all of them changed
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static long commits_started;
+static long commits_finished;
+static int committing;
+static int commit_rc;
+
+// sectors one background writeback round stages and writes
+#define WRITEBACK_BATCH 2048
+
+// background writeback: a thread that brings the image up to date every
+// writeback_ms, and as soon as a writer finds the sectors it lacks have
+// reached 'threshold'. Its lock covers everything here and the two
+// options, which may change while it runs
+typedef struct writeback {
+    sector_t threshold; // writeback_dirty percent of the disk, 0 for none
+    int kicked;         // a writer found the threshold crossed
+    int booted;         // FS_Boot() succeeded, the thread may run
+    FS_Writeback_Stats stats;
+    pthread_t thread;
+    int running;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} writeback_t;
+static writeback_t writeback = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
 
 /***********************END OF REQUIRED STRUCTURES******************/
 
 /**********************START OF HELPER FUNCTIONS***********************/
 
-//to calculate power, used in first_unused_bitmap()
-int ipow(int base, int exp) {
-    int result = 1;
-    for (;;) //unconditional for-loop
-    {
-        if (exp & 1)
-            result *= base;
-        exp >>= 1;
-        if (!exp)
-            break;
-        base *= base;
-    }
-    return result;
-}
-
 //checking for valid characters
 static int valid_character(char c) {
     int temp = (int)c; //casted to an int to compare with ascii decimal value
@@ -114,606 +393,3337 @@ static int illegal_filename(char* name) {
 
 
 
-// Initializing inode bitmap and sector bitmap
-//for inode 1st bit is 1 (for root) others = 0
-// for sector bitmap 255 bits arre 1 (for superblock(1), inode bitmap(1),
-// sector bitmap(3), inode table(250), total = 254)
-static void initialize_bitmap() {
-    char bitmap_buffer[SECTOR_SIZE];
-
-        bitmap_buffer[0] = (unsigned char) 128;
-
-        for( int i = 1; i < SECTOR_SIZE; i++ )
-            bitmap_buffer[i] = 0;
+/*******************STATISTICS*******************/
+
+// every thread counts the calls it makes in a block of its own, so the
+// counting takes no lock and no cache line is shared; FS_GetStats() adds
+// the blocks up. Only the owner changes a block, with relaxed atomic
+// stores the readers pair with relaxed loads. FS_ResetStats() bumps the
+// generation and each block zeroes itself on its next use; until then
+// readers skip it
+typedef struct stats_block {
+    FS_Op_Stats ops[FS_OP_COUNT];
+    unsigned long gen;           // stats_gen the counts belong to
+    struct stats_block* next;    // next live thread's block
+} stats_block_t;
+
+static int stats_every = 16;     // FS_OPT_STATS, timing every call can make a small one half again as slow
+static _Thread_local unsigned stats_skipped[FS_OP_COUNT]; // calls since this thread last timed one
+static unsigned long stats_gen;
+static _Thread_local stats_block_t* my_stats;
+static stats_block_t* stats_blocks;  // blocks of the threads still running
+static stats_block_t stats_retired;  // what exited threads counted
+static Cache_Stats stats_cache;      // cache counters of the disks booted before this one
+static FS_Stats stats_base;          // cache and disk counters when the stats were last reset
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // the list, stats_retired, stats_cache and stats_base
+
+static const char* op_names[FS_OP_COUNT] = {
+    "FS_Boot", "FS_Sync",
+    "File_Create", "File_Open", "File_Read", "File_Write", "File_Readv", "File_Writev",
+    "File_PRead", "File_PWrite", "File_ReadView", "File_Seek", "File_Close", "File_Unlink",
+    "Dir_Create", "Dir_Size", "Dir_Read", "Dir_Unlink",
+    "follow_path",
+};
+
+static double ns_per_tick = 1;     // set once by stats_key_init()
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
 
-        Disk_Write( 1, bitmap_buffer );//write to the inode bitmap
+// the clock calls are timed with: reading the time stamp counter costs a
+// few ns where clock_gettime() costs tens, and a cached File_Open() only
+// takes a few hundred ns
+static long clock_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return (long)__rdtsc();
+#else
+    return now_ns();
+#endif
+}
 
-        int i, j;
+// measure how long a tick is against CLOCK_MONOTONIC, over 2 ms
+static void clock_calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+    long t0 = now_ns(), c0 = clock_ticks(), t1;
+    while((t1 = now_ns()) - t0 < 2000000)
+        ;
+    ns_per_tick = (double)(t1 - t0) / (clock_ticks() - c0);
+#endif
+}
 
-        for( i = 0; i < 31; i++ )
-            bitmap_buffer[ i ] = ( unsigned char )255;
+// histogram bucket of 'ns': itself below 16, then 8 buckets per power of two
+static int hist_bucket(long ns) {
+    if(ns < 16)
+        return ns < 0 ? 0 : (int)ns;
+    int e = 63 - __builtin_clzl((unsigned long)ns);
+    int b = (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+    return b < FS_HIST_BUCKETS ? b : FS_HIST_BUCKETS - 1;
+}
 
-        bitmap_buffer[ 31 ] = ( unsigned char )254;
+// largest value that falls in bucket 'b'
+static long hist_upper(int b) {
+    if(b < 16)
+        return b;
+    int e = b / 8 + 2;
+    return ((long)(b % 8 + 9) << (e - 3)) - 1;
+}
 
-        for( i = 32 ; i < SECTOR_SIZE ; i++ )
-            bitmap_buffer[ i ] = 0;
+static long stat_load(long* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
 
-        Disk_Write( 2, bitmap_buffer ); //sector bimap
+// add to a counter of this thread's block
+static void stat_add(long* counter, long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-        memset( bitmap_buffer, 0, SECTOR_SIZE );
-        Disk_Write( 3, bitmap_buffer ); //sector bitmap
-        Disk_Write( 4, bitmap_buffer ); // sector bitmap
+static void stats_zero(stats_block_t* block) {
+    for(long* c = (long*)block->ops; c < (long*)(block->ops + FS_OP_COUNT); c++)
+        __atomic_store_n(c, 0, __ATOMIC_RELAXED);
 }
 
-//function to return first unused bit from bitmap, which starts from sector 'start', 
-//spanned over 'num' number of sectors, and total size of bitmap 'nbits'
-static int first_unused_bit( int start, int num, int nbytes )
-{
-    char buf[ SECTOR_SIZE ];
-    int sector = 0;
-    int bytes_left = nbytes, check = SECTOR_SIZE;
+// add block 'from' to 'to', which only the caller changes
+static void stats_merge(FS_Op_Stats* to, stats_block_t* from) {
+    for(int op = 0; op < FS_OP_COUNT; op++) {
+        FS_Op_Stats* f = &from->ops[op];
+        to[op].calls += stat_load(&f->calls);
+        to[op].errors += stat_load(&f->errors);
+        to[op].latency.count += stat_load(&f->latency.count);
+        to[op].latency.total_ns += stat_load(&f->latency.total_ns);
+        long max = stat_load(&f->latency.max_ns);
+        if(max > to[op].latency.max_ns)
+            to[op].latency.max_ns = max;
+        for(int b = 0; b < FS_HIST_BUCKETS; b++)
+            to[op].latency.buckets[b] += stat_load(&f->latency.buckets[b]);
+    }
+}
 
-    int rt;//to return the serial number of bit which is 0
+// a thread that made calls exits: what it counted is kept in stats_retired
+static void stats_thread_exit(void* arg) {
+    stats_block_t* block = arg;
+    pthread_mutex_lock(&stats_lock);
+    stats_block_t** link = &stats_blocks;
+    while(*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+    unsigned long gen = __atomic_load_n(&stats_gen, __ATOMIC_RELAXED);
+    if(stats_retired.gen != gen) {
+        memset(stats_retired.ops, 0, sizeof(stats_retired.ops));
+        stats_retired.gen = gen;
+    }
+    if(block->gen == gen)
+        stats_merge(stats_retired.ops, block);
+    pthread_mutex_unlock(&stats_lock);
+    free(block);
+}
 
-    while( sector < num )// to check number of sectors on which bitmap is spanned
-    {
-        Disk_Read( start + sector*SECTOR_SIZE, buf);
+static void stats_key_init() {
+    pthread_key_create(&stats_key, stats_thread_exit);
+    clock_calibrate();
+}
 
-        if( bytes_left < SECTOR_SIZE )//to check if remaining bitmap bytes are less than sector 
-            check = bytes_left;       //then set check to that so that that much bytes would be checked only
+// the calling thread's block, made on its first call; NULL if there is
+// no memory for one (its calls then go uncounted)
+static stats_block_t* stats_mine() {
+    stats_block_t* block = my_stats;
+    if(block == NULL) {
+        pthread_once(&stats_once, stats_key_init);
+        if((block = calloc(1, sizeof(stats_block_t))) == NULL)
+            return NULL;
+        pthread_mutex_lock(&stats_lock);
+        block->gen = __atomic_load_n(&stats_gen, __ATOMIC_RELAXED);
+        block->next = stats_blocks;
+        stats_blocks = block;
+        pthread_mutex_unlock(&stats_lock);
+        pthread_setspecific(stats_key, block);
+        my_stats = block;
+    }
+    unsigned long gen = __atomic_load_n(&stats_gen, __ATOMIC_ACQUIRE);
+    if(block->gen != gen) {
+        stats_zero(block);
+        __atomic_store_n(&block->gen, gen, __ATOMIC_RELEASE);
+    }
+    return block;
+}
 
-        for( int i = 0; i < check; i++ )
-        {
-            char byte_buffer = buf[i];
+// start timing a call of 'op': 0 if the stats are off, -1 if the call
+// is only counted. Reading the clock twice is most of what counting a
+// call costs, which FS_OPT_STATS above 1 saves on most calls. Every call
+// has its own count of those skipped, or a program that repeats the same
+// few calls would only ever have one of them timed
+static long op_begin(FS_Op_t op) {
+    trace(TRACE_CALLS, 'B', op, -1, -1, 0);
+    int every = __atomic_load_n(&stats_every, __ATOMIC_RELAXED);
+    if(every == 0)
+        return 0;
+    if(every > 1 && ++stats_skipped[op] < (unsigned)every)
+        return -1;
+    stats_skipped[op] = 0;
+    return clock_ticks();
+}
 
-            if( byte_buffer != (char)255 )
-            {
-                unsigned char mask = ~byte_buffer;//bitwise complement
+// count a call that started at 'start' and returned 'rc' in 's'
+static void op_count(FS_Op_Stats* s, long start, int rc) {
+    stat_add(&s->calls, 1);
+    if(rc == -1)
+        stat_add(&s->errors, 1);
+    if(start == -1)
+        return;
+    long ns = (long)((clock_ticks() - start) * ns_per_tick);
+    stat_add(&s->latency.count, 1);
+    stat_add(&s->latency.total_ns, ns);
+    if(ns > s->latency.max_ns)
+        __atomic_store_n(&s->latency.max_ns, ns, __ATOMIC_RELAXED);
+    stat_add(&s->latency.buckets[hist_bucket(ns)], 1);
+}
 
-                int loc = 0;//to track the location where is first 0
+// end a call of 'op' that started at 'start' and returns 'rc', which
+// is passed on
+static int op_end(FS_Op_t op, long start, int rc) {
+    stats_block_t* block;
+    if(start != 0 && (block = stats_mine()) != NULL)
+        op_count(&block->ops[op], start, rc);
+    trace(TRACE_CALLS, 'E', op, -1, -1, rc);
+    return rc;
+}
 
-                while( mask != 0 )
-                {
-                    loc++;
-                    mask = mask>>1;
-                }
+// the cache and disk counters of 'stats', as LibCache and LibDisk have
+// them plus the cache's of the disks booted before. Called with fs_lock
+// and stats_lock held
+static void stats_io(FS_Stats* stats) {
+    Cache_Stats cs;
+    Disk_Stats ds;
+    Cache_GetStats(&cs);
+    Disk_GetStats(&ds);
+    stats->cache_hits = stats_cache.hits + cs.hits;
+    stats->cache_misses = stats_cache.misses + cs.misses;
+    stats->cache_evictions = stats_cache.evictions + cs.evictions;
+    stats->cache_writebacks = stats_cache.writebacks + cs.writebacks;
+    stats->disk_reads = ds.reads;
+    stats->disk_writes = ds.writes;
+    stats->disk_sectors_read = ds.sectors_read;
+    stats->disk_sectors_written = ds.sectors_written;
+    stats->disk_seeks = ds.seeks;
+    stats->disk_model_ns = ds.model_ns;
+}
 
-                mask = ipow(2, loc - 1);
+// FS_Boot() is about to start a new cache, keep what the old one counted.
+// The first boot also calibrates the clock, before any file call is timed
+static void stats_carry_cache() {
+    FS_Stats now;
+    pthread_once(&stats_once, stats_key_init);
+    pthread_mutex_lock(&stats_lock);
+    stats_io(&now);
+    stats_cache.hits = now.cache_hits;
+    stats_cache.misses = now.cache_misses;
+    stats_cache.evictions = now.cache_evictions;
+    stats_cache.writebacks = now.cache_writebacks;
+    pthread_mutex_unlock(&stats_lock);
+}
 
-                buf[i] = buf[i] | mask ;
+/*******************TRACING*******************/
+
+// every thread that traces writes to a ring of its own, which nobody
+// waits on: an event is stored a word at a time with relaxed atomics
+// and then published by moving 'head' on. FS_TraceSave() copies a ring
+// and reads 'head' again to drop whatever was overwritten meanwhile.
+// Rings stay until the program ends so exited threads can be saved too
+typedef struct trace_ring {
+    unsigned long head;          // events ever written
+    int thread;
+    struct trace_ring* next;
+    FS_Trace_Event events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+#define TRACE_WORDS (sizeof(FS_Trace_Event) / sizeof(long))
+
+static _Thread_local trace_ring_t* my_trace;
+static trace_ring_t* trace_rings;
+static int trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // trace_rings, trace_threads
+
+static const char* event_names[FS_EV_COUNT - FS_OP_COUNT] = {
+    "add_inode", "inode_alloc", "inode_load", "inode_store", "dir_add",
+    "file_read", "file_write", "file_grow", "sector_alloc", "delalloc_flush",
+    "journal_write", "flush",
+};
+
+// record an event in the calling thread's ring; only reached through
+// trace(), so not at all below TRACE_CALLS
+static void trace_event(char phase, int event, int inode, long sector, long arg) {
+    trace_ring_t* ring = my_trace;
+    if(ring == NULL) {
+        if((ring = calloc(1, sizeof(trace_ring_t))) == NULL)
+            return;
+        pthread_mutex_lock(&trace_lock);
+        ring->thread = ++trace_threads;
+        ring->next = trace_rings;
+        trace_rings = ring;
+        pthread_mutex_unlock(&trace_lock);
+        my_trace = ring;
+    }
+    FS_Trace_Event e = {clock_ticks(), (short)event, phase, 0, inode, sector, arg};
+    long words[TRACE_WORDS];
+    memcpy(words, &e, sizeof(e));
+    unsigned long head = ring->head;
+    long* slot = (long*)&ring->events[head & (TRACE_RING_EVENTS - 1)];
+    // a saver that sees any of the new words also sees the head that
+    // tells it the old event is gone
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(int i = 0; i < TRACE_WORDS; i++)
+        __atomic_store_n(&slot[i], words[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-                Disk_Write( start + sector*SECTOR_SIZE, buf );
+// copy the events of 'ring' still there into 'to', oldest first;
+// returns how many and sets *lost to those overwritten before
+static int trace_copy(trace_ring_t* ring, FS_Trace_Event* to, long* lost) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    for(unsigned long i = first; i < head; i++) {
+        long* slot = (long*)&ring->events[i & (TRACE_RING_EVENTS - 1)];
+        long words[TRACE_WORDS];
+        for(int w = 0; w < TRACE_WORDS; w++)
+            words[w] = __atomic_load_n(&slot[w], __ATOMIC_RELAXED);
+        memcpy(&to[i - first], words, sizeof(words));
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // the owner may be writing event 'now' over event 'now - RING' already
+    unsigned long now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned long valid = now + 1 > TRACE_RING_EVENTS ? now + 1 - TRACE_RING_EVENTS : 0;
+    unsigned long skip = valid > first ? valid - first : 0;
+    if(skip > head - first)
+        skip = head - first;
+    memmove(to, to + skip, (head - first - skip) * sizeof(FS_Trace_Event));
+    *lost = (long)(first + skip);
+    return (int)(head - first - skip);
+}
 
-                return (sector * SECTOR_SIZE * 8) + (i*8) + (8 - loc );//( full sectors) + ( bytes full in current sector) + ( bits full in current byte)
-                    //we are not adding one here because indexing starts from 0  
+/*******************JOURNAL BOOKKEEPING*******************/
+
+#define BIT_TEST(bits, i) ((bits)[(i) / 64] & (1ULL << ((i) % 64)))
+#define BIT_SET(bits, i) ((bits)[(i) / 64] |= 1ULL << ((i) % 64))
+#define BIT_CLEAR(bits, i) ((bits)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+// remember that metadata sector 'sector' changed, for the next commit
+static void journal_note(sector_t sector) {
+    if(!journal.active)
+        return;
+    pthread_mutex_lock(&journal.lock);
+    if(!BIT_TEST(journal.changed, sector)) {
+        if(journal.count == journal.cap) {
+            int cap = journal.cap ? journal.cap * 2 : 256;
+            sector_t* list = (sector_t*)realloc(journal.list, cap * sizeof(sector_t));
+            if(list == NULL) { // leave the sector out rather than fail the caller
+                pthread_mutex_unlock(&journal.lock);
+                return;
             }
+            journal.list = list;
+            journal.cap = cap;
         }
-
-
-        bytes_left-=SECTOR_SIZE;// SECTOR_SIZE bytes have been red 
-        sector++;// go to next sectro
-    } 
-
-    return -1;//bitmap is full
-
+        BIT_SET(journal.changed, sector);
+        journal.list[journal.count++] = sector;
+    }
+    pthread_mutex_unlock(&journal.lock);
 }
 
-// helper function to get a specific inode_t from its inode number
-inode_t* get_inode(int child_inode) {
-
-    int inode_sector = INODE_TABLE_START_SECTOR + child_inode/INODES_PER_SECTOR; // Caculate sector number which hs inode
-    char inode_buffer[SECTOR_SIZE]; // buffer to store the sector's data which contains inode
-
-    Disk_Read(inode_sector, inode_buffer); // save data in inode_sector onto inode_buffer
-
-    int child_loc = child_inode - ( ( inode_sector - INODE_TABLE_START_SECTOR ) * INODES_PER_SECTOR); // Calculating actual position of inode in its sector
-    inode_t* child = ( inode_t* )( inode_buffer + child_loc*sizeof( inode_t ) );
-  
-    return child;
+// 'sector' is being freed: it no longer needs logging, and returns 1 if
+// a logged copy of it could still be replayed over its next owner, in
+// which case it must not be reused before the next checkpoint
+static int journal_forget(sector_t sector) {
+    if(!journal.active)
+        return 0;
+    pthread_mutex_lock(&journal.lock);
+    BIT_CLEAR(journal.changed, sector); // the commit skips it in 'list'
+    pthread_mutex_unlock(&journal.lock);
+    return BIT_TEST(journal.logged, sector) != 0;
 }
 
+// Cache_Put() for buffers holding metadata, which the journal logs
+static void meta_put(char* buf, int dirty) {
+    if(dirty)
+        journal_note(Cache_Sector(buf));
+    Cache_Put(buf, dirty);
+}
 
-//get_child_inode will return inode number of 'fname' file/directory, whhich should be
-// in parent_inode i.e., it should be sub-directory or file, if not return -1, 
-static int get_child_inode(int parent_inode, char* fname)
-{
-    int child_inode;//to return the inode number of child node
-    printf("___ parent inode = %d\n", parent_inode);
-
-    int parent_sector = INODE_TABLE_START_SECTOR + parent_inode / INODES_PER_SECTOR ;//to calculate sector of parent inode
-    int  parent_offset = parent_inode - ( parent_sector - INODE_TABLE_START_SECTOR ) * INODES_PER_SECTOR;//to calculate position of inode on current sector
-
-    char buf[SECTOR_SIZE];
-    Disk_Read( parent_sector, buf );//to read the sector of parent's inode
+/*******************BITMAP ALLOCATOR*******************/
+
+#define WORDS_PER_SECTOR (SECTOR_SIZE/sizeof(uint64_t))
+
+// set up an empty in-memory bitmap of 'nbits' items whose on-disk copy
+// spans 'nsectors' sectors from 'start'
+static int bitmap_init(bitmap_t* bm, sector_t start, sector_t nsectors, sector_t nbits) {
+    free(bm->words);
+    free(bm->dirty);
+    free(bm->held);
+    bm->held = NULL;
+    bm->nbits = nbits;
+    bm->nwords = (nbits + 63) / 64;
+    bm->start = start;
+    bm->nsectors = nsectors;
+    bm->nfree = nbits;
+    bm->hint = 0;
+    bm->words = (uint64_t*)calloc(nsectors * WORDS_PER_SECTOR, sizeof(uint64_t));
+    bm->dirty = (unsigned char*)calloc(nsectors, 1);
+    if(bm->words == NULL || bm->dirty == NULL)
+        return -1;
+    return 0;
+}
 
-    inode_t* parent = (inode_t*)( buf + ( parent_offset*sizeof(inode_t) ) );
-    printf("___ load parent inode: parent_inode = %d, inode address %p, %d (size=%d, type=%d)\n",parent_inode ,parent, parent_inode, parent->size, parent->type);
+// bring the bitmap of 'nbits' items stored in 'nsectors' sectors from
+// 'start' into memory; called at boot, after which the disk copy is
+// only written by bitmap_flush()
+static int bitmap_load(bitmap_t* bm, sector_t start, sector_t nsectors, sector_t nbits) {
+    if(bitmap_init(bm, start, nsectors, nbits) < 0)
+        return -1;
 
-    //inode_t* parent = get_inode(parent_inode);
-    //printf("___ load parent inode: parent_inode = %d, inode address %p, %d (size=%d, type=%d)\n",parent_inode ,parent, parent_inode, parent->size, parent->type);
-    if( parent->type == 0 )//0 represents file, and 1 represents directory, in parent->type
-    {
-        printf("___ Not a directory\n");
-        return -2 ;
+    for(sector_t s = 0; s < nsectors; s++) {
+        unsigned char* buf = (unsigned char*)Cache_Get(start + s);
+        if(buf == NULL)
+            return -1;
+        for(int w = 0; w < WORDS_PER_SECTOR; w++) {
+            uint64_t word = 0;
+            for(int b = 0; b < 8; b++)
+                word = (word << 8) | buf[w*8 + b];
+            bm->words[s*WORDS_PER_SECTOR + w] = word;
+        }
+        Cache_Put((char*)buf, 0);
     }
-    else
-    {
-        int parent_entries = parent->size ;
-        int index = 0;
-        while( parent_entries > 0 )
-        {
-            if( Disk_Read( parent->data[index],buf ) < 0 )//using buf again because its previous data is never being used again
-                return -2;
-
-            for( int i = 0 ; i < DIRENTS_PER_SECTOR ; i++ )
-            {
-                if( i > parent_entries )
-                    break;
-                if(!strcmp(((dirent_t*)buf)[i].fname, fname))
-                {
-                    child_inode = ((dirent_t*)buf)[i].inode;
-                    printf("___ found child inode %d\n", child_inode);
 
-                    return child_inode;
-                }
-            }
+    // bits past the last item are ignored by the scans, clear them so
+    // popcount only sees real items
+    if(nbits % 64)
+        bm->words[bm->nwords - 1] &= ~(~0ULL >> (nbits % 64));
+    for(sector_t w = bm->nwords; w < nsectors * WORDS_PER_SECTOR; w++)
+        bm->words[w] = 0;
+
+    sector_t used = 0;
+    for(sector_t w = 0; w < bm->nwords; w++)
+        used += __builtin_popcountll(bm->words[w]);
+    bm->nfree = nbits - used;
+    return 0;
+}
 
-            parent_entries -= DIRENTS_PER_SECTOR;// every time update number of parent_entries left to check 
-            index++;
+// write every changed bitmap sector back through the buffer cache
+static int bitmap_flush(bitmap_t* bm) {
+    pthread_mutex_lock(&bm->lock);
+    for(sector_t s = 0; s < bm->nsectors; s++) {
+        if(!bm->dirty[s])
+            continue;
+        unsigned char* buf = (unsigned char*)Cache_Get(bm->start + s);
+        if(buf == NULL) {
+            pthread_mutex_unlock(&bm->lock);
+            return -1;
         }
-
+        for(int w = 0; w < WORDS_PER_SECTOR; w++) {
+            uint64_t word = bm->words[s*WORDS_PER_SECTOR + w];
+            if(bm->held != NULL) // free on disk, only kept from reuse
+                word &= ~bm->held[s*WORDS_PER_SECTOR + w];
+            for(int b = 7; b >= 0; b--, word >>= 8)
+                buf[w*8 + b] = (unsigned char)word;
+        }
+        meta_put((char*)buf, 1);
+        bm->dirty[s] = 0;
     }
+    pthread_mutex_unlock(&bm->lock);
+    return 0;
+}
 
-    return -1;//not in the parent
-
+static void bitmap_set(bitmap_t* bm, sector_t item) {
+    bm->words[item / 64] |= 1ULL << (63 - item % 64);
+    bm->dirty[item / (SECTOR_SIZE * 8)] = 1;
+    bm->nfree--;
 }
 
-//follow_path will return immediate parent's inode number, file's/directories inode number
-// through last_inode argument and name of file/directory thourgh last name
-static int follow_path(char* path, int* last_inode, char* last_fname)
-{
-    if(!path) {
-        printf("___ invalid path\n");
-        return -1;
-    }
-    if(path[0] != '/') {
-        printf("___ '%s' not absolute path\n", path);
+// take the first free item at or after the next-fit hint, wrapping
+// around once; -1 if the bitmap is full
+static sector_t bitmap_alloc(bitmap_t* bm) {
+    if(bm->nfree == 0)
         return -1;
+    for(sector_t n = 0; n < bm->nwords; n++) {
+        sector_t w = (bm->hint + n) % bm->nwords;
+        uint64_t free_bits = ~bm->words[w];
+        if(free_bits == 0)
+            continue;
+        sector_t item = w * 64 + __builtin_clzll(free_bits);
+        if(item >= bm->nbits)
+            continue; // only padding left in the last word
+        bitmap_set(bm, item);
+        bm->hint = w;
+        return item;
     }
+    return -1;
+}
 
-    //to remove first '/' from path
-    char tgt[ MAX_PATH ];
-    strncpy( tgt, path + 1, MAX_PATH - 1 );
-    tgt[ MAX_PATH - 1] = '\0';
-    printf("___ path copied\n");
-    char *target = tgt;
-    //to initialize parent and child inode number, initially root i.e., 0
-    int parent = -1, child = 0;
+// give 'item' back to the bitmap
+static void bitmap_free(bitmap_t* bm, sector_t item) {
+    if(item < 0 || item >= bm->nbits)
+        return;
+    uint64_t mask = 1ULL << (63 - item % 64);
+    if(!(bm->words[item / 64] & mask))
+        return;
+    bm->words[item / 64] &= ~mask;
+    bm->dirty[item / (SECTOR_SIZE * 8)] = 1;
+    bm->nfree++;
+}
 
-    char *follow;//to access parts of path, as a/b/c/d.txt then a,b,c will be accessed seperately by follow
-    while( (follow = strsep( &target, "/")) != NULL )
-    {
-        if( *follow == '\0') continue;//to check if the whole path is accessed,now strsep will return NULL so loop will break
+// free 'item' on disk but keep it allocated in memory until
+// bitmap_release(); -1 if that needs memory there is none of
+static int bitmap_hold(bitmap_t* bm, sector_t item) {
+    if(bm->held == NULL && (bm->held = (uint64_t*)calloc(bm->nsectors * WORDS_PER_SECTOR, sizeof(uint64_t))) == NULL)
+        return -1;
+    bm->held[item / 64] |= 1ULL << (63 - item % 64);
+    bm->dirty[item / (SECTOR_SIZE * 8)] = 1;
+    return 0;
+}
 
-        if( illegal_filename( follow ) )//chceking if path-part is legal
-        {
-            return -1;
-        }
-        if( child < 0 )
-        {
-            return -1;
+// make the held items free for reuse
+static void bitmap_release(bitmap_t* bm) {
+    if(bm->held == NULL)
+        return;
+    for(sector_t w = 0; w < bm->nwords; w++) {
+        if(bm->held[w]) {
+            bm->nfree += __builtin_popcountll(bm->words[w] & bm->held[w]);
+            bm->words[w] &= ~bm->held[w];
         }
-
-        parent = child;//pushing the child inode to parent, to go further in child's directory, so making it parent
-        child = get_child_inode(parent, follow);
-        if(last_fname) strcpy(last_fname, follow);
     }
+    free(bm->held);
+    bm->held = NULL;
+}
 
-    if( child < -1 ) return -1;//some error happend
-    else
-    {
-        if( parent == -1 && child == 0 ) parent = 0;
+// give 'count' items from 'item' on back, a word at a time
+static void bitmap_free_run(bitmap_t* bm, sector_t item, int count) {
+    if(item < 0 || count <= 0 || count > bm->nbits - item)
+        return;
+    while(count > 0) {
+        int bit = item % 64;
+        int n = count < 64 - bit ? count : 64 - bit;
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1) << (64 - bit - n));
+        bm->nfree += __builtin_popcountll(bm->words[item / 64] & mask);
+        bm->words[item / 64] &= ~mask;
+        bm->dirty[item / (SECTOR_SIZE * 8)] = 1;
+        item += n;
+        count -= n;
+    }
+}
 
-        *last_inode = child;
+static int bitmap_test(bitmap_t* bm, sector_t item) {
+    return (bm->words[item / 64] >> (63 - item % 64)) & 1;
+}
 
-        return parent;
+// first free item at or after 'item', -1 if there is none before the end
+static sector_t bitmap_next_free(bitmap_t* bm, sector_t item) {
+    if(item >= bm->nbits)
+        return -1;
+    sector_t w = item / 64;
+    uint64_t free_bits = ~bm->words[w] & (~0ULL >> (item % 64));
+    while(free_bits == 0) {
+        if(++w >= bm->nwords)
+            return -1;
+        free_bits = ~bm->words[w];
     }
+    item = w * 64 + __builtin_clzll(free_bits);
+    return item < bm->nbits ? item : -1;
+}
 
+// number of consecutive free items starting at 'item', at most 'max'
+static int bitmap_run_length(bitmap_t* bm, sector_t item, int max) {
+    int n = 0;
+    if(max > bm->nbits - item)
+        max = bm->nbits - item;
+    while(n < max) {
+        int bit = (item + n) % 64;
+        uint64_t used = bm->words[(item + n) / 64] << bit;
+        if(used != 0) {
+            n += __builtin_clzll(used);
+            break;
+        }
+        n += 64 - bit;
+    }
+    return n < max ? n : max;
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
-{
-    int child_inode_number = first_unused_bit( INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE );
+// allocate up to 'want' consecutive items. The run starts at 'goal' when
+// that item is free (so a file can grow in place); otherwise the first
+// run of 'want' items after the next-fit hint is taken, or failing that
+// the longest run there is. Returns the first item and sets *got to the
+// run length; -1 if the bitmap is full
+static sector_t bitmap_alloc_run(bitmap_t* bm, sector_t goal, int want, int* got) {
+    sector_t best = -1;
+    int best_len = 0;
 
-    if( child_inode_number < 0 )
-    {
-        printf("___ inode is not available");
+    if(bm->nfree == 0 || want <= 0)
         return -1;
+    if(goal >= 0 && goal < bm->nbits && !bitmap_test(bm, goal)) {
+        best = goal;
+        best_len = bitmap_run_length(bm, goal, want);
+    }
+    else {
+        sector_t first = (bm->hint % bm->nwords) * 64;
+        sector_t pos = first;
+        int wrapped = 0;
+        for(;;) {
+            sector_t item = bitmap_next_free(bm, pos);
+            if(item == -1 || (wrapped && item >= first)) {
+                if(wrapped)
+                    break;
+                wrapped = 1;
+                pos = 0;
+                continue;
+            }
+            int len = bitmap_run_length(bm, item, want);
+            if(len > best_len) {
+                best = item;
+                best_len = len;
+                if(len == want)
+                    break;
+            }
+            pos = item + len;
+        }
     }
-    printf("___ child inode is available with inode number %d \n", child_inode_number );
-
-    int new_inode_sector = INODE_TABLE_START_SECTOR + child_inode_number/INODES_PER_SECTOR;//to calculate sector number on which it lie
-    char buf[ SECTOR_SIZE ];//buffer to read the sector where new inode/ parent inode lies
-    if(Disk_Read( new_inode_sector, buf ) < 0 ) return -1;//read the sector on which new inode lies
 
-    int sector_num = new_inode_sector - INODE_TABLE_START_SECTOR;//sector from start on which new inode lies
-    int offset = child_inode_number - sector_num * INODES_PER_SECTOR ;//going to byte where new inode to be stored
+    for(int i = 0; i < best_len; i++)
+        bitmap_set(bm, best + i);
+    bm->hint = (best + best_len) / 64 % bm->nwords;
+    *got = best_len;
+    return best;
+}
 
-    inode_t* child_inode = (inode_t*)(buf + offset*sizeof(inode_t));
-    for(int i = 0 ;i<30;i++)
-        child_inode->data[i]=0;
-    memset(child_inode, 0, sizeof(inode_t) );
-    child_inode->type = type;
-    if( Disk_Write( new_inode_sector, buf) < 0 ) {
-        printf("___ Disk write failed returning -1\n");
+// load both bitmaps from the disk
+static int bitmaps_load() {
+    if(bitmap_load(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, layout.inodes) < 0 ||
+       bitmap_load(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, layout.sectors) < 0) {
+        fs_log(TRACE_ERRORS, "___ loading the bitmaps failed\n");
         return -1;
-    }//writing back the new inode's entry
-
-    // Retrieving parents inode to make entry
+    }
+    return 0;
+}
 
-    memset( buf, 0, SECTOR_SIZE );//clearing buffer buf to reuse it
-    int parent_inode_sector = INODE_TABLE_START_SECTOR + parent_inode/INODES_PER_SECTOR;//to calculate sector number on which the parent inode lie
-    if(Disk_Read( parent_inode_sector, buf ) < 0 ) {
-        printf("___ Disk read failed returning -1\n");
+// build the bitmaps of a freshly formatted disk: inode 0 (the root) and
+// every sector before the data area are in use, then write them out
+static int bitmaps_format() {
+    if(bitmap_init(&inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, layout.inodes) < 0 ||
+       bitmap_init(&sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, layout.sectors) < 0) {
+        fs_log(TRACE_ERRORS, "___ formatting the bitmaps failed\n");
         return -1;
-    }//read the sector on which new inode lies
+    }
+    memset(inode_bitmap.dirty, 1, inode_bitmap.nsectors);
+    memset(sector_bitmap.dirty, 1, sector_bitmap.nsectors);
 
-    sector_num = parent_inode_sector - INODE_TABLE_START_SECTOR;//number of sectors from start on which parent inode lies
-    offset = parent_inode - sector_num * INODES_PER_SECTOR ;//going to byte where parent inode to be stored
+    bitmap_set(&inode_bitmap, 0);
+    for(sector_t s = 0; s < DATABLOCK_START_SECTOR; s++)
+        bitmap_set(&sector_bitmap, s);
+    return (bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0) ? -1 : 0;
+}
 
-    inode_t* parent = (inode_t*)(buf + offset*sizeof(inode_t));
+// allocate a free data sector, -1 if the disk is full. Sectors
+// promised to delayed blocks count as taken
+static sector_t alloc_sector() {
+    sector_t sector = -1;
+    pthread_mutex_lock(&sector_bitmap.lock);
+    if(sector_bitmap.nfree > delalloc_reserved)
+        sector = bitmap_alloc(&sector_bitmap);
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    return sector;
+}
 
-    if( parent->type != 1 ) {
-        printf("___ parent not directory returning -2\n");
-        return -2;
-    }//Parent is not directory
+// allocate up to 'want' consecutive data sectors, preferably starting
+// at 'goal'; see bitmap_alloc_run(). Sectors promised to delayed blocks
+// count as taken, except the first 'reserved' of them, which are the
+// caller's own and are used up first
+static sector_t alloc_sectors(sector_t goal, int want, int reserved, int* got) {
+    trace(TRACE_STEPS, 'B', FS_EV_SECTOR_ALLOC, -1, goal, want);
+    pthread_mutex_lock(&sector_bitmap.lock);
+    sector_t left = sector_bitmap.nfree - delalloc_reserved + reserved;
+    if(want > left)
+        want = left > 0 ? (int)left : 0;
+    sector_t sector = bitmap_alloc_run(&sector_bitmap, goal, want, got);
+    if(sector >= 0)
+        delalloc_reserved -= *got < reserved ? *got : reserved;
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    trace(TRACE_STEPS, 'E', FS_EV_SECTOR_ALLOC, -1, sector, sector >= 0 ? *got : 0);
+    return sector;
+}
 
-        //Calculations for  dirent_t of  directory
-    int number_of_entries = parent->size;
-    int sector_sub = number_of_entries/DIRENTS_PER_SECTOR;
-    char dirent_buf[ SECTOR_SIZE ];
+// promise 'count' free data sectors to delayed blocks, -1 if fewer than
+// that are left
+static int delalloc_reserve(int count) {
+    int rc = 0;
+    pthread_mutex_lock(&sector_bitmap.lock);
+    if(sector_bitmap.nfree - delalloc_reserved < count)
+        rc = -1;
+    else
+        delalloc_reserved += count;
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    return rc;
+}
 
-    if( ( sector_sub * DIRENTS_PER_SECTOR) == number_of_entries )// New sector is needed as rest sectors are full
-    {
-        if( sector_sub == 30) {
-            printf("___ sector sub is 30 returning -1\n");
-            return -1;
-        }//Parent directory is full with its capacity to have subdirectories/files
+// change the promised sectors by 'count' without checking, for giving
+// them back or taking back ones that were just freed
+static void delalloc_adjust(int count) {
+    pthread_mutex_lock(&sector_bitmap.lock);
+    delalloc_reserved += count;
+    pthread_mutex_unlock(&sector_bitmap.lock);
+}
 
-        int new_sector = first_unused_bit( SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE );//get the sector number for new sector
-        parent->data[sector_sub] = new_sector ;//making entry in parent's inode for new sector
-        memset( dirent_buf, 0, SECTOR_SIZE );//filling dirent buffer with 0, because we had created neww
-                                            //new secctor, and we will write dirent buffer on that sector
-                                            // so it should be clear, unless it may write some garbage 
-        printf("___ New sector is created,with sector number %d\n", new_sector);
-    }
-    else
-    {
-        if( Disk_Read( parent->data[sector_sub], dirent_buf) < 0 ) {
-            printf("___ Disk read second failed returning -1\n");
-            return -1;
-        }
+// give a data sector back to the sector bitmap; a cached copy is dropped
+// first so it cannot be written over the sector's next owner
+static void free_sector(sector_t sector) {
+    Cache_Discard(sector);
+    pthread_mutex_lock(&sector_bitmap.lock);
+    if(!journal_forget(sector) || bitmap_hold(&sector_bitmap, sector) == -1)
+        bitmap_free(&sector_bitmap, sector);
+    pthread_mutex_unlock(&sector_bitmap.lock);
+}
 
-        printf("___ Sector loaded with sector number %d, for group number \n", parent->data[sector_sub], sector_sub );
+// give 'count' data sectors starting at 'sector' back
+static void free_sectors(sector_t sector, int count) {
+    for(int i = 0; i < count; i++)
+        Cache_Discard(sector + i);
+    pthread_mutex_lock(&sector_bitmap.lock);
+    if(!journal.active)
+        bitmap_free_run(&sector_bitmap, sector, count);
+    else {
+        for(int i = 0; i < count; i++) {
+            if(!journal_forget(sector + i) || bitmap_hold(&sector_bitmap, sector + i) == -1)
+                bitmap_free(&sector_bitmap, sector + i);
+        }
     }
+    pthread_mutex_unlock(&sector_bitmap.lock);
+}
 
-    int offset_sub = parent->size - sector_sub * DIRENTS_PER_SECTOR;//to calculate where the new entry to be made
+// allocate a free inode number, -1 if there is none left
+static int alloc_inode_number() {
+    trace(TRACE_STEPS, 'B', FS_EV_INODE_ALLOC, -1, -1, 0);
+    pthread_mutex_lock(&inode_bitmap.lock);
+    int inode = (int)bitmap_alloc(&inode_bitmap);
+    pthread_mutex_unlock(&inode_bitmap.lock);
+    trace(TRACE_STEPS, 'E', FS_EV_INODE_ALLOC, inode, -1, 0);
+    return inode;
+}
 
-    dirent_t* sub = ( dirent_t*)( dirent_buf + offset_sub * sizeof(dirent_t) );//tofetch  out the dirent structure from dirent buf
+// give an inode number back to the inode bitmap
+static void free_inode_number(int inode) {
+    pthread_mutex_lock(&inode_bitmap.lock);
+    bitmap_free(&inode_bitmap, inode);
+    pthread_mutex_unlock(&inode_bitmap.lock);
+}
 
-    sub->inode = child_inode_number;//to make inode entry in dirent structure
-    strncpy( sub->fname, file, MAX_NAME );//to make file_name entry in dirent structre
+// 1 if inode number 'inode' is allocated, i.e. still names a file or
+// directory
+static int inode_in_use(int inode) {
+    pthread_mutex_lock(&inode_bitmap.lock);
+    int used = inode >= 0 && inode < inode_bitmap.nbits && bitmap_test(&inode_bitmap, inode);
+    pthread_mutex_unlock(&inode_bitmap.lock);
+    return used;
+}
 
-    if( Disk_Write( parent->data[sector_sub], dirent_buf) < 0 ) {
-        printf("___ Disk write second failed returning -1\n");
-        return -1;
-    }
+/*******************IN-CORE INODE TABLE*******************/
 
-    parent->size++;
+static icache_entry_t* icache_at(int e) {
+    return &icache_chunks[e / ICACHE_CHUNK][e % ICACHE_CHUNK];
+}
 
-    if( Disk_Write( parent_inode_sector, buf) < 0 ) {
-        printf("___ Disk write third failed returning -1\n");
+// add a chunk of entries to the in-core inode table, with twice as many
+// hash chains as entries; -1 if it is as large as it gets or out of
+// memory. Called with icache_lock held
+static int icache_grow() {
+    int c = icache_size / ICACHE_CHUNK;
+    if(c == ICACHE_MAX_CHUNKS)
+        return -1;
+    icache_entry_t* chunk = (icache_entry_t*)calloc(ICACHE_CHUNK, sizeof(icache_entry_t));
+    int nbuckets = icache_nbuckets > 0 ? icache_nbuckets : 1;
+    while(nbuckets < 2 * (icache_size + ICACHE_CHUNK))
+        nbuckets *= 2;
+    int* buckets = (int*)malloc(sizeof(int) * nbuckets);
+    if(chunk == NULL || buckets == NULL) {
+        free(chunk);
+        free(buckets);
         return -1;
     }
-
+    for(int i = 0; i < ICACHE_CHUNK; i++) {
+        pthread_rwlock_init(&chunk[i].lock, NULL);
+        chunk[i].inum = -1;
+    }
+    icache_chunks[c] = chunk;
+
+    for(int b = 0; b < nbuckets; b++)
+        buckets[b] = -1;
+    for(int e = 0; e < icache_size; e++) {
+        icache_entry_t* entry = icache_at(e);
+        if(entry->inum != -1) {
+            entry->next = buckets[entry->inum & (nbuckets - 1)];
+            buckets[entry->inum & (nbuckets - 1)] = e;
+        }
+    }
+    free(icache_buckets);
+    icache_buckets = buckets;
+    icache_nbuckets = nbuckets;
+    icache_hand = icache_size; // straight to the new entries
+    icache_size += ICACHE_CHUNK;
     return 0;
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
-{
-  int child_inode;
-  char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  if(parent_inode >= 0) {
-    if(child_inode >= 0) {
-      printf("___ file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
-      return -1;
-    } else {
-      if(add_inode(type, parent_inode, last_fname) >= 0) {
-    printf("___ successfully created file/directory: '%s'\n", pathname);
-    return 0;
-      } else {
-    printf("___ error: something wrong with adding child inode\n");
-    osErrno = E_CREATE;
-    return -1;
-      }
+// drop every in-core inode, used when the disk is (re)loaded; the table
+// keeps the size it grew to
+static void icache_init() {
+    if(icache_size == 0 && icache_grow() == -1) {
+        fs_log(TRACE_ERRORS, "___ out of memory for the in-core inode table\n");
+        exit(1);
     }
-  } else {
-    printf("___ error: something wrong with the file/path: '%s'\n", pathname);
-    osErrno = E_CREATE;
-    return -1;
-  }
+    for(int i = 0; i < icache_size; i++) {
+        icache_entry_t* entry = icache_at(i);
+        entry->inum = -1;
+        entry->refs = 0;
+        entry->dirty = 0;
+        entry->opens = 0;
+        free(entry->delayed); // delayed blocks of the last disk are lost like the rest of it
+        entry->delayed = NULL;
+        entry->ndelayed = entry->delayed_cap = 0;
+    }
+    delalloc_reserved = 0;
+    icache_pinned = 0;
+    for(int i = 0; i < icache_nbuckets; i++)
+        icache_buckets[i] = -1;
+    icache_hand = 0;
 }
 
+// returns the in-core entry for 'inum', -1 if it is not resident
+static int icache_lookup(int inum) {
+    int e;
+    for(e = icache_buckets[inum & (icache_nbuckets - 1)]; e != -1; e = icache_at(e)->next)
+        if(icache_at(e)->inum == inum)
+            return e;
+    return -1;
+}
 
-// helper function to unlink the file from the parent node
-int unlink_helper(int parent_inode,int child_inode) {
-    char inode_buffer[SECTOR_SIZE];
-    int inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-    if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-    printf("___ load inode table for parent inode %d from disk sector %d\n",
-            parent_inode, inode_sector);
-
-    // parent inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = parent_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-    printf("___ get parent inode %d (size=%d, type=%d)\n",
-            parent_inode, parent->size, parent->type);
-
-    if(parent->size > 0)
-        parent->size--;
-    if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    printf("___ update parent inode on disk sector %d\n", inode_sector);
-
-    int i;
-    for(i = 0; i < 30; i++) {
-        int sector_data = parent->data[i];
-        char sector_buffer[SECTOR_SIZE];
-
-        Disk_Read(sector_data, sector_buffer);
-
-        int j;
-        for(j = 0; j < 25; j++){
-            dirent_t * entry = (dirent_t*)(sector_buffer + (j*20)); //get all the data from the sector
+// write back every dirty in-core inode living in inode-table 'sector'
+// with a single pass over that sector. Inodes other threads hold may be
+// half way through a change, they are only included with 'held_too'
+// (when every other call is locked out). Delayed blocks are left out of
+// the size written, the table only covers blocks that have sectors
+static int icache_write_sector(sector_t sector, int held_too) {
+    int first = (sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
+    trace(TRACE_STEPS, 'B', FS_EV_INODE_STORE, first, sector, 0);
+    char* buf = Cache_Get(sector);
+    if(buf == NULL) {
+        trace(TRACE_STEPS, 'E', FS_EV_INODE_STORE, first, sector, -1);
+        return -1;
+    }
 
-            if(entry->inode == child_inode){
-                memset(entry, 0, sizeof(dirent_t));
-                Disk_Write(sector_data, sector_buffer);
-                return 0;
-            }
+    for(int i = 0; i < INODES_PER_SECTOR; i++) {
+        int e = icache_lookup(first + i);
+        icache_entry_t* entry = e == -1 ? NULL : icache_at(e);
+        if(entry != NULL && entry->dirty && (held_too || entry->refs == 0)) {
+            inode_t* d = (inode_t*)(buf + i*sizeof(inode_t));
+            memcpy(d, &entry->d, sizeof(inode_t));
+            if(entry->ndelayed > 0)
+                d->size = ((d->size + SECTOR_SIZE - 1) / SECTOR_SIZE - entry->ndelayed) * SECTOR_SIZE;
+            entry->dirty = 0;
         }
     }
-    return -1; // error when unlinking
+    meta_put(buf, 1);
+    trace(TRACE_STEPS, 'E', FS_EV_INODE_STORE, first, sector, 0);
+    return 0;
 }
 
+// write back all dirty in-core inodes, batched per inode-table sector;
+// only called with fs_lock held exclusively
+static int icache_flush() {
+    int rc = 0;
+    pthread_mutex_lock(&icache_lock);
+    for(int e = 0; e < icache_size && rc == 0; e++) {
+        if(icache_at(e)->inum != -1 && icache_at(e)->dirty)
+            rc = icache_write_sector(INODE_TABLE_START_SECTOR + icache_at(e)->inum/INODES_PER_SECTOR, 1);
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return rc;
+}
 
-// reset 'num_bit'th bit with 'num' sectors starting at 'start' sector
-//0 = success -1 = failure
-static int reset_bitmap(int start, int num, int num_bit) {
+// pick an unreferenced entry to reuse (CLOCK), writing it back if needed;
+// a table mostly pinned (by open files) grows instead of being scanned
+static int icache_evict() {
+    if(icache_pinned >= icache_size / 4 * 3 && icache_grow() == 0)
+        return icache_hand++;
+    for(int scanned = 0; scanned < 2*icache_size; scanned++) {
+        int e = icache_hand;
+        icache_entry_t* entry = icache_at(e);
+        icache_hand = (icache_hand + 1) % icache_size;
+
+        if(entry->refs > 0)
+            continue;
+        if(entry->inum == -1)
+            return e;
+        if(entry->ref) { // second chance
+            entry->ref = 0;
+            continue;
+        }
+        if(entry->dirty &&
+           icache_write_sector(INODE_TABLE_START_SECTOR + entry->inum/INODES_PER_SECTOR, 0) < 0)
+            return -1;
 
-    int max_bits = SECTOR_SIZE * 8;
-    int temp_bit = num_bit - 1;
-    int bit_num = temp_bit%max_bits; // bit location on "last" sector
-    int sector_location = (temp_bit/max_bits) + start; // temp_bit/max_bits is always going to be 0??
+        int* link = &icache_buckets[entry->inum & (icache_nbuckets - 1)];
+        while(*link != e)
+            link = &icache_at(*link)->next;
+        *link = entry->next;
+        entry->inum = -1;
+        return e;
+    }
+    fs_log(TRACE_ERRORS, "___ in-core inode table full\n");
+    osErrno = E_TOO_MANY_OPEN_FILES;
+    return -1;
+}
 
-    if(num_bit > max_bits)
-        return -1; // ibit is not in scope
+// helper function to get a specific inode_t from its inode number; the
+// inode stays resident until the matching put_inode(). Its contents are
+// only safe to use under inode_lock()
+inode_t* get_inode(int child_inode) {
+    if(child_inode < 0)
+        return NULL;
+    pthread_mutex_lock(&icache_lock);
+    int e = icache_lookup(child_inode);
+
+    if(e == -1) {
+        sector_t inode_sector = INODE_TABLE_START_SECTOR + child_inode/INODES_PER_SECTOR; // Caculate sector number which hs inode
+        int child_loc = child_inode % INODES_PER_SECTOR; // Calculating actual position of inode in its sector
+
+        char* inode_buffer = NULL;
+        trace(TRACE_STEPS, 'B', FS_EV_INODE_LOAD, child_inode, inode_sector, 0);
+        if((e = icache_evict()) < 0 || (inode_buffer = Cache_Get(inode_sector)) == NULL) {
+            if(e >= 0)
+                osErrno = E_GENERAL;
+            trace(TRACE_STEPS, 'E', FS_EV_INODE_LOAD, child_inode, inode_sector, -1);
+            pthread_mutex_unlock(&icache_lock);
+            return NULL;
+        }
+        icache_entry_t* entry = icache_at(e);
+        memcpy(&entry->d, inode_buffer + child_loc*sizeof(inode_t), sizeof(inode_t));
+        Cache_Put(inode_buffer, 0);
+        trace(TRACE_STEPS, 'E', FS_EV_INODE_LOAD, child_inode, inode_sector, 0);
+
+        entry->inum = child_inode;
+        entry->dirty = 0;
+        entry->next = icache_buckets[child_inode & (icache_nbuckets - 1)];
+        icache_buckets[child_inode & (icache_nbuckets - 1)] = e;
+    }
 
-    printf("num value: %d\n", num);
-    printf("max_bits values: %d\n", max_bits);
-    printf("start value from bitmap_reset: %d\n", start);
-    printf("sector location from bitmap_reset: %d\n", sector_location);
+    icache_entry_t* entry = icache_at(e);
+    if(entry->refs++ == 0)
+        icache_pinned++;
+    entry->ref = 1;
+    pthread_mutex_unlock(&icache_lock);
+    return &entry->d;
+}
 
-    if(bit_num==0) {
-        sector_location -= 1;
-        bit_num = max_bits;
-    }
+// release an inode obtained from get_inode(); 'dirty' schedules it for
+// write back to the inode table
+void put_inode(inode_t* inode, int dirty) {
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    pthread_mutex_lock(&icache_lock);
+    if(dirty)
+        entry->dirty = 1;
+    if(--entry->refs == 0)
+        icache_pinned--;
+    pthread_mutex_unlock(&icache_lock);
+}
 
+// flag an inode that stays pinned (e.g. by an open file) as changed
+static void mark_inode_dirty(inode_t* inode) {
+    pthread_mutex_lock(&icache_lock);
+    ((icache_entry_t*)inode)->dirty = 1;
+    pthread_mutex_unlock(&icache_lock);
+}
 
-    char buffer[SECTOR_SIZE];
-    Disk_Read(sector_location, buffer);
+// lock an inode got from get_inode() for reading, or with 'write' for
+// changing it or anything it owns (entries, block map, data sectors)
+static void inode_lock(inode_t* inode, int write) {
+    pthread_rwlock_t* lock = &((icache_entry_t*)inode)->lock;
+    if(write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+}
 
-    int byte_location = bit_num/8;
-    int bit_location = bit_num%8;
+static void inode_unlock(inode_t* inode) {
+    pthread_rwlock_unlock(&((icache_entry_t*)inode)->lock);
+}
 
-    int temp_buffer = buffer[byte_location];
-    int mask = 255 - ipow(2, 7-bit_location);
+/*******************DENTRY CACHE*******************/
 
-    buffer[byte_location] = temp_buffer & mask;
-    Disk_Write(sector_location, buffer);
+// forget every cached path component, used when the disk is (re)loaded
+static void dcache_init() {
+    for(int i = 0; i < DCACHE_SIZE; i++)
+        dcache[i].parent = -1;
+    for(int i = 0; i < DCACHE_BUCKETS; i++)
+        dcache_buckets[i] = -1;
+    dcache_hand = 0;
+}
 
-    return 0;
+// FNV-1a hash of a file name, seeded so different directories spread out
+static unsigned int name_hash(unsigned int seed, char* name) {
+    unsigned int h = 2166136261u ^ seed;
+    for(; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
 
+static int dcache_hash(int parent, char* name) {
+    return name_hash((unsigned int)parent, name) & (DCACHE_BUCKETS - 1);
 }
 
+// returns the entry for 'name' in directory 'parent', -1 if not cached
+static int dcache_find(int parent, char* name) {
+    int e;
+    for(e = dcache_buckets[dcache_hash(parent, name)]; e != -1; e = dcache[e].next)
+        if(dcache[e].parent == parent && !strcmp(dcache[e].name, name))
+            return e;
+    return -1;
+}
 
-//check if file or directory 0 if directory 1 if file
-int get_path_type(char* pathname) {
+static void dcache_remove(int e) {
+    int* link = &dcache_buckets[dcache_hash(dcache[e].parent, dcache[e].name)];
+    while(*link != e)
+        link = &dcache[*link].next;
+    *link = dcache[e].next;
+    dcache[e].parent = -1;
+}
+
+// look 'name' up in directory 'parent'; returns 1 and sets *inode (-1
+// for a negative entry) on a hit, 0 on a miss
+static int dcache_lookup(int parent, char* name, int* inode) {
+    if(!dcache_enabled)
+        return 0;
+    pthread_mutex_lock(&dcache_lock);
+    int e = dcache_find(parent, name);
+    if(e != -1) {
+        dcache[e].ref = 1;
+        *inode = dcache[e].inode;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return e != -1;
+}
+
+// remember the result of a directory scan, recycling entries with CLOCK;
+// called with the directory locked so the result cannot be stale
+static void dcache_insert(int parent, char* name, int inode) {
+    if(!dcache_enabled)
+        return;
+    pthread_mutex_lock(&dcache_lock);
+    int e = dcache_find(parent, name);
+    if(e == -1) {
+        for(;;) {
+            e = dcache_hand;
+            dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+            if(dcache[e].parent == -1)
+                break;
+            if(!dcache[e].ref) {
+                dcache_remove(e);
+                break;
+            }
+            dcache[e].ref = 0; // second chance
+        }
+        dcache[e].parent = parent;
+        strncpy(dcache[e].name, name, MAX_NAME);
+        dcache[e].name[MAX_NAME-1] = '\0';
+        int h = dcache_hash(parent, name);
+        dcache[e].next = dcache_buckets[h];
+        dcache_buckets[h] = e;
+    }
+    dcache[e].inode = inode;
+    dcache[e].ref = 1;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// drop the entry for 'name' in directory 'parent' after it changed
+static void dcache_invalidate(int parent, char* name) {
+    pthread_mutex_lock(&dcache_lock);
+    int e = dcache_find(parent, name);
+    if(e != -1)
+        dcache_remove(e);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// drop every entry under directory 'parent', whose inode number is
+// about to be freed and may be reused by an unrelated directory
+static void dcache_purge_dir(int parent) {
+    pthread_mutex_lock(&dcache_lock);
+    for(int e = 0; e < DCACHE_SIZE; e++)
+        if(dcache[e].parent == parent)
+            dcache_remove(e);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/*******************DIRECTORY FORMATS*******************/
+
+// linear directories keep their 'size' entries packed at the start of
+// the sectors in data[]. Hashed directories are extendible hash tables:
+// the low 'depth' bits of a name's hash pick one of the 2^depth slots of
+// a table kept in sectors of DIR_SLOTS_PER_PAGE slots, and each slot
+// holds the sector of a bucket. A bucket with a local depth of d holds
+// the names whose hash ends in the same d bits, so 2^(depth-d) slots
+// share it. A full bucket splits in two by the next bit, and the table
+// doubles when that bit is beyond its depth; only at DIR_MAX_DEPTH do
+// full buckets get overflow sectors chained to them. A lookup reads a
+// table sector and a bucket whatever the size of the directory
+
+// cursor for walking the entries of a directory of either format
+typedef struct dir_iter {
+    int index;       // linear: next entry; hashed: next slot of the table
+    sector_t sector; // hashed: sector of the bucket being walked, 0 for none
+    int slot;        // hashed: next entry in 'sector'
+} dir_iter_t;
+
+static int is_directory(inode_t* inode) {
+    return inode->type != 0;
+}
+
+// allocate a zero-filled sector for a hashed directory, -1 if the disk is full
+static sector_t dir_alloc() {
+    sector_t sector = alloc_sector();
+    if(sector < 0)
+        return -1;
+    char* buf = Cache_GetNew(sector);
+    if(buf == NULL) {
+        free_sector(sector);
+        return -1;
+    }
+    meta_put(buf, 1);
+    return sector;
+}
+
+// sector holding page 'page' of the table of hashed directory 'dir':
+// the first DIR_DIRECT_PAGES are in the inode, the rest are reached
+// through two levels of pointer sectors from hash.indirect. With
+// 'create' a missing page and the pointer sectors leading to it are
+// allocated. 0 if there is no such page, -1 on a disk error or a full disk
+static sector_t dir_page(inode_t* dir, int page, int create) {
+    if(page < DIR_DIRECT_PAGES) {
+        if(dir->hash.pages[page] == 0 && create && (dir->hash.pages[page] = dir_alloc()) < 0) {
+            dir->hash.pages[page] = 0;
+            return -1;
+        }
+        return dir->hash.pages[page];
+    }
+    if(dir->hash.indirect == 0) {
+        if(!create)
+            return 0;
+        if((dir->hash.indirect = dir_alloc()) < 0) {
+            dir->hash.indirect = 0;
+            return -1;
+        }
+    }
+    page -= DIR_DIRECT_PAGES;
+    int index[2] = {page / DIR_SLOTS_PER_PAGE, page % DIR_SLOTS_PER_PAGE};
+    sector_t sector = dir->hash.indirect;
+    for(int level = 0; level < 2 && sector > 0; level++) {
+        sector_t* pointers = (sector_t*)Cache_Get(sector);
+        if(pointers == NULL)
+            return -1;
+        sector = pointers[index[level]];
+        if(sector == 0 && create) {
+            if((sector = dir_alloc()) < 0) {
+                Cache_Put((char*)pointers, 0);
+                return -1;
+            }
+            pointers[index[level]] = sector;
+            meta_put((char*)pointers, 1);
+        }
+        else
+            Cache_Put((char*)pointers, 0);
+    }
+    return sector;
+}
+
+// bucket sector in slot 'slot' of the table of 'dir', -1 on a disk error
+static sector_t dir_slot(inode_t* dir, unsigned slot) {
+    sector_t page = dir_page(dir, slot / DIR_SLOTS_PER_PAGE, 0);
+    if(page <= 0)
+        return -1; // every page of the table exists
+    sector_t* slots = (sector_t*)Cache_Get(page);
+    if(slots == NULL)
+        return -1;
+    sector_t sector = slots[slot % DIR_SLOTS_PER_PAGE];
+    Cache_Put((char*)slots, 0);
+    return sector;
+}
+
+// point slots 'first', 'first' + 'stride', ... of the table of 'dir' at
+// bucket 'sector'
+static int dir_point(inode_t* dir, unsigned first, unsigned stride, sector_t sector) {
+    unsigned slots = 1u << dir->hash.depth;
+    for(unsigned s = first; s < slots; ) {
+        sector_t page = dir_page(dir, s / DIR_SLOTS_PER_PAGE, 0);
+        if(page <= 0)
+            return -1;
+        sector_t* table = (sector_t*)Cache_Get(page);
+        if(table == NULL)
+            return -1;
+        unsigned end = (s / DIR_SLOTS_PER_PAGE + 1) * DIR_SLOTS_PER_PAGE;
+        for(; s < slots && s < end; s += stride)
+            table[s % DIR_SLOTS_PER_PAGE] = sector;
+        meta_put((char*)table, 1);
+    }
+    return 0;
+}
+
+// double the table of 'dir'; the new upper half points where the lower
+// half does, and the depth only goes up once it is all there
+static int dir_double(inode_t* dir) {
+    unsigned slots = 1u << dir->hash.depth;
+    if(slots < DIR_SLOTS_PER_PAGE) { // still within the first page
+        sector_t* table = (sector_t*)Cache_Get(dir->hash.pages[0]);
+        if(table == NULL)
+            return -1;
+        memcpy(table + slots, table, slots * sizeof(sector_t));
+        meta_put((char*)table, 1);
+    }
+    else {
+        int pages = slots / DIR_SLOTS_PER_PAGE;
+        for(int page = 0; page < pages; page++) {
+            sector_t from = dir_page(dir, page, 0), to = dir_page(dir, pages + page, 1);
+            if(from <= 0 || to <= 0)
+                return -1;
+            char* src = Cache_Get(from);
+            if(src == NULL)
+                return -1;
+            char* dst = Cache_Get(to);
+            if(dst == NULL) {
+                Cache_Put(src, 0);
+                return -1;
+            }
+            memcpy(dst, src, SECTOR_SIZE);
+            meta_put(dst, 1);
+            Cache_Put(src, 0);
+        }
+    }
+    dir->hash.depth++;
+    return 0;
+}
+
+// split the full bucket at 'sector' of 'dir', which the caller has
+// pinned as 'bucket' and which is released here, by the next bit of the
+// hash; the table doubles first when the bucket is as deep as it
+static int dir_split(inode_t* dir, sector_t sector, dir_bucket_t* bucket) {
+    int depth = bucket->depth;
+    unsigned bit = 1u << depth;
+    unsigned low = name_hash(0, bucket->entries[0].fname) & (bit - 1); // the same for every entry
+
+    sector_t sibling_sector;
+    dir_bucket_t* sibling;
+    if((depth == dir->hash.depth && dir_double(dir) == -1) || (sibling_sector = dir_alloc()) < 0) {
+        Cache_Put((char*)bucket, 0);
+        return -1;
+    }
+    if((sibling = (dir_bucket_t*)Cache_Get(sibling_sector)) == NULL) {
+        Cache_Put((char*)bucket, 0);
+        free_sector(sibling_sector);
+        return -1;
+    }
+    for(int i = 0; i < DIRENTS_PER_BUCKET; i++) {
+        if(bucket->entries[i].fname[0] == '\0' || !(name_hash(0, bucket->entries[i].fname) & bit))
+            continue;
+        sibling->entries[sibling->count++] = bucket->entries[i];
+        memset(&bucket->entries[i], 0, sizeof(dirent_t));
+        bucket->count--;
+        if(i < bucket->free)
+            bucket->free = i;
+    }
+    sibling->free = sibling->count;
+    bucket->depth = sibling->depth = depth + 1;
+    meta_put((char*)sibling, 1);
+    meta_put((char*)bucket, 1);
+    // the slots whose low depth + 1 bits are 'low' with 'bit' set move over
+    return dir_point(dir, low | bit, bit << 1, sibling_sector);
+}
+
+// sector of the bucket for names hashing to 'hash' in hashed directory
+// 'dir', 0 if it has no table yet and -1 on a disk error
+static sector_t dir_bucket_of(inode_t* dir, unsigned hash) {
+    if(dir->hash.pages[0] == 0)
+        return 0;
+    return dir_slot(dir, hash & ((1u << dir->hash.depth) - 1));
+}
+
+// returns the inode stored under 'name' in 'dir', -1 if there is none
+// and -2 on a disk error
+static int dir_lookup(inode_t* dir, char* name) {
+    if(dir->type == FS_DIR_HASHED) {
+        sector_t sector = dir_bucket_of(dir, name_hash(0, name));
+        if(sector <= 0)
+            return sector == 0 ? -1 : -2;
+
+        while(sector != 0) { // overflow sectors only past DIR_MAX_DEPTH
+            dir_bucket_t* bucket = (dir_bucket_t*)Cache_Get(sector);
+            if(bucket == NULL)
+                return -2;
+            for(int i = 0; i < DIRENTS_PER_BUCKET; i++) {
+                if(bucket->entries[i].fname[0] != '\0' && !strncmp(bucket->entries[i].fname, name, MAX_NAME)) {
+                    int inode = bucket->entries[i].inode;
+                    Cache_Put((char*)bucket, 0);
+                    return inode;
+                }
+            }
+            sector_t next = bucket->next;
+            Cache_Put((char*)bucket, 0);
+            sector = next;
+        }
+        return -1;
+    }
+
+    for(int s = 0; s * DIRENTS_PER_SECTOR < dir->size; s++) {
+        dirent_t* dirents = (dirent_t*)Cache_Get(dir->data[s]);
+        if(dirents == NULL)
+            return -2;
+        int n = dir->size - s * DIRENTS_PER_SECTOR;
+        if(n > DIRENTS_PER_SECTOR)
+            n = DIRENTS_PER_SECTOR;
+        for(int i = 0; i < n; i++) {
+            if(!strncmp(dirents[i].fname, name, MAX_NAME)) {
+                int inode = dirents[i].inode;
+                Cache_Put((char*)dirents, 0);
+                return inode;
+            }
+        }
+        Cache_Put((char*)dirents, 0);
+    }
+    return -1;
+}
+
+// add the entry 'name' -> 'inode' to 'dir'; the caller writes back the
+// directory inode. Returns -1 if the directory or the disk is full
+static int dir_add(inode_t* dir, char* name, int inode) {
+    dirent_t* entry;
+
+    if(dir->type == FS_DIR_HASHED) {
+        unsigned hash = name_hash(0, name);
+        if(dir->hash.pages[0] == 0) { // the first entry: a one-slot table and its bucket
+            sector_t page = dir_alloc(), first = page < 0 ? -1 : dir_alloc();
+            sector_t* table = first < 0 ? NULL : (sector_t*)Cache_Get(page);
+            if(table == NULL) {
+                if(first >= 0)
+                    free_sector(first);
+                if(page >= 0)
+                    free_sector(page);
+                return -1;
+            }
+            table[0] = first;
+            meta_put((char*)table, 1);
+            dir->hash.pages[0] = page;
+            dir->hash.depth = 0;
+        }
+
+        dir_bucket_t* bucket;
+        for(;;) {
+            sector_t sector = dir_bucket_of(dir, hash);
+            if(sector <= 0 || (bucket = (dir_bucket_t*)Cache_Get(sector)) == NULL)
+                return -1;
+            if(bucket->count < DIRENTS_PER_BUCKET || bucket->depth == DIR_MAX_DEPTH)
+                break;
+            if(dir_split(dir, sector, bucket) == -1)
+                return -1;
+        }
+        while(bucket->count == DIRENTS_PER_BUCKET) { // as deep as it gets: the first overflow sector with room
+            sector_t next = bucket->next;
+            if(next == 0) {
+                if((next = dir_alloc()) < 0) {
+                    Cache_Put((char*)bucket, 0);
+                    return -1;
+                }
+                bucket->next = next;
+                meta_put((char*)bucket, 1);
+            }
+            else
+                Cache_Put((char*)bucket, 0);
+            if((bucket = (dir_bucket_t*)Cache_Get(next)) == NULL)
+                return -1;
+            bucket->depth = DIR_MAX_DEPTH;
+        }
+
+        int i = bucket->free;
+        while(bucket->entries[i].fname[0] != '\0')
+            i++;
+        entry = &bucket->entries[i];
+        bucket->count++;
+        bucket->free = i + 1;
+        entry->inode = inode;
+        strncpy(entry->fname, name, MAX_NAME);
+        meta_put((char*)bucket, 1);
+        dir->size++;
+        return 0;
+    }
+
+    int sector_sub = dir->size / DIRENTS_PER_SECTOR;
+    char* dirent_buf;
+    if(sector_sub * DIRENTS_PER_SECTOR == dir->size) { // New sector is needed as rest sectors are full
+        if(sector_sub == MAX_SECTORS_PER_FILE) {
+            fs_log(TRACE_TEXT, "___ linear directory is full\n");
+            return -1;
+        }
+        sector_t new_sector = alloc_sector();
+        if(new_sector < 0)
+            return -1;
+        dir->data[sector_sub] = new_sector;
+        dirent_buf = Cache_GetNew(new_sector);
+    }
+    else
+        dirent_buf = Cache_Get(dir->data[sector_sub]);
+    if(dirent_buf == NULL)
+        return -1;
+
+    entry = (dirent_t*)dirent_buf + (dir->size - sector_sub * DIRENTS_PER_SECTOR);
+    entry->inode = inode;
+    strncpy(entry->fname, name, MAX_NAME);
+    meta_put(dirent_buf, 1);
+    dir->size++;
+    return 0;
+}
+
+// remove the entry 'name' from 'dir', freeing sectors that become
+// empty (a hashed directory keeps the buckets its table points at); the
+// caller writes back the directory inode. Returns the inode the entry
+// pointed at, -1 if there was no such entry
+static int dir_remove(inode_t* dir, char* name) {
+    if(dir->type == FS_DIR_HASHED) {
+        sector_t sector = dir_bucket_of(dir, name_hash(0, name));
+        sector_t prev = 0;
+
+        while(sector > 0) {
+            dir_bucket_t* bucket = (dir_bucket_t*)Cache_Get(sector);
+            if(bucket == NULL)
+                break;
+            for(int i = 0; i < DIRENTS_PER_BUCKET; i++) {
+                if(bucket->entries[i].fname[0] == '\0' || strncmp(bucket->entries[i].fname, name, MAX_NAME))
+                    continue;
+
+                int inode = bucket->entries[i].inode;
+                memset(&bucket->entries[i], 0, sizeof(dirent_t));
+                if(i < bucket->free)
+                    bucket->free = i;
+                int unlinked = 0;
+                if(--bucket->count == 0 && prev != 0) { // unlink an empty overflow sector from its chain
+                    dir_bucket_t* before = (dir_bucket_t*)Cache_Get(prev);
+                    if(before != NULL) { // otherwise it stays in the chain, empty
+                        before->next = bucket->next;
+                        meta_put((char*)before, 1);
+                        unlinked = 1;
+                    }
+                }
+                // freed only once nothing holds or points at it, so the
+                // discard and the journal forget it for good
+                meta_put((char*)bucket, 1);
+                if(unlinked)
+                    free_sector(sector);
+                dir->size--;
+                return inode;
+            }
+            prev = sector;
+            sector = bucket->next;
+            Cache_Put((char*)bucket, 0);
+        }
+        return -1;
+    }
+
+    // linear: the last entry moves into the hole so entries stay packed
+    int last = dir->size - 1;
+    for(int s = 0; s * DIRENTS_PER_SECTOR < dir->size; s++) {
+        dirent_t* dirents = (dirent_t*)Cache_Get(dir->data[s]);
+        if(dirents == NULL)
+            return -1;
+        for(int i = 0; i < DIRENTS_PER_SECTOR && s * DIRENTS_PER_SECTOR + i <= last; i++) {
+            if(strncmp(dirents[i].fname, name, MAX_NAME))
+                continue;
+
+            int inode = dirents[i].inode;
+            dirent_t* tail = (dirent_t*)Cache_Get(dir->data[last / DIRENTS_PER_SECTOR]);
+            if(tail == NULL) {
+                Cache_Put((char*)dirents, 0);
+                return -1;
+            }
+            dirents[i] = tail[last % DIRENTS_PER_SECTOR];
+            memset(&tail[last % DIRENTS_PER_SECTOR], 0, sizeof(dirent_t));
+            meta_put((char*)tail, 1);
+            meta_put((char*)dirents, 1);
+            if(last % DIRENTS_PER_SECTOR == 0) { // last sector is now empty
+                free_sector(dir->data[last / DIRENTS_PER_SECTOR]);
+                dir->data[last / DIRENTS_PER_SECTOR] = 0;
+            }
+            dir->size--;
+            return inode;
+        }
+        Cache_Put((char*)dirents, 0);
+    }
+    return -1;
+}
+
+// fetch the next entry of 'dir' into 'out'; returns 1 for an entry, 0
+// at the end of the directory and -1 on a disk error
+static int dir_next(inode_t* dir, dir_iter_t* it, dirent_t* out) {
+    if(dir->type == FS_DIR_HASHED) {
+        if(dir->hash.pages[0] == 0)
+            return 0;
+        for(;;) {
+            if(it->sector == 0) { // move on to the next bucket, from the lowest slot pointing at it
+                if(it->index >= (1 << dir->hash.depth))
+                    return 0;
+                sector_t sector = dir_slot(dir, it->index);
+                if(sector <= 0)
+                    return -1;
+                dir_bucket_t* bucket = (dir_bucket_t*)Cache_Get(sector);
+                if(bucket == NULL)
+                    return -1;
+                if(it->index < (1 << bucket->depth))
+                    it->sector = sector;
+                it->index++;
+                it->slot = 0;
+                Cache_Put((char*)bucket, 0);
+                continue;
+            }
+            dir_bucket_t* bucket = (dir_bucket_t*)Cache_Get(it->sector);
+            if(bucket == NULL)
+                return -1;
+            for(; it->slot < DIRENTS_PER_BUCKET; it->slot++) {
+                if(bucket->entries[it->slot].fname[0] != '\0') {
+                    *out = bucket->entries[it->slot++];
+                    Cache_Put((char*)bucket, 0);
+                    return 1;
+                }
+            }
+            it->sector = bucket->next;
+            it->slot = 0;
+            Cache_Put((char*)bucket, 0);
+        }
+    }
+
+    if(it->index >= dir->size)
+        return 0;
+    dirent_t* dirents = (dirent_t*)Cache_Get(dir->data[it->index / DIRENTS_PER_SECTOR]);
+    if(dirents == NULL)
+        return -1;
+    *out = dirents[it->index % DIRENTS_PER_SECTOR];
+    Cache_Put((char*)dirents, 0);
+    it->index++;
+    return 1;
+}
+
+// free every sector owned by an empty directory
+static void dir_free(inode_t* dir) {
+    if(dir->type == FS_DIR_HASHED) {
+        if(dir->hash.pages[0] == 0)
+            return;
+        // a bucket is freed from the lowest slot pointing at it, and only
+        // after the table has been read, as its sector is not read again
+        unsigned slots = 1u << dir->hash.depth;
+        sector_t* buckets = (sector_t*)malloc(sizeof(sector_t) * slots);
+        unsigned nbuckets = 0;
+        for(unsigned s = 0; buckets != NULL && s < slots; s++) {
+            sector_t sector = dir_slot(dir, s);
+            dir_bucket_t* bucket = sector > 0 ? (dir_bucket_t*)Cache_Get(sector) : NULL;
+            if(bucket == NULL)
+                continue;
+            sector_t next = bucket->next;
+            int first = s < (1u << bucket->depth);
+            Cache_Put((char*)bucket, 0);
+            if(!first)
+                continue;
+            buckets[nbuckets++] = sector;
+            while(next != 0) { // overflow sectors have no other way in
+                dir_bucket_t* overflow = (dir_bucket_t*)Cache_Get(next);
+                if(overflow == NULL)
+                    break;
+                sector_t after = overflow->next;
+                Cache_Put((char*)overflow, 0);
+                free_sector(next);
+                next = after;
+            }
+        }
+        for(unsigned b = 0; b < nbuckets; b++)
+            free_sector(buckets[b]);
+        free(buckets);
+
+        for(int page = 0; page < DIR_DIRECT_PAGES; page++)
+            if(dir->hash.pages[page] != 0)
+                free_sector(dir->hash.pages[page]);
+        if(dir->hash.indirect != 0) {
+            sector_t* pointers = (sector_t*)Cache_Get(dir->hash.indirect);
+            for(int i = 0; pointers != NULL && i < (int)DIR_SLOTS_PER_PAGE; i++) {
+                sector_t* pages = pointers[i] != 0 ? (sector_t*)Cache_Get(pointers[i]) : NULL;
+                for(int j = 0; pages != NULL && j < (int)DIR_SLOTS_PER_PAGE; j++)
+                    if(pages[j] != 0)
+                        free_sector(pages[j]);
+                if(pages != NULL)
+                    Cache_Put((char*)pages, 0);
+                if(pointers[i] != 0)
+                    free_sector(pointers[i]);
+            }
+            if(pointers != NULL)
+                Cache_Put((char*)pointers, 0);
+            free_sector(dir->hash.indirect);
+        }
+        return;
+    }
+
+    for(int i = 0; i < MAX_SECTORS_PER_FILE; i++)
+        if(dir->data[i] != 0)
+            free_sector(dir->data[i]);
+}
+
+/*******************FILE BLOCK MAP*******************/
+
+// regular files map their blocks with extents kept in file order: the
+// first NUM_DIRECT_EXTENTS live in the inode, the next
+// EXTENTS_PER_SECTOR in the indirect block and the rest in indirect
+// blocks reached through the double-indirect block. Consecutive blocks
+// allocated next to the last extent just make that extent longer, so a
+// file written sequentially usually needs a single extent
+
+// number of blocks of file 'inode', delayed ones included
+static int file_blocks(inode_t* inode) {
+    return (inode->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+// number of blocks held by the map of file 'inode'; the delayed ones
+// (see delalloc_flush()) follow them
+static int file_mapped(inode_t* inode) {
+    return file_blocks(inode) - ((icache_entry_t*)inode)->ndelayed;
+}
+
+// allocate a zero-filled sector for the block map, 0 if the disk is full
+static sector_t map_alloc() {
+    int got;
+    sector_t sector = alloc_sectors(-1, 1, 0, &got);
+    if(sector < 0)
+        return 0;
+    char* buf = Cache_GetNew(sector);
+    if(buf == NULL) {
+        free_sector(sector);
+        return 0;
+    }
+    meta_put(buf, 1);
+    return sector;
+}
+
+// find the indirect block holding extent 'e' (past the direct ones) and
+// its slot there; with 'create' missing map blocks are allocated.
+// Returns 0 if the block does not exist or cannot be allocated
+static sector_t map_sector(inode_t* inode, int e, int create, int* slot) {
+    e -= NUM_DIRECT_EXTENTS;
+    if(e < EXTENTS_PER_SECTOR) {
+        if(inode->map.indirect == 0 && create)
+            inode->map.indirect = map_alloc();
+        *slot = e;
+        return inode->map.indirect;
+    }
+
+    e -= EXTENTS_PER_SECTOR;
+    *slot = e % EXTENTS_PER_SECTOR;
+    if(inode->map.dindirect == 0) {
+        if(!create || (inode->map.dindirect = map_alloc()) == 0)
+            return 0;
+    }
+    sector_t* pointers = (sector_t*)Cache_Get(inode->map.dindirect);
+    if(pointers == NULL)
+        return 0;
+    sector_t sector = pointers[e / EXTENTS_PER_SECTOR];
+    if(sector == 0 && create) {
+        sector = map_alloc();
+        pointers[e / EXTENTS_PER_SECTOR] = sector;
+    }
+    meta_put((char*)pointers, sector != 0 && create);
+    return sector;
+}
+
+// read extent 'e' of file 'inode' into 'ext', through the indirect
+// block copy kept by 'cursor' when there is one
+static int extent_get(inode_t* inode, map_cursor_t* cursor, int e, extent_t* ext) {
+    int slot;
+    if(e < NUM_DIRECT_EXTENTS) {
+        *ext = inode->map.extents[e];
+        return 0;
+    }
+    sector_t sector = map_sector(inode, e, 0, &slot);
+    if(sector == 0)
+        return -1;
+    if(cursor == NULL) {
+        char* buf = Cache_Get(sector);
+        if(buf == NULL)
+            return -1;
+        *ext = ((extent_t*)buf)[slot];
+        Cache_Put(buf, 0);
+        return 0;
+    }
+    if(cursor->extents == NULL && (cursor->extents = malloc(SECTOR_SIZE)) == NULL)
+        return extent_get(inode, NULL, e, ext);
+    if(cursor->sector != sector) {
+        if(Cache_Read(sector, (char*)cursor->extents) == -1)
+            return -1;
+        cursor->sector = sector;
+    }
+    *ext = cursor->extents[slot];
+    return 0;
+}
+
+// store 'ext' as extent 'e' of file 'inode', allocating map blocks as
+// needed; -1 if there is no room for them
+static int extent_put(inode_t* inode, int e, extent_t* ext) {
+    int slot;
+    if(e < NUM_DIRECT_EXTENTS) {
+        inode->map.extents[e] = *ext;
+        return 0;
+    }
+    sector_t sector = map_sector(inode, e, 1, &slot);
+    if(sector == 0)
+        return -1;
+    char* buf = Cache_Get(sector);
+    if(buf == NULL)
+        return -1;
+    ((extent_t*)buf)[slot] = *ext;
+    meta_put(buf, 1);
+    return 0;
+}
+
+// void the lookups every cursor has cached for file 'inode', needed
+// whenever its block map changes; cursors notice on their next use
+static void map_changed(inode_t* inode) {
+    ((icache_entry_t*)inode)->map_gen++;
+}
+
+// sector holding 'block' of file 'inode', -1 past the end of the map;
+// *run is set to the number of blocks from 'block' on that follow it
+// on consecutive sectors. Lookups at or after the one remembered by
+// 'cursor' (which may be NULL) resume from there
+static sector_t file_bmap(inode_t* inode, map_cursor_t* cursor, int block, int* run) {
+    int e = 0, first = 0;
+    extent_t ext;
+
+    if(cursor != NULL && cursor->gen != ((icache_entry_t*)inode)->map_gen) {
+        cursor->ext = -1;
+        cursor->sector = -1;
+        cursor->gen = ((icache_entry_t*)inode)->map_gen;
+    }
+    if(cursor != NULL && cursor->ext >= 0 && block >= cursor->first) {
+        e = cursor->ext;
+        first = cursor->first;
+    }
+    for(; e < inode->map.nextents; e++) {
+        if(extent_get(inode, cursor, e, &ext) == -1)
+            return -1;
+        if(block < first + ext.length) {
+            if(cursor != NULL) {
+                cursor->ext = e;
+                cursor->first = first;
+            }
+            *run = first + ext.length - block;
+            return ext.start + block - first;
+        }
+        first += ext.length;
+    }
+    return -1;
+}
+
+// shrink the map of file 'inode' to its first 'blocks' blocks, freeing
+// the data sectors past them and the map blocks no longer needed
+static void file_truncate(inode_t* inode, int blocks) {
+    int e, kept = 0;
+    extent_t ext;
+
+    map_changed(inode);
+    for(e = 0; e < inode->map.nextents && kept < blocks; e++) {
+        if(extent_get(inode, NULL, e, &ext) == -1)
+            break;
+        if(kept + ext.length > blocks) {
+            int keep = blocks - kept;
+            free_sectors(ext.start + keep, ext.length - keep);
+            ext.length = keep;
+            extent_put(inode, e, &ext);
+        }
+        kept += ext.length;
+    }
+    int nextents = e;
+    for(; e < inode->map.nextents; e++) {
+        if(extent_get(inode, NULL, e, &ext) == 0)
+            free_sectors(ext.start, ext.length);
+    }
+    inode->map.nextents = nextents;
+
+    int indirect = nextents - NUM_DIRECT_EXTENTS - EXTENTS_PER_SECTOR; // extents under dindirect
+    if(inode->map.dindirect != 0) {
+        int needed = indirect > 0 ? (indirect + EXTENTS_PER_SECTOR - 1) / EXTENTS_PER_SECTOR : 0;
+        sector_t* pointers = (sector_t*)Cache_Get(inode->map.dindirect);
+        if(pointers != NULL) {
+            for(int i = needed; i < POINTERS_PER_SECTOR; i++) {
+                if(pointers[i] != 0) {
+                    free_sector(pointers[i]);
+                    pointers[i] = 0;
+                }
+            }
+            meta_put((char*)pointers, 1);
+        }
+        if(needed == 0) {
+            free_sector(inode->map.dindirect);
+            inode->map.dindirect = 0;
+        }
+    }
+    if(nextents <= NUM_DIRECT_EXTENTS && inode->map.indirect != 0) {
+        free_sector(inode->map.indirect);
+        inode->map.indirect = 0;
+    }
+}
+
+// append 'count' newly allocated blocks to the map of file 'inode', the
+// first 'reserved' of them on sectors delalloc_reserve() promised. On
+// failure the map is left as it was and osErrno is E_NO_SPACE (disk
+// full) or E_FILE_TOO_BIG (the file is too fragmented to map them)
+static int file_grow(inode_t* inode, int count, int reserved) {
+    int inum = ((icache_entry_t*)inode)->inum;
+    int old_blocks = file_mapped(inode);
+    int used = 0; // promised sectors allocated so far
+    extent_t last = {0, 0};
+
+    trace(TRACE_STEPS, 'B', FS_EV_FILE_GROW, inum, -1, count);
+    map_changed(inode);
+    if(inode->map.nextents > 0 && extent_get(inode, NULL, inode->map.nextents - 1, &last) == -1) {
+        trace(TRACE_STEPS, 'E', FS_EV_FILE_GROW, inum, -1, -1);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    while(count > 0) {
+        int n = inode->map.nextents, got;
+        sector_t start = alloc_sectors(n > 0 ? last.start + last.length : -1, count, reserved - used, &got);
+        if(start < 0) {
+            osErrno = E_NO_SPACE;
+            break;
+        }
+        used += got < reserved - used ? got : reserved - used;
+        if(n > 0 && start == last.start + last.length) {
+            last.length += got;
+            if(extent_put(inode, n - 1, &last) == -1) { // only direct extents and loaded map blocks here
+                free_sectors(start, got);
+                osErrno = E_GENERAL;
+                break;
+            }
+        }
+        else if(n == MAX_EXTENTS) {
+            free_sectors(start, got);
+            osErrno = E_FILE_TOO_BIG;
+            break;
+        }
+        else {
+            last.start = start;
+            last.length = got;
+            if(extent_put(inode, n, &last) == -1) {
+                free_sectors(start, got);
+                osErrno = E_NO_SPACE;
+                break;
+            }
+            inode->map.nextents++;
+        }
+        count -= got;
+    }
+    if(count > 0) {
+        file_truncate(inode, old_blocks);
+        delalloc_adjust(used); // still promised
+        trace(TRACE_STEPS, 'E', FS_EV_FILE_GROW, inum, -1, -1);
+        return -1;
+    }
+    trace(TRACE_STEPS, 'E', FS_EV_FILE_GROW, inum, -1, 0);
+    return 0;
+}
+
+/*******************DELAYED ALLOCATION*******************/
+
+// blocks a write adds to a file do not get sectors straight away: up to
+// delalloc_blocks of them wait in memory with the in-core inode (which
+// File_Open() keeps resident) and are given sectors all at once, next to
+// the file's last extent where there is room, when a descriptor is
+// closed, on FS_Sync() and background writeback, or when a write would
+// take the file past the limit. Files that several writers append to a
+// little at a time then still end up in a few extents. Sectors are
+// promised to the blocks as they are added, so a full disk still fails
+// the write that would need them
+
+// make room for 'count' more delayed blocks after those file 'inode'
+// has, zero-filled, and promise sectors to them; the write adds them to
+// 'ndelayed' once it has filled them. -1 if the disk cannot take them
+static int delalloc_grow(inode_t* inode, int count) {
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    int want = entry->ndelayed + count;
+    if(want > entry->delayed_cap) {
+        int cap = entry->delayed_cap > 0 ? entry->delayed_cap : 8;
+        while(cap < want)
+            cap *= 2;
+        if(cap > delalloc_blocks)
+            cap = delalloc_blocks > want ? delalloc_blocks : want;
+        char* delayed = (char*)realloc(entry->delayed, (size_t)cap * SECTOR_SIZE);
+        if(delayed == NULL) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        entry->delayed = delayed;
+        entry->delayed_cap = cap;
+    }
+    if(delalloc_reserve(count) == -1) {
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+    memset(entry->delayed + (size_t)entry->ndelayed * SECTOR_SIZE, 0, (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+// give the delayed blocks of file 'inode', and the blocks up to 'blocks'
+// a write is about to add (0 for none), sectors in one go and write the
+// delayed ones out, a disk request per run. Called with the inode
+// write-locked or every other call locked out. If no sectors can be had
+// nothing changes and osErrno says why
+static int delalloc_flush(inode_t* inode, int blocks) {
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    int count = entry->ndelayed;
+    int mapped = file_blocks(inode) - count;
+    if(blocks < mapped + count)
+        blocks = mapped + count;
+    if(blocks == mapped)
+        return 0;
+    trace(TRACE_STEPS, 'B', FS_EV_DELALLOC_FLUSH, entry->inum, -1, count);
+    if(file_grow(inode, blocks - mapped, count) == -1) {
+        trace(TRACE_STEPS, 'E', FS_EV_DELALLOC_FLUSH, entry->inum, -1, -1);
+        return -1;
+    }
+    entry->ndelayed = 0;
+
+    int rc = 0;
+    for(int b = 0; b < count && rc == 0; ) {
+        int run;
+        sector_t sector = file_bmap(inode, NULL, mapped + b, &run);
+        if(run > count - b)
+            run = count - b;
+        if(sector < 0 || Cache_WriteRange(sector, run, entry->delayed + (size_t)b * SECTOR_SIZE) == -1) {
+            osErrno = E_GENERAL;
+            rc = -1;
+        }
+        b += run;
+    }
+    free(entry->delayed);
+    entry->delayed = NULL;
+    entry->delayed_cap = 0;
+    if(count > 0)
+        mark_inode_dirty(inode);
+    trace(TRACE_STEPS, 'E', FS_EV_DELALLOC_FLUSH, entry->inum, -1, rc);
+    return rc;
+}
+
+// forget the delayed blocks of file 'inode' when they cannot be given
+// sectors and the inode is about to be let go, cutting the file back
+static void delalloc_drop(inode_t* inode) {
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    if(entry->ndelayed == 0)
+        return;
+    fs_log(TRACE_ERRORS, "___ dropping %d delayed blocks of inode %d\n", entry->ndelayed, entry->inum);
+    delalloc_adjust(-entry->ndelayed);
+    inode->size = file_mapped(inode) * SECTOR_SIZE;
+    entry->ndelayed = 0;
+    free(entry->delayed);
+    entry->delayed = NULL;
+    entry->delayed_cap = 0;
+    mark_inode_dirty(inode);
+}
+
+// give every file's delayed blocks sectors, with every other call locked
+// out (FS_Sync() and writeback); a file that cannot have them keeps them
+// and the call fails
+static int delalloc_flush_all() {
+    int rc = 0;
+    for(int e = 0; e < icache_size; e++) {
+        icache_entry_t* entry = icache_at(e);
+        if(entry->inum != -1 && entry->ndelayed > 0 && delalloc_flush(&entry->d, 0) == -1)
+            rc = -1;
+    }
+    return rc;
+}
+
+//get_child_inode will return inode number of 'fname' file/directory, whhich should be
+// in parent_inode i.e., it should be sub-directory or file, if not return -1, 
+static int get_child_inode(int parent_inode, char* fname)
+{
+    fs_log(TRACE_TEXT, "___ parent inode = %d\n", parent_inode);
+
+    inode_t* parent = get_inode( parent_inode );//in-core parent inode, no inode table read on a hit
+    if( parent == NULL )
+        return -2;
+    inode_lock( parent, 0 );
+    fs_log(TRACE_TEXT, "___ load parent inode: parent_inode = %d, inode address %p, %d (size=%d, type=%d)\n",parent_inode ,(void*)parent, parent_inode, parent->size, parent->type);
+
+    if( !is_directory( parent ) )
+    {
+        fs_log(TRACE_TEXT, "___ Not a directory\n");
+        inode_unlock( parent );
+        put_inode( parent, 0 );
+        return -2 ;
+    }
+
+    int child_inode = dir_lookup( parent, fname );//to return the inode number of child node
+    if( child_inode >= 0 )
+        fs_log(TRACE_TEXT, "___ found child inode %d\n", child_inode);
+    if( child_inode >= -1 )//found, or known not to exist; cached before the directory can change again
+        dcache_insert( parent_inode, fname, child_inode );
+    inode_unlock( parent );
+    put_inode( parent, 0 );
+    return child_inode;//-1 if not in the parent
+
+}
+
+//follow_path will return immediate parent's inode number, file's/directories inode number
+// through last_inode argument and name of file/directory thourgh last name
+static int follow_path(char* path, int* last_inode, char* last_fname)
+{
+    long start = op_begin(FS_OP_LOOKUP);
+    *last_inode = -1;//callers may look at it even when the walk fails
+    if(!path) {
+        fs_log(TRACE_TEXT, "___ invalid path\n");
+        return op_end(FS_OP_LOOKUP, start, -1);
+    }
+    if(path[0] != '/') {
+        fs_log(TRACE_TEXT, "___ '%s' not absolute path\n", path);
+        return op_end(FS_OP_LOOKUP, start, -1);
+    }
+
+    //to remove first '/' from path
+    char tgt[ MAX_PATH ];
+    strncpy( tgt, path + 1, MAX_PATH - 1 );
+    tgt[ MAX_PATH - 1] = '\0';
+    fs_log(TRACE_TEXT, "___ path copied\n");
+    char *target = tgt;
+    //to initialize parent and child inode number, initially root i.e., 0
+    int parent = -1, child = 0;
+
+    char *follow;//to access parts of path, as a/b/c/d.txt then a,b,c will be accessed seperately by follow
+    while( (follow = strsep( &target, "/")) != NULL )
+    {
+        if( *follow == '\0') continue;//to check if the whole path is accessed,now strsep will return NULL so loop will break
+
+        if( illegal_filename( follow ) )//chceking if path-part is legal
+        {
+            return op_end(FS_OP_LOOKUP, start, -1);
+        }
+        if( child < 0 )
+        {
+            return op_end(FS_OP_LOOKUP, start, -1);
+        }
+
+        parent = child;//pushing the child inode to parent, to go further in child's directory, so making it parent
+        if( !dcache_lookup( parent, follow, &child ) )//directory is only scanned on a dentry cache miss
+            child = get_child_inode(parent, follow);
+        if(last_fname) strcpy(last_fname, follow);
+    }
+
+    if( child < -1 ) return op_end(FS_OP_LOOKUP, start, -1);//some error happend
+    else
+    {
+        if( parent == -1 && child == 0 ) parent = 0;
+
+        *last_inode = child;
+
+        return op_end(FS_OP_LOOKUP, start, parent);
+    }
+
+}
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'
+int add_inode(int type, int parent_inode, char* file)
+{
+    int child_inode_number = alloc_inode_number();
+
+    if( child_inode_number < 0 )
+    {
+        fs_log(TRACE_TEXT, "___ inode is not available");
+        return -1;
+    }
+    fs_log(TRACE_TEXT, "___ child inode is available with inode number %d \n", child_inode_number );
+
+    inode_t* child_inode = get_inode( child_inode_number );//in-core copy of the new inode
+    if( child_inode == NULL ) {
+        free_inode_number( child_inode_number );
+        return -1;
+    }
+    inode_lock( child_inode, 1 );//nothing leads to it yet, but a stale lookup may still hold it
+    memset(child_inode, 0, sizeof(inode_t) );
+    child_inode->type = ( type == 1 ) ? dir_format : 0;//directories get the format selected with FS_OPT_DIR_FORMAT
+    inode_unlock( child_inode );
+    put_inode( child_inode, 1 );//the new inode's entry is written back with the next flush
+
+    // Retrieving parents inode to make entry
+
+    inode_t* parent = get_inode( parent_inode );
+    if( parent == NULL ) {
+        fs_log(TRACE_ERRORS, "___ Disk read failed returning -1\n");
+        free_inode_number( child_inode_number );
+        return -1;
+    }
+    inode_lock( parent, 1 );//the directory stays locked until the entry is in
+
+    if( !is_directory( parent ) ) {
+        fs_log(TRACE_TEXT, "___ parent not directory returning -2\n");
+        inode_unlock( parent );
+        put_inode( parent, 0 );
+        free_inode_number( child_inode_number );
+        return -2;
+    }//Parent is not directory
+
+    if( dir_lookup( parent, file ) != -1 ) {
+        fs_log(TRACE_TEXT, "___ '%s' appeared in parent %d meanwhile\n", file, parent_inode);
+        inode_unlock( parent );
+        put_inode( parent, 0 );
+        free_inode_number( child_inode_number );
+        return -1;
+    }
+
+    trace(TRACE_STEPS, 'B', FS_EV_DIR_ADD, child_inode_number, -1, parent_inode);
+    int added = dir_add( parent, file, child_inode_number );
+    trace(TRACE_STEPS, 'E', FS_EV_DIR_ADD, child_inode_number, -1, added);
+    if( added < 0 ) {
+        fs_log(TRACE_TEXT, "___ no room for a new entry in parent %d returning -1\n", parent_inode);
+        inode_unlock( parent );
+        put_inode( parent, 1 );
+        free_inode_number( child_inode_number );
+        return -1;
+    }
+
+    dcache_insert( parent_inode, file, child_inode_number );//replaces a negative entry left by the lookup
+    inode_unlock( parent );
+    put_inode( parent, 1 );
+
+    return 0;
+}
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, char* pathname)
+{
+  int child_inode;
+  char last_fname[MAX_NAME];
+  int parent_inode = follow_path(pathname, &child_inode, last_fname);
+  if(parent_inode >= 0) {
+    if(child_inode >= 0) {
+      fs_log(TRACE_TEXT, "___ file/directory '%s' already exists, failed to create\n", pathname);
+      osErrno = E_CREATE;
+      return -1;
+    } else {
+      trace(TRACE_STEPS, 'B', FS_EV_ADD_INODE, parent_inode, -1, type);
+      int rc = add_inode(type, parent_inode, last_fname);
+      trace(TRACE_STEPS, 'E', FS_EV_ADD_INODE, parent_inode, -1, rc);
+      if(rc >= 0) {
+    fs_log(TRACE_TEXT, "___ successfully created file/directory: '%s'\n", pathname);
+    return 0;
+      } else {
+    fs_log(TRACE_TEXT, "___ error: something wrong with adding child inode\n");
+    osErrno = E_CREATE;
+    return -1;
+      }
+    }
+  } else {
+    fs_log(TRACE_TEXT, "___ error: something wrong with the file/path: '%s'\n", pathname);
+    osErrno = E_CREATE;
+    return -1;
+  }
+}
+
+
+//check if file or directory 1 if directory 0 if file
+int get_path_type(char* pathname) {
     int token;
     char filename[MAX_NAME];
     follow_path(pathname, &token, filename); // find the token
 
-    if(token==-1) // if token is invalid
+    if(token < 0) // if token is invalid
+        return -1;
+
+    inode_t* inode = get_inode(token); // get inode of this token
+    if(inode == NULL)
+        return -1;
+    inode_lock(inode, 0);
+    int type = is_directory(inode);
+    inode_unlock(inode);
+    put_inode(inode, 0);
+    return type; // return the type of this token
+}
+
+
+// remove file (type 0) or empty directory (type 1) 'child_inode', known
+// as 'name' in directory 'parent_inode'. Returns -1 if that entry is
+// gone, -2 if the file is open or the directory not empty
+int remove_inode(int type, int parent_inode, int child_inode, char* name) {
+
+    // parent inode
+    inode_t* parent = get_inode(parent_inode);
+    if(parent == NULL)
+        return -1;
+    inode_lock(parent, 1);
+    fs_log(TRACE_TEXT, "___ get parent inode %d (size=%d, type=%d)\n",
+            parent_inode, parent->size, parent->type);
+
+    // the entry may have changed since the path was looked up
+    inode_t* inode = NULL;
+    if(!is_directory(parent) || dir_lookup(parent, name) != child_inode ||
+       (inode = get_inode(child_inode)) == NULL) {
+        inode_unlock(parent);
+        put_inode(parent, 0);
+        return -1;
+    }
+    inode_lock(inode, 1);
+    // File_Open() counts descriptors under the inode lock held here
+    if(type == 0 ? __atomic_load_n(&((icache_entry_t*)inode)->opens, __ATOMIC_RELAXED) > 0 : inode->size > 0) {
+        inode_unlock(inode);
+        put_inode(inode, 0);
+        inode_unlock(parent);
+        put_inode(parent, 0);
+        return -2;
+    }
+
+    //for file
+    if(type == 0) {
+        file_truncate(inode, 0);
+    }
+    //directory
+    else {
+        dcache_purge_dir(child_inode);
+        dir_free(inode);
+    }
+
+    memset(inode, 0, sizeof(inode_t)); // the in-core copy must not outlive the file
+    inode_unlock(inode);
+    put_inode(inode, 1);
+
+    // nothing may lead to the inode number once it can be reused
+    dcache_invalidate(parent_inode, name);
+    int removed = dir_remove(parent, name);
+    inode_unlock(parent);
+    put_inode(parent, 1);
+    free_inode_number(child_inode);
+    return removed < 0 ? -1 : 0; // error when unlinking
+}
+
+
+// entry of descriptor 'fd', NULL if the table never grew that far
+static open_file_t* fd_slot(int fd) {
+    if(fd < 0 || fd >= __atomic_load_n(&fd_nchunks, __ATOMIC_ACQUIRE) * FD_CHUNK)
+        return NULL;
+    return &fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+// entry of open descriptor 'fd', NULL if it is not open
+static open_file_t* fd_get(int fd) {
+    open_file_t* of = fd_slot(fd);
+    return (of == NULL || of->inode < 1) ? NULL : of;
+}
+
+// take an unused descriptor off the free list, growing the table when
+// the list is empty; -1 once MAX_OPEN_FILES are in use. Called with
+// fd_lock held
+static int fd_alloc() {
+    if(fd_free == -1) {
+        if(fd_nchunks == MAX_OPEN_FILES / FD_CHUNK)
+            return -1;
+        open_file_t* chunk = (open_file_t*)calloc(FD_CHUNK, sizeof(open_file_t));
+        if(chunk == NULL)
+            return -1;
+        for(int i = 0; i < FD_CHUNK; i++) {
+            chunk[i].next_free = (i + 1 < FD_CHUNK) ? fd_nchunks * FD_CHUNK + i + 1 : -1;
+            pthread_mutex_init(&chunk[i].lock, NULL);
+        }
+        fd_free = fd_nchunks * FD_CHUNK;
+        fd_chunks[fd_nchunks] = chunk;
+        __atomic_store_n(&fd_nchunks, fd_nchunks + 1, __ATOMIC_RELEASE);
+    }
+    int fd = fd_free;
+    fd_free = fd_slot(fd)->next_free;
+    return fd;
+}
+
+// put descriptor 'fd' back on the free list, called with fd_lock held
+static void fd_release(int fd) {
+    open_file_t* of = fd_slot(fd);
+    of->inode = 0;
+    of->ip = NULL;
+    of->next_free = fd_free;
+    fd_free = fd;
+}
+
+// empty the open file table, used when the disk is (re)loaded
+static void fd_table_reset() {
+    for(int c = 0; c < fd_nchunks; c++) {
+        for(int i = 0; i < FD_CHUNK; i++) {
+            free(fd_chunks[c][i].map.extents);
+            pthread_mutex_destroy(&fd_chunks[c][i].lock);
+        }
+        free(fd_chunks[c]);
+        fd_chunks[c] = NULL;
+    }
+    fd_nchunks = 0;
+    fd_free = -1;
+}
+
+// work out where everything lives on a disk of 'sectors' sectors with
+// 'inodes' inodes and a journal of 'journal_sectors': superblock, inode
+// bitmap, sector bitmap, inode table, journal, then data. Returns -1 if
+// that leaves no room for data
+static int layout_init(sector_t sectors, int inodes, int journal_sectors) {
+    if(sectors <= 0 || inodes <= 0 || journal_sectors < 0)
         return -1;
+    layout.sectors = sectors;
+    layout.inodes = inodes;
+    layout.inode_bitmap_sectors = ((sector_t)inodes + SECTOR_SIZE*8 - 1) / (SECTOR_SIZE*8);
+    layout.sector_bitmap_start = INODE_BITMAP_START_SECTOR + layout.inode_bitmap_sectors;
+    layout.sector_bitmap_sectors = (sectors + SECTOR_SIZE*8 - 1) / (SECTOR_SIZE*8);
+    layout.inode_table_start = layout.sector_bitmap_start + layout.sector_bitmap_sectors;
+    layout.inode_table_sectors = ((sector_t)inodes + INODES_PER_SECTOR - 1) / INODES_PER_SECTOR;
+    layout.journal_start = layout.inode_table_start + layout.inode_table_sectors;
+    layout.journal_sectors = journal_sectors;
+    layout.data_start = layout.journal_start + layout.journal_sectors;
+    return layout.data_start < sectors ? 0 : -1;
+}
 
-    inode_t* inode = get_inode(token); // get inode of this token
-    return inode->type; // return the type of this token
+// give delayed blocks their sectors, push all in-memory metadata
+// (bitmaps, in-core inodes) into the buffer cache and write the dirty
+// buffers back to the disk
+static int fs_flush() {
+    trace(TRACE_STEPS, 'B', FS_EV_FLUSH, -1, -1, 0);
+    int rc = -1;
+    if(delalloc_flush_all() == 0 && bitmap_flush(&inode_bitmap) == 0 && bitmap_flush(&sector_bitmap) == 0 &&
+       icache_flush() == 0)
+        rc = Cache_Flush();
+    trace(TRACE_STEPS, 'E', FS_EV_FLUSH, -1, -1, rc);
+    return rc;
 }
 
+/*******************JOURNAL*******************/
 
-int remove_inode(int type, int parent_inode, int child_inode) {
+// FNV-1a, the checksum of a transaction
+static uint64_t journal_checksum(uint64_t sum, const char* data, size_t len) {
+    for(size_t i = 0; i < len; i++)
+        sum = (sum ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    return sum;
+}
 
-    //for file
-    if(type == 0) {
-        char buffer[SECTOR_SIZE];
-        inode_t* file = get_inode(child_inode);
+// write 'count' sectors into the log from offset 'at' on, wrapping
+// around its end; one scatter/gather transfer
+static int journal_write(sector_t at, sector_t count, char* buffer) {
+    Disk_Segment segs[2];
+    int n = 0;
+    sector_t first = journal.size - at < count ? journal.size - at : count;
+    segs[n++] = (Disk_Segment){ JOURNAL_START_SECTOR + 1 + at, (int)first, buffer };
+    if(first < count)
+        segs[n++] = (Disk_Segment){ JOURNAL_START_SECTOR + 1, (int)(count - first), buffer + first * SECTOR_SIZE };
+    return Cache_WriteV(segs, n);
+}
+
+static int journal_read(sector_t at, char* buffer) {
+    return Cache_Read(JOURNAL_START_SECTOR + 1 + at % journal.size, buffer);
+}
+
+static int journal_write_header() {
+    char buffer[SECTOR_SIZE];
+    journal_header_t* h = (journal_header_t*)buffer;
+    memset(buffer, 0, SECTOR_SIZE);
+    h->magic = JOURNAL_MAGIC;
+    h->seq = journal.seq;
+    h->tail = journal.tail;
+    return Cache_WriteRange(JOURNAL_START_SECTOR, 1, buffer);
+}
+
+// set up the in-memory side of the journal of the disk being booted,
+// 'use' says whether FS_Sync() is to commit through it. The position in
+// the log is left to the caller
+static int journal_init(int use) {
+    free(journal.changed);
+    free(journal.logged);
+    journal.changed = journal.logged = NULL;
+    journal.count = 0;
+    journal.size = JOURNAL_SECTORS > 0 ? JOURNAL_SECTORS - 1 : 0;
+    journal.active = 0;
+    if(!use)
+        return 0;
+    journal.changed = (uint64_t*)calloc((layout.sectors + 63) / 64, sizeof(uint64_t));
+    journal.logged = (uint64_t*)calloc((layout.sectors + 63) / 64, sizeof(uint64_t));
+    if(journal.changed == NULL || journal.logged == NULL)
+        return -1;
+    journal.active = 1;
+    return 0;
+}
+
+// write the held home sectors in place and empty the log. Only called
+// right after a commit, when the disk holds exactly what was logged
+static int journal_checkpoint() {
+    Disk_ReleaseHolds();
+    if(Disk_Save(filesys_name) == -1)
+        return -1;
+    journal.tail = (journal.tail + journal.used) % journal.size;
+    journal.used = 0;
+    if(journal_write_header() == -1 || Disk_Save(filesys_name) == -1)
+        return -1;
+    memset(journal.logged, 0, (layout.sectors + 63) / 64 * sizeof(uint64_t));
+    pthread_mutex_lock(&sector_bitmap.lock);
+    bitmap_release(&sector_bitmap);
+    pthread_mutex_unlock(&sector_bitmap.lock);
+    journal.checkpoints++;
+    fs_log(TRACE_TEXT, "___ journal checkpoint %ld\n", journal.checkpoints);
+    return 0;
+}
+
+// FS_Sync() through the journal, with fs_lock held exclusively: file
+// data and everything else that is not journaled reach the image first,
+// then every metadata sector noted since the last commit goes to the log
+// as one transaction, in one sequential write. Their home copies wait
+// for a checkpoint, which happens here once half the log is in use and
+// otherwise in the background
+static int journal_commit() {
+    if(delalloc_flush_all() < 0 || bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0 || icache_flush() < 0)
+        return -1;
+
+    // the transaction: the noted sectors that were not freed since
+    int n = 0;
+    for(int i = 0; i < journal.count; i++) {
+        if(BIT_TEST(journal.changed, journal.list[i]))
+            journal.list[n++] = journal.list[i];
+    }
+    journal.count = n;
+    sector_t need = n + (n + JOURNAL_HOMES - 1) / JOURNAL_HOMES + 1;
+
+    if(n > 0 && need > journal.size - journal.used) {
+        // more than the log can take: write everything in place, as
+        // without a journal, and start the log afresh
+        fs_log(TRACE_TEXT, "___ journal transaction of %d sectors does not fit, syncing in place\n", n);
+        for(int i = 0; i < n; i++)
+            BIT_CLEAR(journal.changed, journal.list[i]);
+        journal.count = 0;
+        if(Cache_Flush() == -1)
+            return -1;
+        return journal_checkpoint();
+    }
 
-        for(int i = 0; i < 30; i++) {
-            int file_sector = (unsigned char) file->data[i];
+    for(int i = 0; i < n; i++) {
+        if(Disk_Hold(journal.list[i], 1) == -1)
+            return -1;
+    }
+    if(Cache_Flush() == -1 || Disk_Save(filesys_name) == -1)
+        return -1;
+    if(n == 0)
+        return 0;
 
-            if(file_sector != 0) {
-                memset(buffer, 0, SECTOR_SIZE);
-                Disk_Write(file_sector, buffer);
-                reset_bitmap(2, 3, file_sector + 1);
+    char* txn = (char*)calloc(need, SECTOR_SIZE);
+    if(txn == NULL)
+        return -1;
+    uint64_t sum = 0xcbf29ce484222325ULL;
+    char* at = txn;
+    for(int i = 0; i < n; i += JOURNAL_HOMES) {
+        journal_desc_t* desc = (journal_desc_t*)at;
+        desc->magic = JOURNAL_DESC;
+        desc->count = n - i < JOURNAL_HOMES ? n - i : JOURNAL_HOMES;
+        desc->seq = journal.seq;
+        at += SECTOR_SIZE;
+        for(int j = 0; j < desc->count; j++, at += SECTOR_SIZE) {
+            desc->homes[j] = journal.list[i + j];
+            if(Cache_Read(desc->homes[j], at) == -1) {
+                free(txn);
+                return -1;
             }
         }
+        sum = journal_checksum(sum, (char*)desc, at - (char*)desc);
+    }
+    journal_desc_t* commit = (journal_desc_t*)at;
+    commit->magic = JOURNAL_COMMIT;
+    commit->count = (int)need;
+    commit->seq = journal.seq;
+    commit->checksum = sum;
+
+    sector_t at_log = (journal.tail + journal.used) % journal.size;
+    trace(TRACE_STEPS, 'B', FS_EV_JOURNAL_WRITE, -1, at_log, need);
+    int rc = journal_write(at_log, need, txn);
+    free(txn);
+    if(rc == 0)
+        rc = Disk_Save(filesys_name);
+    trace(TRACE_STEPS, 'E', FS_EV_JOURNAL_WRITE, -1, at_log, rc);
+    if(rc == -1)
+        return -1;
 
-        reset_bitmap(1, 1, child_inode);
-        unlink_helper(parent_inode, child_inode);
-        return 0; //success
+    for(int i = 0; i < n; i++) {
+        BIT_CLEAR(journal.changed, journal.list[i]);
+        BIT_SET(journal.logged, journal.list[i]);
     }
-    //directory
-    if (type == 1) {
-        unlink_helper(parent_inode, child_inode);
-        return 0; //success
+    journal.count = 0;
+    journal.used += need;
+    journal.seq++;
+    journal.commits++;
+    fs_log(TRACE_TEXT, "___ journal commit %llu: %d sectors, log %lld/%lld\n", (unsigned long long)journal.seq - 1, n,
+           (long long)journal.used, (long long)journal.size);
+
+    if(journal.used > journal.size / 2)
+        return journal_checkpoint();
+    if(journal.used > journal.size / 4) {
+        pthread_mutex_lock(&journal.wake_lock);
+        pthread_cond_signal(&journal.wake);
+        pthread_mutex_unlock(&journal.wake_lock);
+    }
+    return 0;
+}
+
+// replay the committed transactions left in the log of the disk just
+// loaded, oldest first, then empty the log. Called by FS_Boot() before
+// anything else is read
+static int journal_recover() {
+    char buffer[SECTOR_SIZE];
+    journal_header_t* h = (journal_header_t*)buffer;
+    if(Cache_Read(JOURNAL_START_SECTOR, buffer) == -1)
+        return -1;
+    if(h->magic != JOURNAL_MAGIC || h->tail < 0 || h->tail >= journal.size) {
+        fs_log(TRACE_ERRORS, "___ journal header is damaged, nothing replayed\n");
+        journal.tail = journal.used = 0;
+        journal.seq = 1;
+        return journal_write_header() == -1 || Disk_Save(filesys_name) == -1 ? -1 : 0;
+    }
+    journal.tail = h->tail;
+    journal.used = 0;
+    journal.seq = h->seq;
+    journal.replayed = 0;
+
+    sector_t pos = journal.tail, scanned = 0;
+    char desc_buf[SECTOR_SIZE], block[SECTOR_SIZE];
+    journal_desc_t* desc = (journal_desc_t*)desc_buf;
+    while(scanned < journal.size) {
+        // check the whole transaction before applying any of it
+        sector_t len = 0;
+        uint64_t sum = 0xcbf29ce484222325ULL;
+        int ok = 0;
+        while(scanned + len < journal.size) {
+            if(journal_read(pos + len, desc_buf) == -1 || desc->seq != journal.seq)
+                break;
+            if(desc->magic == JOURNAL_COMMIT) {
+                ok = (desc->count == len + 1 && desc->checksum == sum);
+                len++;
+                break;
+            }
+            if(desc->magic != JOURNAL_DESC || desc->count <= 0 || desc->count > JOURNAL_HOMES)
+                break;
+            sum = journal_checksum(sum, desc_buf, SECTOR_SIZE);
+            for(int j = 0; j < desc->count; j++) {
+                if(journal_read(pos + len + 1 + j, block) == -1)
+                    return -1;
+                sum = journal_checksum(sum, block, SECTOR_SIZE);
+            }
+            len += 1 + desc->count;
+        }
+        if(!ok)
+            break;
+
+        for(sector_t at = pos; at < pos + len - 1; ) {
+            if(journal_read(at, desc_buf) == -1)
+                return -1;
+            for(int j = 0; j < desc->count; j++) {
+                if(desc->homes[j] < DATABLOCK_START_SECTOR && desc->homes[j] >= JOURNAL_START_SECTOR)
+                    continue; // never the journal itself
+                if(journal_read(at + 1 + j, block) == -1 || Cache_Write(desc->homes[j], block) == -1)
+                    return -1;
+            }
+            at += 1 + desc->count;
+        }
+        pos = (pos + len) % journal.size;
+        scanned += len;
+        journal.seq++;
+        journal.replayed++;
+    }
+
+    if(journal.replayed == 0)
+        return 0;
+    fs_log(TRACE_TEXT, "___ journal: replayed %ld transactions\n", journal.replayed);
+    journal.tail = pos;
+    if(Cache_Flush() == -1 || Disk_Save(filesys_name) == -1 ||
+       journal_write_header() == -1 || Disk_Save(filesys_name) == -1)
+        return -1;
+    return 0;
+}
+
+// the time 'ms' milliseconds from now, for pthread_cond_timedwait()
+static struct timespec deadline(int ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+    if(until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    return until;
+}
+
+// the background checkpointer: commits and checkpoints when woken by a
+// commit that left a quarter of the log in use, or every checkpoint_ms
+static void* journal_thread(void* arg) {
+    pthread_mutex_lock(&journal.wake_lock);
+    while(!journal.stop) {
+        if(checkpoint_ms > 0) {
+            struct timespec until = deadline(checkpoint_ms);
+            pthread_cond_timedwait(&journal.wake, &journal.wake_lock, &until);
+        }
+        else
+            pthread_cond_wait(&journal.wake, &journal.wake_lock);
+        if(journal.stop)
+            break;
+        if(journal.retimed) { // woken only to pick up the new period
+            journal.retimed = 0;
+            continue;
+        }
+        pthread_mutex_unlock(&journal.wake_lock);
+
+        pthread_rwlock_wrlock(&fs_lock);
+        if(journal.active && journal.used > 0 && journal_commit() == 0 && journal.used > 0)
+            journal_checkpoint();
+        pthread_rwlock_unlock(&fs_lock);
+
+        pthread_mutex_lock(&journal.wake_lock);
+    }
+    pthread_mutex_unlock(&journal.wake_lock);
+    return NULL;
+}
+
+static void journal_start_thread() {
+    if(!journal.active || journal.running)
+        return;
+    journal.stop = 0;
+    journal.retimed = 0;
+    if(pthread_create(&journal.thread, NULL, journal_thread, NULL) == 0)
+        journal.running = 1;
+}
+
+// stop the checkpointer; called by FS_Boot() before it takes fs_lock
+static void journal_stop_thread() {
+    if(!journal.running)
+        return;
+    pthread_mutex_lock(&journal.wake_lock);
+    journal.stop = 1;
+    pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.wake_lock);
+    pthread_join(journal.thread, NULL);
+    journal.running = 0;
+}
+
+// FS_Sync() with the journal: one commit at a time, and callers that
+// arrive while one is running share the next
+static int journal_sync() {
+    pthread_mutex_lock(&commit_lock);
+    long want = commits_started + 1; // the first commit to start after this call
+    while(commits_finished < want) {
+        if(committing) {
+            pthread_cond_wait(&commit_done, &commit_lock);
+            continue;
+        }
+        committing = 1;
+        long mine = ++commits_started;
+        pthread_mutex_unlock(&commit_lock);
+
+        pthread_rwlock_wrlock(&fs_lock);
+        int rc = journal_commit();
+        pthread_rwlock_unlock(&fs_lock);
+
+        pthread_mutex_lock(&commit_lock);
+        committing = 0;
+        commits_finished = mine;
+        commit_rc = rc;
+        pthread_cond_broadcast(&commit_done);
+    }
+    int rc = commit_rc;
+    pthread_mutex_unlock(&commit_lock);
+    return rc;
+}
+
+/*******************WRITEBACK*******************/
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// bring the image up to date without holding other calls up for long:
+// delayed blocks get their sectors and the in-core metadata goes into
+// the cache with every call locked out,
+// then the sectors go to the image WRITEBACK_BATCH at a time, other
+// calls only waiting while they are copied. With a journal the metadata
+// has to be committed and checkpointed instead, which is done like the
+// checkpointer does it
+static int writeback_flush() {
+    int rc = 0;
+    if(journal.active) {
+        pthread_rwlock_wrlock(&fs_lock);
+        if(journal_commit() == -1 || (journal.used > 0 && journal_checkpoint() == -1))
+            rc = -1;
+        pthread_rwlock_unlock(&fs_lock);
+        return rc;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    if(delalloc_flush_all() < 0 || bitmap_flush(&inode_bitmap) < 0 || bitmap_flush(&sector_bitmap) < 0 ||
+       icache_flush() < 0)
+        rc = -1;
+    pthread_rwlock_unlock(&fs_lock);
+
+    sector_t written = WRITEBACK_BATCH;
+    while(rc == 0 && written >= WRITEBACK_BATCH) {
+        pthread_rwlock_rdlock(&fs_lock);
+        written = Cache_Writeback(WRITEBACK_BATCH);
+        pthread_rwlock_unlock(&fs_lock);
+        if(written < 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+// the writeback thread: flushes every writeback_ms, or when kicked by a
+// writer, if the image lacks anything
+static void* writeback_thread(void* arg) {
+    pthread_mutex_lock(&writeback.lock);
+    while(!writeback.stop) {
+        int timed_out = 0;
+        if(!writeback.kicked) {
+            if(writeback_ms > 0) {
+                struct timespec until = deadline(writeback_ms);
+                timed_out = pthread_cond_timedwait(&writeback.wake, &writeback.lock, &until) == ETIMEDOUT;
+            }
+            else
+                pthread_cond_wait(&writeback.wake, &writeback.lock);
+        }
+        if(writeback.stop)
+            break;
+        int kicked = writeback.kicked;
+        sector_t threshold = writeback.threshold;
+        writeback.kicked = 0;
+        if(!kicked && !timed_out) // an option changed
+            continue;
+        pthread_mutex_unlock(&writeback.lock);
+
+        pthread_rwlock_rdlock(&fs_lock);
+        sector_t unsaved = Cache_Unsaved();
+        pthread_rwlock_unlock(&fs_lock);
+
+        // a kick that an earlier flush already dealt with is dropped
+        int rc = 0;
+        long start = now_us();
+        int flush = timed_out ? unsaved > 0 : unsaved >= threshold;
+        if(flush)
+            rc = writeback_flush();
+        long us = now_us() - start;
+
+        pthread_mutex_lock(&writeback.lock);
+        if(flush) {
+            writeback.stats.flushes++;
+            if(timed_out)
+                writeback.stats.timed++;
+            else
+                writeback.stats.triggered++;
+            if(rc == -1)
+                writeback.stats.failed++;
+            writeback.stats.sectors += unsaved;
+            writeback.stats.total_us += us;
+            if(us > writeback.stats.max_us)
+                writeback.stats.max_us = us;
+        }
+    }
+    pthread_mutex_unlock(&writeback.lock);
+    return NULL;
+}
+
+// wake the writeback thread if the image lacks at least the threshold;
+// called by writers, with fs_lock held
+static void writeback_poke() {
+    sector_t threshold = __atomic_load_n(&writeback.threshold, __ATOMIC_RELAXED);
+    if(threshold <= 0 || Cache_Unsaved() < threshold)
+        return;
+    pthread_mutex_lock(&writeback.lock);
+    if(!writeback.kicked) {
+        writeback.kicked = 1;
+        pthread_cond_signal(&writeback.wake);
+    }
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+// apply the writeback options: start the thread if one of them is on,
+// or have a running one pick up their new values
+static void writeback_start_thread() {
+    pthread_mutex_lock(&writeback.lock);
+    __atomic_store_n(&writeback.threshold, (sector_t)writeback_dirty * Disk_Sectors() / 100, __ATOMIC_RELAXED);
+    if(writeback.running)
+        pthread_cond_signal(&writeback.wake);
+    else if(writeback.booted && (writeback_ms > 0 || writeback_dirty > 0)) {
+        writeback.stop = writeback.kicked = 0;
+        memset(&writeback.stats, 0, sizeof(writeback.stats));
+        if(pthread_create(&writeback.thread, NULL, writeback_thread, NULL) == 0)
+            writeback.running = 1;
     }
+    pthread_mutex_unlock(&writeback.lock);
+}
 
+// stop the writeback thread; called by FS_Boot() before it takes fs_lock
+static void writeback_stop_thread() {
+    pthread_mutex_lock(&writeback.lock);
+    writeback.booted = 0;
+    if(!writeback.running) {
+        pthread_mutex_unlock(&writeback.lock);
+        return;
+    }
+    writeback.stop = 1;
+    pthread_cond_signal(&writeback.wake);
+    pthread_mutex_unlock(&writeback.lock);
+    pthread_join(writeback.thread, NULL);
+    writeback.running = 0;
 }
 
 
 /**********************END OF HELPER FUNCTIONS********************************/
 
 /**********************START OF DISK FUNCTIONS********************************/
-int FS_Boot(char *back_file) {
-    printf("FS_Boot %s\n", back_file);
+// FS_Boot() with every other call locked out
+static int fs_boot(char *back_file) {
+    journal.active = 0; // nothing is noted until the journal is set up again
 
     // oops, check for errors
     if (Disk_Init() == -1) {
-        printf("Disk_Init() failed\n");
+        fs_log(TRACE_ERRORS, "Disk_Init() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    fs_log(TRACE_TEXT, "disk - '%s' initialized\n", back_file);
+
+    // every sector LibFS touches goes through the buffer cache; what
+    // the last one counted is kept for FS_GetStats()
+    stats_carry_cache();
+    if (Cache_Init(cache_sectors) == -1) {
+        fs_log(TRACE_ERRORS, "Cache_Init() failed\n");
         osErrno = E_GENERAL;
         return -1;
     }
-    printf("disk - '%s' initialized\n", back_file);
+    icache_init();
+    dcache_init();
     strncpy(filesys_name, back_file, 1024);
     filesys_name[1023] = '\0';
 
 
     //load disk
     if(Disk_Load(filesys_name) == -1) {
-        printf("___ load disk '%s' failed\n", filesys_name);
+        fs_log(TRACE_TEXT, "___ load disk '%s' failed\n", filesys_name);
 
         if(diskErrno == E_OPENING_FILE) {
-            printf("____ cant open file_sys '%s', creating new file system\n", filesys_name);
+            fs_log(TRACE_TEXT, "____ cant open file_sys '%s', creating new file system\n", filesys_name);
+
+            //the journal holds home sectors back until checkpoint time,
+            //which the mmap and file backends write through
+            if(format_journal > 0 && disk_backend != FS_DISK_MEMORY) {
+                fs_log(TRACE_ERRORS, "_____ a journal needs the in-memory disk backend, '%s' not formatted\n", filesys_name);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+
+            //the geometry comes from Disk_SetSectors() and FS_OPT_INODES
+            if(layout_init(Disk_Sectors(), format_inodes, format_journal) == -1 || journal_init(0) == -1) {
+                fs_log(TRACE_ERRORS, "_____ %lld sectors can't hold %d inodes, a %d-sector journal and any data\n",
+                       (long long)Disk_Sectors(), format_inodes, format_journal);
+                osErrno = E_GENERAL;
+                return -1;
+            }
 
             //initializing superblock
             char buffer[SECTOR_SIZE];
+            superblock_t* sb = (superblock_t *) buffer;
             memset(buffer, 0, SECTOR_SIZE);
-            *(int *) buffer = MAGIC_NUMBER;
-            if(Disk_Write(SUPERBLOCK_START_SECTOR, buffer) == -1) {
-                printf("_____ superblock initialization failed\n");
+            sb->magic = MAGIC_NUMBER;
+            sb->version = FS_VERSION;
+            sb->sector_size = SECTOR_SIZE;
+            sb->inodes = layout.inodes;
+            sb->sectors = layout.sectors;
+            sb->journal_sectors = (int)layout.journal_sectors;
+            if(Cache_Write(SUPERBLOCK_START_SECTOR, buffer) == -1) {
+                fs_log(TRACE_ERRORS, "_____ superblock initialization failed\n");
                 osErrno = E_GENERAL;
                 return -1;
             }
-            printf("____ superblock initialization successful\n");
+            fs_log(TRACE_TEXT, "____ superblock initialization successful\n");
 
             //initialize inode bitmap
-            initialize_bitmap();
-            printf("____ inode bitmap intialized\n");
-            printf("____ sector bitmap intialized\n");
-
-            for(int i = 0; i < INODE_TABLE_SECTORS; i++) {
-                memset(buffer, 0, SECTOR_SIZE);
-                if(i == 0) {
-                    //first inode table entry = root directory
-                    ((inode_t *) buffer)->size = 0;
-                    ((inode_t *) buffer)->type = 1;
-                }
-                if(Disk_Write(INODE_TABLE_START_SECTOR + i, buffer) == -1) {
-                    printf("_____ inode initialize failed\n");
-                    osErrno = E_GENERAL;
-                    return -1;
-                }
+            if(bitmaps_format() == -1) {
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            fs_log(TRACE_TEXT, "____ inode bitmap intialized\n");
+            fs_log(TRACE_TEXT, "____ sector bitmap intialized\n");
+
+            //Disk_Init() zero-filled the inode table, only the root
+            //directory (first inode table entry) needs writing
+            memset(buffer, 0, SECTOR_SIZE);
+            ((inode_t *) buffer)->size = 0;
+            ((inode_t *) buffer)->type = dir_format;
+            if(Cache_Write(INODE_TABLE_START_SECTOR, buffer) == -1) {
+                fs_log(TRACE_ERRORS, "_____ inode initialize failed\n");
+                osErrno = E_GENERAL;
+                return -1;
             }
             inode_t* parent = get_inode(0);
-            printf("___  in load parent inode: parent_inode = %d, inode address %p, %d (size=%d, type=%d)\n",0 ,parent, 0, parent->size, parent->type);
+            if(parent == NULL) {
+                fs_log(TRACE_ERRORS, "_____ root inode can't be loaded\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            fs_log(TRACE_TEXT, "___  in load parent inode: parent_inode = %d, inode address %p, %d (size=%d, type=%d)\n",0 ,(void*)parent, 0, parent->size, parent->type);
+            put_inode(parent, 0);
 
-            printf("____ inode table initialized\n");
+            fs_log(TRACE_TEXT, "____ inode table initialized\n");
+
+            //an empty journal
+            journal.tail = journal.used = 0;
+            journal.seq = 1;
+            if(JOURNAL_SECTORS > 0 && journal_write_header() == -1) {
+                fs_log(TRACE_ERRORS, "_____ journal initialization failed\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
 
             //saving progress
-            if(Disk_Save(filesys_name) == -1) {
-                printf("_____ disk save failed for '%s'\n", filesys_name);
+            if(fs_flush() == -1 || Disk_Save(filesys_name) == -1) {
+                fs_log(TRACE_ERRORS, "_____ disk save failed for '%s'\n", filesys_name);
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            else if(journal_init(JOURNAL_SECTORS > 0 && Disk_Hold(0, 0) == 0) == -1) {
                 osErrno = E_GENERAL;
                 return -1;
             }
             else {
-                printf("_____ All initialized, Boot Successfull\n");
-                memset(open_files, 0, MAX_OPEN_FILES * sizeof(open_file_t));
+                fs_log(TRACE_TEXT, "_____ All initialized, Boot Successfull\n");
+                fd_table_reset();
                 return 0;
             }
         }
         // error while reading file
         else {
-            printf("___ file read failed for '%s' , boot failed\n", filesys_name);
+            fs_log(TRACE_ERRORS, "___ file read failed for '%s' , boot failed\n", filesys_name);
             osErrno = E_GENERAL;
             return -1;
         }
     }
     else {
-        printf("___ load disk from file '%s' successful\n", filesys_name);
-
-        int size = 0;
-        FILE *fp = fopen(filesys_name, "r");
-        if(fp) {
-            fseek(fp, 0, SEEK_END);
-            size = ftell(fp);
-            fclose(fp);
-        }
-        if(size != SECTOR_SIZE * NUM_SECTORS) {
-            printf("___ file size check for '%s' failed\n", filesys_name);
-            osErrno = E_GENERAL;
-            return -1;
-        }
-        printf("___ file size check for '%s' successful\n", filesys_name);
+        fs_log(TRACE_TEXT, "___ load disk from file '%s' successful\n", filesys_name);
 
         //check magic number
         bool magic = false;
         char buffer[SECTOR_SIZE];
-        if(Disk_Read(SUPERBLOCK_START_SECTOR, buffer) == -1)
+        superblock_t* sb = (superblock_t *) buffer;
+        if(Cache_Read(SUPERBLOCK_START_SECTOR, buffer) == -1)
             magic = false;
-        if(*(int *) buffer == MAGIC_NUMBER)
+        else if(sb->magic == MAGIC_NUMBER)
             magic = true;
         else
             magic = false;
 
+        // images written by another version of the on-disk format would
+        // be misread (e.g. sector lists taken for extents), refuse them
+        if(magic && sb->version != FS_VERSION) {
+            fs_log(TRACE_ERRORS, "... disk format version %d, expected %d, boot failed\n", sb->version, FS_VERSION);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+
+        // the layout follows from the geometry the disk was formatted with
+        if(magic && (sb->sector_size != SECTOR_SIZE || sb->sectors != Disk_Sectors() ||
+                     layout_init(sb->sectors, sb->inodes, sb->journal_sectors) == -1)) {
+            fs_log(TRACE_ERRORS, "___ geometry check for '%s' failed (%d-byte sectors, %lld of %lld sectors, %d inodes)\n",
+                   filesys_name, sb->sector_size, (long long)sb->sectors, (long long)Disk_Sectors(), sb->inodes);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+
         if(magic) {
             // final boot success
-            printf("___ check magic successful\n");
-            memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
+            fs_log(TRACE_TEXT, "___ check magic successful\n");
+
+            // finish whatever the journal committed before anything
+            // else is read; the mmap and file backends write through,
+            // so only the in-memory one can hold sectors back for it
+            if(journal_init(0) == -1 || (JOURNAL_SECTORS > 0 && journal_recover() == -1) ||
+               journal_init(JOURNAL_SECTORS > 0 && Disk_Hold(0, 0) == 0) == -1) {
+                fs_log(TRACE_ERRORS, "___ journal recovery failed\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            if(JOURNAL_SECTORS > 0 && Disk_Hold(0, 0) == -1)
+                fs_log(TRACE_ERRORS, "___ journal of '%s' replayed, but FS_Sync() won't use it on this disk backend\n", filesys_name);
+            if(bitmaps_load() == -1) {
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            fd_table_reset();
             return 0;
         }
         else {
-            printf("... check magic failed, boot failed\n");
+            fs_log(TRACE_ERRORS, "... check magic failed, boot failed\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+
+    // do all of the other stuff needed...
+
+    return 0;
+}
+
+int FS_Boot(char *back_file) {
+    fs_log(TRACE_TEXT, "FS_Boot %s\n", back_file);
+    long start = op_begin(FS_OP_BOOT);
+    journal_stop_thread(); // they take fs_lock themselves
+    writeback_stop_thread();
+    pthread_rwlock_wrlock(&fs_lock);
+    int rc = fs_boot(back_file);
+    // by default only a disk that is not in memory anyway is read ahead;
+    // Disk_AioEngine() tells whether it stays in its file
+    readahead_window = readahead_max >= 0 ? readahead_max : Disk_AioEngine() != 0 ? READAHEAD_DEFAULT : 0;
+    delalloc_blocks = delalloc_max;
+    pthread_rwlock_unlock(&fs_lock);
+    if(rc == 0) {
+        journal_start_thread();
+        pthread_mutex_lock(&writeback.lock);
+        writeback.booted = 1;
+        pthread_mutex_unlock(&writeback.lock);
+        writeback_start_thread();
+    }
+    return op_end(FS_OP_BOOT, start, rc);
+}
+
+int FS_Sync()
+{
+    fs_log(TRACE_TEXT, "FS_Sync\n");
+    long start = op_begin(FS_OP_SYNC);
+
+    //write back the bitmaps, dirty inodes and buffers, then save the disk;
+    //calls in flight finish first and new ones wait. With a journal the
+    //metadata is logged instead of written in place
+    int rc;
+    if(journal.active)
+        rc = journal_sync();
+    else {
+        pthread_rwlock_wrlock(&fs_lock);
+        rc = (fs_flush() == -1 || Disk_Save(filesys_name) == -1) ? -1 : 0;
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    if (rc == -1) {
+        fs_log(TRACE_ERRORS, "___ Disk sync for file %s failed\n", filesys_name);
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_SYNC, start, -1);
+    }
+    else {
+        fs_log(TRACE_TEXT, "___ disk sync successfull for file %s\n", filesys_name);
+        return op_end(FS_OP_SYNC, start, 0);
+    }
+}
+
+int FS_SetOption(FS_Option_t option, int value)
+{
+    fs_log(TRACE_TEXT, "FS_SetOption %d = %d\n", option, value);
+
+    switch(option) {
+    case FS_OPT_CACHE_SECTORS:
+        if(value <= 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        cache_sectors = value;
+        return 0;
+    case FS_OPT_DCACHE:
+        dcache_enabled = (value != 0);
+        dcache_init();
+        return 0;
+    case FS_OPT_DIR_FORMAT:
+        if(value != FS_DIR_LINEAR && value != FS_DIR_HASHED) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        dir_format = value;
+        return 0;
+    case FS_OPT_FSYNC:
+        disk_sync_mode = value ? (disk_sync_mode | DISK_SYNC_FSYNC) : (disk_sync_mode & ~DISK_SYNC_FSYNC);
+        Disk_SetSyncMode(disk_sync_mode);
+        return 0;
+    case FS_OPT_FULL_SYNC:
+        disk_sync_mode = value ? (disk_sync_mode | DISK_SYNC_FULL) : (disk_sync_mode & ~DISK_SYNC_FULL);
+        Disk_SetSyncMode(disk_sync_mode);
+        return 0;
+    case FS_OPT_DISK_SECTORS:
+        if(Disk_SetSectors(value) == -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        return 0;
+    case FS_OPT_INODES:
+        if(value <= 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        format_inodes = value;
+        return 0;
+    case FS_OPT_DISK_BACKEND:
+        if(Disk_SetBackend(value == FS_DISK_MMAP ? DISK_BACKEND_MMAP :
+                           value == FS_DISK_FILE ? DISK_BACKEND_FILE :
+                           value == FS_DISK_MEMORY ? DISK_BACKEND_MEMORY : -1) == -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        disk_backend = value;
+        return 0;
+    case FS_OPT_JOURNAL_SECTORS:
+        if(value != 0 && value < JOURNAL_MIN_SECTORS) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        format_journal = value;
+        return 0;
+    case FS_OPT_CHECKPOINT_MS:
+        if(value < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        pthread_mutex_lock(&journal.wake_lock);
+        checkpoint_ms = value;
+        journal.retimed = 1;
+        pthread_cond_signal(&journal.wake);
+        pthread_mutex_unlock(&journal.wake_lock);
+        return 0;
+    case FS_OPT_READAHEAD:
+        if(value < -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        readahead_max = value;
+        return 0;
+    case FS_OPT_DELALLOC:
+        if(value < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        delalloc_max = value;
+        return 0;
+    case FS_OPT_STATS:
+        if(value < 0) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        __atomic_store_n(&stats_every, value, __ATOMIC_RELAXED);
+        return 0;
+    case FS_OPT_WRITEBACK_MS:
+    case FS_OPT_WRITEBACK_DIRTY:
+        if(value < 0 || (option == FS_OPT_WRITEBACK_DIRTY && value > 100)) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        pthread_mutex_lock(&writeback.lock);
+        if(option == FS_OPT_WRITEBACK_MS)
+            writeback_ms = value;
+        else
+            writeback_dirty = value;
+        pthread_mutex_unlock(&writeback.lock);
+        writeback_start_thread();
+        return 0;
+    case FS_OPT_DISK_QUEUE_DEPTH:
+        if(value <= 0 || Disk_SetAio(DISK_AIO_AUTO, value) == -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        return 0;
+    default:
+        osErrno = E_GENERAL;
+        return -1;
+    }
+}
+
+void FS_GetWritebackStats(FS_Writeback_Stats *stats)
+{
+    pthread_mutex_lock(&writeback.lock);
+    *stats = writeback.stats;
+    pthread_mutex_unlock(&writeback.lock);
+}
+
+int FS_GetFragmentation(FS_Frag_Stats *stats)
+{
+    fs_log(TRACE_TEXT, "FS_GetFragmentation\n");
+    memset(stats, 0, sizeof(FS_Frag_Stats));
+
+    pthread_rwlock_rdlock(&fs_lock);
+    for(int i = 0; i < layout.inodes; i++) {
+        if(!inode_in_use(i))
+            continue;
+        inode_t* inode = get_inode(i);
+        if(inode == NULL) {
+            pthread_rwlock_unlock(&fs_lock);
             osErrno = E_GENERAL;
             return -1;
         }
+        inode_lock(inode, 0);
+        if(inode->type == 0) {
+            int extents = inode->map.nextents;
+            int bucket = 0;
+            while(bucket < FS_FRAG_BUCKETS - 1 && extents > (1 << bucket))
+                bucket++;
+            stats->files++;
+            stats->blocks += file_mapped(inode);
+            stats->delayed += ((icache_entry_t*)inode)->ndelayed;
+            stats->extents += extents;
+            if(extents > stats->max_extents)
+                stats->max_extents = extents;
+            stats->histogram[bucket]++;
+        }
+        inode_unlock(inode);
+        put_inode(inode, 0);
     }
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
 
-    // do all of the other stuff needed...
+int FS_GetStats(FS_Stats *stats)
+{
+    memset(stats, 0, sizeof(FS_Stats));
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&stats_lock);
+    unsigned long gen = __atomic_load_n(&stats_gen, __ATOMIC_RELAXED);
+    for(stats_block_t* block = stats_blocks; block != NULL; block = block->next) {
+        if(__atomic_load_n(&block->gen, __ATOMIC_ACQUIRE) == gen)
+            stats_merge(stats->ops, block);
+    }
+    if(stats_retired.gen == gen)
+        stats_merge(stats->ops, &stats_retired);
+    stats_io(stats);
+    stats->cache_hits -= stats_base.cache_hits;
+    stats->cache_misses -= stats_base.cache_misses;
+    stats->cache_evictions -= stats_base.cache_evictions;
+    stats->cache_writebacks -= stats_base.cache_writebacks;
+    stats->disk_reads -= stats_base.disk_reads;
+    stats->disk_writes -= stats_base.disk_writes;
+    stats->disk_sectors_read -= stats_base.disk_sectors_read;
+    stats->disk_sectors_written -= stats_base.disk_sectors_written;
+    stats->disk_seeks -= stats_base.disk_seeks;
+    stats->disk_model_ns -= stats_base.disk_model_ns;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
+
+void FS_ResetStats()
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&stats_lock);
+    stats_io(&stats_base);
+    __atomic_add_fetch(&stats_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+long FS_HistPercentile(const FS_Histogram *hist, double percentile)
+{
+    double rank = percentile / 100 * hist->count;
+    long seen = 0;
+    if(hist->count == 0)
+        return 0;
+    for(int b = 0; b < FS_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if(seen > 0 && seen >= rank)
+            return hist_upper(b) < hist->max_ns ? hist_upper(b) : hist->max_ns;
+    }
+    return hist->max_ns;
+}
+
+const char* FS_OpName(FS_Op_t op)
+{
+    return op >= 0 && op < FS_OP_COUNT ? op_names[op] : "unknown";
+}
+
+int FS_DumpStats(FILE *out)
+{
+    FS_Stats* stats = malloc(sizeof(FS_Stats));
+    if(stats == NULL || FS_GetStats(stats) == -1) {
+        free(stats);
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
+    // latencies in microseconds, the histogram as [largest ns, count]
+    // pairs for the buckets in use
+    fprintf(out, "{\n  \"ops\": {\n");
+    for(int op = 0; op < FS_OP_COUNT; op++) {
+        FS_Op_Stats* o = &stats->ops[op];
+        FS_Histogram* h = &o->latency;
+        fprintf(out, "    \"%s\": {\"calls\": %ld, \"errors\": %ld, \"timed\": %ld, \"mean_us\": %.3f, "
+                "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+                "\"histogram\": [", op_names[op], o->calls, o->errors, h->count, h->count > 0 ? h->total_ns / 1e3 / h->count : 0.0,
+                FS_HistPercentile(h, 50) / 1e3, FS_HistPercentile(h, 90) / 1e3, FS_HistPercentile(h, 99) / 1e3,
+                FS_HistPercentile(h, 99.9) / 1e3, h->max_ns / 1e3);
+        int first = 1;
+        for(int b = 0; b < FS_HIST_BUCKETS; b++) {
+            if(h->buckets[b] == 0)
+                continue;
+            fprintf(out, "%s[%ld, %ld]", first ? "" : ", ", hist_upper(b), h->buckets[b]);
+            first = 0;
+        }
+        fprintf(out, "]}%s\n", op + 1 < FS_OP_COUNT ? "," : "");
+    }
+    long lookups = stats->cache_hits + stats->cache_misses;
+    fprintf(out, "  },\n  \"cache\": {\"hits\": %ld, \"misses\": %ld, \"hit_rate\": %.4f, \"evictions\": %ld, "
+            "\"writebacks\": %ld},\n", stats->cache_hits, stats->cache_misses,
+            lookups > 0 ? (double)stats->cache_hits / lookups : 0.0, stats->cache_evictions, stats->cache_writebacks);
+    fprintf(out, "  \"disk\": {\"reads\": %ld, \"writes\": %ld, \"sectors_read\": %ld, \"sectors_written\": %ld, "
+            "\"seeks\": %ld, \"model_ms\": %.3f}\n}\n", stats->disk_reads, stats->disk_writes, stats->disk_sectors_read,
+            stats->disk_sectors_written, stats->disk_seeks, stats->disk_model_ns / 1e6);
+    free(stats);
+    if(ferror(out)) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
     return 0;
 }
 
-int FS_Sync()
+const char* FS_EventName(int event)
 {
-    printf("FS_Sync\n");
+    if(event >= 0 && event < FS_OP_COUNT)
+        return op_names[event];
+    return event >= FS_OP_COUNT && event < FS_EV_COUNT ? event_names[event - FS_OP_COUNT] : "unknown";
+}
 
-    //just have to do disk save
-    if (Disk_Save(filesys_name) == -1) {
-        printf("___ Disk sync for file %s failed\n", filesys_name);
+int FS_TraceSave(const char *path)
+{
+    fs_log(TRACE_TEXT, "FS_TraceSave %s\n", path);
+    pthread_once(&stats_once, stats_key_init); // the clock is calibrated
+    FS_Trace_Event* events = malloc(sizeof(FS_Trace_Event) * TRACE_RING_EVENTS);
+    FILE* f = fopen(path, "wb");
+    if(events == NULL || f == NULL) {
+        free(events);
+        if(f != NULL)
+            fclose(f);
         osErrno = E_GENERAL;
         return -1;
     }
-    else {
-        printf("___ disk sync successfull for file %s\n", filesys_name);
-        return 0;
+
+    pthread_mutex_lock(&trace_lock);
+    FS_Trace_Header header = {FS_TRACE_MAGIC, trace_threads, TRACE_RING_EVENTS, ns_per_tick};
+    int rc = fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : -1;
+    for(trace_ring_t* ring = trace_rings; ring != NULL && rc == 0; ring = ring->next) {
+        FS_Trace_Thread thread = {ring->thread, 0, 0};
+        thread.count = trace_copy(ring, events, &thread.lost);
+        if(fwrite(&thread, sizeof(thread), 1, f) != 1 ||
+           fwrite(events, sizeof(FS_Trace_Event), thread.count, f) != (size_t)thread.count)
+            rc = -1;
     }
+    pthread_mutex_unlock(&trace_lock);
+    free(events);
+    if(fclose(f) != 0 || rc == -1) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    return 0;
 }
 
 /**********************END OF DISK FUNCTIONS********************************/
@@ -723,302 +3733,767 @@ int
 File_Create(char *file)
 {
     
-    printf("File_Create('%s'):\n", file);
-    return create_file_or_directory(0, file);
+    fs_log(TRACE_TEXT, "File_Create('%s'):\n", file);
+    long start = op_begin(FS_OP_CREATE);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = create_file_or_directory(0, file);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_CREATE, start, rc);
 }
 
-int File_Open(char *file)
+// File_Open() once fs_lock is held
+static int file_open(char *file)
 {
-    printf("FS_Open '%s'\n", file);
-    //first unused file descriptor
-    int fd;
-    bool found = false;
-    for(int i = 0; i < MAX_OPEN_FILES; i++) {
-       if(open_files[i].inode == 0) {
-           fd = i;
-           found = true;
-           break;
-       }
-    }
-    if(!found) {
-        printf("___ max files already open\n");
+    //an unused file descriptor, reserved with inode -1 while the path
+    //is looked up
+    pthread_mutex_lock(&fd_lock);
+    int fd = fd_alloc();
+    open_file_t* of = fd == -1 ? NULL : fd_slot(fd);
+    if(of != NULL)
+        of->inode = -1;
+    pthread_mutex_unlock(&fd_lock);
+    if(of == NULL) {
+        fs_log(TRACE_TEXT, "___ max files already open\n");
         osErrno = E_TOO_MANY_OPEN_FILES;
         return -1;
     }
 
     int child_inode;
+    osErrno = E_GENERAL; // until the lookup or get_inode() finds every in-core inode pinned
     follow_path(file, &child_inode, NULL); //retrieves child inode number of 'file'
-    if (child_inode == -1) {
-        printf("___ file '%s' not found\n", file);
+    inode_t* child = child_inode == -1 ? NULL : get_inode(child_inode); // stays pinned until File_Close()
+    if(child != NULL)
+        inode_lock(child, 0);
+    if(child == NULL && osErrno == E_TOO_MANY_OPEN_FILES) {
+        fs_log(TRACE_TEXT, "___ no in-core inode left for '%s'\n", file);
+    }
+    // the file may have been unlinked since it was looked up
+    else if (child_inode == -1 || (child != NULL && !inode_in_use(child_inode))) {
+        fs_log(TRACE_TEXT, "___ file '%s' not found\n", file);
         osErrno = E_NO_SUCH_FILE;
-        return -1;
+    }
+    else if(child == NULL) {
+        fs_log(TRACE_ERRORS, "___ cant read inode for file '%s' from disk sector\n", file);
+        osErrno = E_GENERAL;
+    }
+    else if(child->type != 0) {
+        fs_log(TRACE_TEXT, "___ FILE ERROR - '%s' not a file\n", file);
+        osErrno = E_GENERAL;
     }
     else {
-        int inode_sector = INODE_TABLE_START_SECTOR + child_inode/INODES_PER_SECTOR;
-        char buffer[SECTOR_SIZE];
-        if(Disk_Read(inode_sector, buffer) == -1) {
-            printf("___ cant read inode for file '%s' from disk sector\n");
-            osErrno = E_GENERAL;
-            return -1;
-        }
-        printf("___ disk read success, loading inode table entry for for inode from disk sector\n");
-
-        int inode_start = (inode_sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-        int offset = child_inode - inode_start;
-        assert(offset >= 0 && offset < INODES_PER_SECTOR);
-        inode_t* child = (inode_t*) (buffer + offset* sizeof(inode_t));
-        printf("___ inode %d, size = %d, type = %d", child_inode, child->size, child->type);
-
-        if(child->type != 0) {
-            printf("___ FILE ERROR - '%s' not a file\n", file);
-            osErrno = E_GENERAL;
-            return -1;
-        }
-
-        //all correct. initialize file entries in open file table
-        open_files[fd].inode = child_inode;
-        open_files[fd].size = child->size;
-        open_files[fd].pos = 0;
+        fs_log(TRACE_TEXT, "___ inode %d, size = %d, type = %d\n", child_inode, child->size, child->type);
+
+        //all correct. initialize file entries in open file table; File_Unlink()
+        //checks the open count under the inode lock held here
+        __atomic_add_fetch(&((icache_entry_t*)child)->opens, 1, __ATOMIC_RELAXED);
+        of->size = child->size;
+        of->pos = 0;
+        of->ip = child;
+        of->map.ext = -1;
+        of->map.sector = -1;
+        of->ra = (readahead_t){ 0, 0, 0 };
+        __atomic_store_n(&of->inode, child_inode, __ATOMIC_RELEASE);
+        inode_unlock(child);
         return fd; //file descriptor returned
-
     }
 
+    if(child != NULL) {
+        inode_unlock(child);
+        put_inode(child, 0);
+    }
+    pthread_mutex_lock(&fd_lock);
+    fd_release(fd);
+    pthread_mutex_unlock(&fd_lock);
+    return -1;
 }
 
-int
-File_Read(int fd, void *buffer, int size)
+int File_Open(char *file)
 {
-    printf("FS_Read\n");
-    /* YOUR CODE */
-    int remaining_bytes = size; // the bytes remaining to write
-    int initial_position = open_files[fd].pos; // initial position to start write
-    printf("___ Initial Position of pos variable is : %d\n",initial_position);
-    int start = open_files[fd].pos / SECTOR_SIZE; // current location of file pointer
-    int end = ((size+open_files[fd].pos+SECTOR_SIZE-1)/SECTOR_SIZE); // end point after write
+    fs_log(TRACE_TEXT, "FS_Open '%s'\n", file);
+    long start = op_begin(FS_OP_OPEN);
+    pthread_rwlock_rdlock(&fs_lock);
+    int fd = file_open(file);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_OPEN, start, fd);
+}
 
-    printf("___ Start : %d  End : %d Size: %d\n",start,end,size);
+// lock out FS_Sync() and the other users of open file 'of' that would
+// conflict with a transfer: any writer, and with 'write' any reader too.
+// Calls that use the descriptor's position or map cursor take its own
+// lock first, since readers of the inode share it
+static void io_begin(open_file_t* of, int write)
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    inode_lock(of->ip, write);
+}
 
-    // error checking
+static void io_end(open_file_t* of)
+{
+    inode_unlock(of->ip);
+    pthread_rwlock_unlock(&fs_lock);
+}
 
-    if(open_files[fd].inode < 1){ // if the file is not open
-        osErrno = E_BAD_FD;
+// total length of an iovec array, -1 if it is malformed or does not
+// fit an int
+static int iov_total(const struct iovec* iov, int iovcnt)
+{
+    if(iovcnt < 0 || iovcnt > FS_IOV_MAX || (iov == NULL && iovcnt > 0))
         return -1;
+    int total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > (size_t)(INT_MAX - total) || (iov[i].iov_base == NULL && iov[i].iov_len > 0))
+            return -1;
+        total += (int)iov[i].iov_len;
     }
+    return total;
+}
 
+// the whole-sector runs of a file transfer, handed to the cache together
+// in one scatter/gather call
+typedef struct io_batch {
+    Disk_Segment segs[IO_SEGMENTS];
+    int n;
+    int write;
+} io_batch_t;
 
-    inode_t* inode = get_inode(open_files[fd].inode); // grab file inode
+static int batch_flush(io_batch_t* batch)
+{
+    if(batch->n == 0)
+        return 0;
+    int rc = batch->write ? Cache_WriteV(batch->segs, batch->n) : Cache_ReadV(batch->segs, batch->n);
+    batch->n = 0;
+    return rc;
+}
 
-    if(inode->size < size)
-    {
-        printf("...File size exceeded! \n");
+// queues 'count' sectors from 'sector' for 'buffer', extending the last
+// segment when both the sectors and the memory carry on from it
+static int batch_add(io_batch_t* batch, sector_t sector, int count, char* buffer)
+{
+    if(batch->n > 0) {
+        Disk_Segment* last = &batch->segs[batch->n - 1];
+        if(last->sector + last->count == sector && last->buffer + (size_t)last->count * SECTOR_SIZE == buffer) {
+            last->count += count;
+            return 0;
+        }
+    }
+    if(batch->n == IO_SEGMENTS && batch_flush(batch) == -1)
         return -1;
+    batch->segs[batch->n++] = (Disk_Segment){ sector, count, buffer };
+    return 0;
+}
+
+// sequential readahead for a read of 'size' bytes at 'pos' through the
+// descriptor's own position: a read that starts where the last one
+// ended gets the file blocks after it prefetched into the cache, in
+// windows that double (up to readahead_window, and a quarter of the cache)
+// each time the stream runs past what was read ahead. Any other read
+// resets the window. Reads at least as big as the largest window get
+// nothing, they already go to the disk in large transfers. Called with
+// the descriptor's lock held, so one stream never prefetches twice
+static void readahead(open_file_t* of, int pos, int size)
+{
+    readahead_t* ra = &of->ra;
+    int first = pos / SECTOR_SIZE;
+    int end = (pos + size + SECTOR_SIZE - 1) / SECTOR_SIZE; // one past the last block read
+    int blocks = (of->ip->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int max = readahead_window < cache_sectors / 4 ? readahead_window : cache_sectors / 4;
+
+    int sequential = (pos == ra->next);
+    ra->next = pos + size;
+    if(!sequential || end - first >= max) {
+        ra->window = ra->ahead = 0;
+        return;
     }
+    if(end <= ra->ahead) // still inside the last window
+        return;
 
-    if(open_files[fd].pos %SECTOR_SIZE==0)
-        open_files[fd].pos = 0;
-
-    printf("___ Inode number --%d\n",open_files[fd].inode);
-    printf("___ File Inode size :: %d \n",inode->size);
-    int position = 0;
-    for(int i=start; i<end; i++) { // write everything byte by byte
-        // char data_buffer[SECTOR_SIZE];
-        char disk_buffer[SECTOR_SIZE];
-        int sector = inode->data[i];
-        printf("Sector number being read is : %d\n",sector);
-
-        if(open_files[fd].pos == 0){
-            // if all the remaining bytes don't fit in one sector
-            if(remaining_bytes >= SECTOR_SIZE){ // buffer gets as much as possible
-                Disk_Read(sector, disk_buffer);
-                memcpy(((char*)buffer + position), disk_buffer, SECTOR_SIZE);
-                position += SECTOR_SIZE;
-                printf("___ Full sector:: %d %.*s\n", sector, SECTOR_SIZE, disk_buffer);
-                remaining_bytes -= SECTOR_SIZE;
-            } else{ // buffer gets everything
-                Disk_Read(sector, disk_buffer);
-
-                memcpy(((char*)buffer + position), disk_buffer, remaining_bytes);
-                position += remaining_bytes;
-                printf("remaining_bytes:: %d %.*s\n", sector, remaining_bytes, disk_buffer);
-                remaining_bytes = 0;
-            }
-            // write data to sector
-        } else{
-            Disk_Read(sector, disk_buffer);
-            // printf("File pointer from middle:: %s",disk_buffer);
-            position += open_files[fd].pos%SECTOR_SIZE;
-            printf("From the middle:: %d :: %d  :: %.*s\n", sector, position,SECTOR_SIZE-position, disk_buffer+position);
-            memcpy(((char*)buffer + position), disk_buffer, SECTOR_SIZE - open_files[fd].size);
+    if(ra->window == 0)
+        ra->window = 2 * (end - first) > READAHEAD_MIN ? 2 * (end - first) : READAHEAD_MIN;
+    else
+        ra->window *= 2;
+    if(ra->window > max)
+        ra->window = max;
+
+    int block = first > ra->ahead ? first : ra->ahead;
+    int to = end + ra->window < blocks ? end + ra->window : blocks;
+    while(block < to) {
+        int run;
+        sector_t sector = file_bmap(of->ip, &of->map, block, &run);
+        if(sector < 0)
+            break;
+        if(run > to - block)
+            run = to - block;
+        if(Cache_Prefetch(sector, run) < 0)
+            break;
+        block += run;
+    }
+    ra->ahead = block;
+}
 
-            remaining_bytes -= SECTOR_SIZE-open_files[fd].pos;
+// reads up to 'size' bytes at 'pos' of an open file into the vectors,
+// one block map lookup and one pass over the sectors for the whole call.
+// Returns the bytes read, short only at the end of the file.
+static int file_readv(open_file_t* of, map_cursor_t* cursor, const struct iovec* iov, int size, int pos)
+{
+    inode_t* inode = of->ip; // file inode, pinned by File_Open()
+    if(pos >= inode->size)
+        return 0;
+    if(size > inode->size - pos) // reads stop at the end of the file
+        size = inode->size - pos;
+    fs_log(TRACE_TEXT, "___ inode %d, pos %d, reading %d bytes\n", of->inode, pos, size);
+    trace(TRACE_STEPS, 'B', FS_EV_FILE_READ, of->inode, pos / SECTOR_SIZE, size);
+    if(cursor == &of->map && readahead_window > 0) // File_Read(), with of->lock held
+        readahead(of, pos, size);
+
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    int mapped = file_mapped(inode);
+    io_batch_t batch = { .n = 0, .write = 0 };
+    int done = 0;
+    int rc = 0;
+    int v = 0;        // vector being filled
+    size_t vdone = 0; // bytes of it already filled
+    while(done < size) {
+        while(vdone == iov[v].iov_len) {
+            v++;
+            vdone = 0;
+        }
+        char* dst = (char*)iov[v].iov_base + vdone;
+        int room = size - done;
+        if(iov[v].iov_len - vdone < (size_t)room)
+            room = (int)(iov[v].iov_len - vdone);
+
+        int run, n;
+        int block = pos / SECTOR_SIZE;
+        int offset = pos % SECTOR_SIZE;
+        sector_t sector = block < mapped ? file_bmap(inode, cursor, block, &run) : 0;
+        if(sector < 0) {
+            rc = -1;
+            break;
+        }
 
-            open_files[fd].pos = 0;
+        if(block >= mapped) {
+            // delayed blocks, still in memory up to the end of the file
+            memcpy(dst, entry->delayed + (size_t)(block - mapped) * SECTOR_SIZE + offset, room);
+            n = room;
         }
+        else if(offset == 0 && room >= SECTOR_SIZE) {
+            // whole sectors: one segment per contiguous run, all of
+            // them read together
+            int count = room / SECTOR_SIZE;
+            if(count > run)
+                count = run;
+            if(batch_add(&batch, sector, count, dst) == -1) {
+                rc = -1;
+                break;
+            }
+            n = count * SECTOR_SIZE;
+        }
+        else {
+            // partial sector, or the tail of a vector
+            n = SECTOR_SIZE - offset;
+            if(n > room)
+                n = room;
+            char* data = Cache_Get(sector);
+            if(data == NULL) {
+                rc = -1;
+                break;
+            }
+            memcpy(dst, data + offset, n);
+            Cache_Put(data, 0);
+        }
+        done += n;
+        pos += n;
+        vdone += n;
+    }
+    if(rc == -1 || batch_flush(&batch) == -1) {
+        osErrno = E_GENERAL;
+        done = -1;
     }
+    trace(TRACE_STEPS, 'E', FS_EV_FILE_READ, of->inode, -1, done);
+    return done;
+}
 
-    File_Seek(fd,size);
+// writes 'size' bytes from the vectors at 'pos' of an open file, growing
+// it first if needed; the inode is updated once at the end. Returns the
+// bytes written.
+static int file_writev(open_file_t* of, map_cursor_t* cursor, const struct iovec* iov, int size, int pos)
+{
+    inode_t* inode = of->ip; // file inode, pinned by File_Open()
+    int end = pos + size;
+    if(end < pos) { // the size does not fit an int
+        osErrno = E_FILE_TOO_BIG;
+        return -1;
+    }
 
-    printf("My buffer%s\n",buffer );
+    // map every block the write reaches before copying anything, so a
+    // file that cannot grow is left untouched. While the blocks past
+    // those mapped stay few enough they are only delayed ones
+    icache_entry_t* entry = (icache_entry_t*)inode;
+    int old_blocks = file_blocks(inode);
+    int new_blocks = (end + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int mapped = old_blocks - entry->ndelayed;
+    int delayed = 0; // delayed blocks the write adds
+    if(new_blocks > old_blocks) {
+        if(new_blocks - mapped <= delalloc_blocks) {
+            if(delalloc_grow(inode, new_blocks - old_blocks) == -1)
+                return -1;
+            delayed = new_blocks - old_blocks;
+        }
+        else if(delalloc_flush(inode, new_blocks) == -1) {
+            fs_log(TRACE_TEXT, "___ can't grow inode %d to %d blocks\n", of->inode, new_blocks);
+            return -1;
+        }
+        else
+            mapped = new_blocks;
+    }
+    fs_log(TRACE_TEXT, "___ inode %d, pos %d, writing %d bytes\n", of->inode, pos, size);
+    trace(TRACE_STEPS, 'B', FS_EV_FILE_WRITE, of->inode, pos / SECTOR_SIZE, size);
+
+    io_batch_t batch = { .n = 0, .write = 1 };
+    int done = 0;
+    int rc = 0;
+    int v = 0;        // vector being consumed
+    size_t vdone = 0; // bytes of it already written
+    while(done < size) {
+        while(vdone == iov[v].iov_len) {
+            v++;
+            vdone = 0;
+        }
+        char* src = (char*)iov[v].iov_base + vdone;
+        int room = size - done;
+        if(iov[v].iov_len - vdone < (size_t)room)
+            room = (int)(iov[v].iov_len - vdone);
+
+        int run, n;
+        int block = pos / SECTOR_SIZE;
+        int offset = pos % SECTOR_SIZE;
+        sector_t sector = block < mapped ? file_bmap(inode, cursor, block, &run) : 0;
+        if(sector < 0) {
+            rc = -1;
+            break;
+        }
 
+        if(block >= mapped) {
+            // delayed blocks run to the end of the file, the rest of the
+            // vector waits in memory for their sectors
+            memcpy(entry->delayed + (size_t)(block - mapped) * SECTOR_SIZE + offset, src, room);
+            n = room;
+        }
+        else if(offset == 0 && room >= SECTOR_SIZE) {
+            // whole sectors: one segment per contiguous run, all of
+            // them written together
+            int count = room / SECTOR_SIZE;
+            if(count > run)
+                count = run;
+            if(batch_add(&batch, sector, count, src) == -1) {
+                rc = -1;
+                break;
+            }
+            n = count * SECTOR_SIZE;
+        }
+        else {
+            // partial sector, or the tail of a vector; a block the file
+            // did not have yet has no contents worth reading
+            n = SECTOR_SIZE - offset;
+            if(n > room)
+                n = room;
+            char* data = block < old_blocks ? Cache_Get(sector) : Cache_GetNew(sector);
+            if(data == NULL) {
+                rc = -1;
+                break;
+            }
+            memcpy(data + offset, src, n);
+            // the rest of a sector just added is written by the next
+            // vector, so it must not be zeroed again
+            if(block >= old_blocks)
+                old_blocks = block + 1;
+            Cache_Put(data, 1);
+        }
+        done += n;
+        pos += n;
+        vdone += n;
+    }
+    if(rc == -1 || batch_flush(&batch) == -1) {
+        delalloc_adjust(-delayed);
+        trace(TRACE_STEPS, 'E', FS_EV_FILE_WRITE, of->inode, -1, -1);
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
-    return -1;
+    entry->ndelayed += delayed;
+    if(pos > inode->size)
+        inode->size = pos;
+    of->size = inode->size;
+
+    // the in-core inode reaches the inode table on the next flush
+    mark_inode_dirty(inode);
+    fs_log(TRACE_TEXT, "... update child inode %d (size=%d, type=%d)\n",
+            of->inode, inode->size, inode->type);
+    trace(TRACE_STEPS, 'E', FS_EV_FILE_WRITE, of->inode, -1, size);
+    writeback_poke();
+    return size;
 }
 
 int
-File_Write(int fd, void *buffer, int size)
+File_Read(int fd, void *buffer, int size)
 {
-    printf("FS_Write\n");
-    int remaining_bytes = size; // the bytes remaining to write
-    int initial_position = open_files[fd].pos; // initial position to start write
-    // dprintf("\nInitial Position of pos variable is : %d\n",initial_position);
-    int start = open_files[fd].pos / SECTOR_SIZE; // current location of file pointer
-    int end = ((size+open_files[fd].pos+SECTOR_SIZE-1)/SECTOR_SIZE); // end point after write
-
+    fs_log(TRACE_TEXT, "FS_Read\n");
+    long start = op_begin(FS_OP_READ);
 
     // error checking
-    if(fd<0 && fd>MAX_OPEN_FILES) { // not enough space on the disk
-        osErrno = E_NO_SPACE;
-        return -1;
-    } else if(open_files[fd].inode < 1){ // if the file is not open
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
         osErrno = E_BAD_FD;
-        return -1;
-    } else if(end > 29){ // file exceeds maximum file size
-        osErrno = E_FILE_TOO_BIG;
-        return -1;
+        return op_end(FS_OP_READ, start, -1);
+    }
+    if(size < 0 || buffer == NULL) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_READ, start, -1);
     }
 
-    inode_t* inode = get_inode(open_files[fd].inode); // grab file inode
-
-    printf("___ Start : %d  End : %d Size: %d\n",start,end,inode->size);
+    struct iovec iov = { buffer, (size_t)size };
+    pthread_mutex_lock(&of->lock);
+    io_begin(of, 0);
+    int done = file_readv(of, &of->map, &iov, size, of->pos);
+    io_end(of);
+    if(done > 0)
+        of->pos += done;
+    pthread_mutex_unlock(&of->lock);
+    return op_end(FS_OP_READ, start, done); // bytes read, 0 at the end of the file
+}
 
-    int i;
+int
+File_Write(int fd, void *buffer, int size)
+{
+    fs_log(TRACE_TEXT, "FS_Write\n");
+    long start = op_begin(FS_OP_WRITE);
 
-    int child_inode = open_files[fd].inode;
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_WRITE, start, -1);
+    }
+    if(size < 0 || buffer == NULL) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_WRITE, start, -1);
+    }
 
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
+    struct iovec iov = { buffer, (size_t)size };
+    pthread_mutex_lock(&of->lock);
+    io_begin(of, 1);
+    int done = file_writev(of, &of->map, &iov, size, of->pos);
+    io_end(of);
+    if(done > 0)
+        of->pos += done;
+    pthread_mutex_unlock(&of->lock);
+    return op_end(FS_OP_WRITE, start, done);
+}
 
-    // get the child inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+int File_Readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    fs_log(TRACE_TEXT, "FS_Readv\n");
+    long start = op_begin(FS_OP_READV);
 
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_READV, start, -1);
+    }
+    int size = iov_total(iov, iovcnt);
+    if(size < 0) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_READV, start, -1);
+    }
 
-    for(i=start; i<end; i++) { // write everything byte by byte
-        // char data_buffer[SECTOR_SIZE];
-        char disk_buffer[SECTOR_SIZE];
-        char disk_data[2000];
-        int sector = inode->data[i];
+    pthread_mutex_lock(&of->lock);
+    io_begin(of, 0);
+    int done = file_readv(of, &of->map, iov, size, of->pos);
+    io_end(of);
+    if(done > 0)
+        of->pos += done;
+    pthread_mutex_unlock(&of->lock);
+    return op_end(FS_OP_READV, start, done); // bytes read, 0 at the end of the file
+}
 
+int File_Writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    fs_log(TRACE_TEXT, "FS_Writev\n");
+    long start = op_begin(FS_OP_WRITEV);
 
-        if(sector==0) // find location where the information should be stored
-        {
-            sector = first_unused_bit(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-            inode->data[i]= sector;
-            child->data[i]=sector;
-            printf("___ Sector number to be written at is : %d\n",inode->data[i]);
-            open_files[fd].pos = 0;
-        }
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_WRITEV, start, -1);
+    }
+    int size = iov_total(iov, iovcnt);
+    if(size < 0) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_WRITEV, start, -1);
+    }
 
-        if(open_files[fd].pos == 0){
-            // if all the remaining bytes don't fit in one sector
+    pthread_mutex_lock(&of->lock);
+    io_begin(of, 1);
+    int done = file_writev(of, &of->map, iov, size, of->pos);
+    io_end(of);
+    if(done > 0)
+        of->pos += done;
+    pthread_mutex_unlock(&of->lock);
+    return op_end(FS_OP_WRITEV, start, done);
+}
 
-            // sector = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-            // inode->data[i]= sector;
-            // child->data[i]=sector;
+int File_PRead(int fd, void *buffer, int size, int offset)
+{
+    fs_log(TRACE_TEXT, "FS_PRead\n");
+    long start = op_begin(FS_OP_PREAD);
 
-            if(remaining_bytes >= SECTOR_SIZE){ // buffer gets as much as possible
-                memcpy(disk_buffer, ((char*)buffer + i * SECTOR_SIZE), SECTOR_SIZE);
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_PREAD, start, -1);
+    }
+    if(size < 0 || buffer == NULL) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_PREAD, start, -1);
+    }
 
-                remaining_bytes -= SECTOR_SIZE;
-            } else{ // buffer gets everything
-                memcpy(disk_buffer, ((char*)buffer + i * SECTOR_SIZE), remaining_bytes);
-                remaining_bytes = 0;
-            }
-            printf("___ XXXXXSector Number to which data is written :: %d\n",sector);
-            printf("___ Data written :: %s\n",disk_buffer);
+    // a private map cursor: neither the position nor the lookup cache of
+    // the descriptor is touched, so threads can share the descriptor
+    extent_t extents[EXTENTS_PER_SECTOR];
+    map_cursor_t map = { -1, 0, -1, 0, extents };
+    struct iovec iov = { buffer, (size_t)size };
+    int done;
+    io_begin(of, 0);
+    if(offset < 0 || offset > of->ip->size) {
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        done = -1;
+    }
+    else
+        done = file_readv(of, &map, &iov, size, offset);
+    io_end(of);
+    return op_end(FS_OP_PREAD, start, done); // bytes read, 0 at the end of the file
+}
 
-            Disk_Write(sector, disk_buffer); // write data to sector
-            Disk_Read(sector, disk_data);
-        } else{
-            Disk_Read(sector, disk_buffer);
-            memcpy(disk_buffer, (disk_buffer+open_files[fd].size), SECTOR_SIZE-open_files[fd].size);
-            Disk_Write(sector, disk_buffer);
-            printf("___ Data written :: %s\n",disk_buffer);
-            remaining_bytes -= SECTOR_SIZE-open_files[fd].size;
-            open_files[fd].pos = 0;
-        }
+int File_PWrite(int fd, void *buffer, int size, int offset)
+{
+    fs_log(TRACE_TEXT, "FS_PWrite\n");
+    long start = op_begin(FS_OP_PWRITE);
 
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_PWRITE, start, -1);
+    }
+    if(size < 0 || buffer == NULL) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_PWRITE, start, -1);
     }
-    //  printf("Inode number --%d\n",open_files[fd].inode);
-    // for(i=0;i<30;i++)
-    //  printf(":: %d  ",inode->data[i]);
-    // printf("\n");
 
+    extent_t extents[EXTENTS_PER_SECTOR];
+    map_cursor_t map = { -1, 0, -1, 0, extents };
+    struct iovec iov = { buffer, (size_t)size };
+    int done;
+    io_begin(of, 1);
+    // like File_Seek(), writes may start at the end of the file but not
+    // past it, so files never have holes
+    if(offset < 0 || offset > of->ip->size) {
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        done = -1;
+    }
+    else
+        done = file_writev(of, &map, &iov, size, offset);
+    io_end(of);
+    return op_end(FS_OP_PWRITE, start, done);
+}
 
-    inode->size = initial_position+size;
-    open_files[fd].pos = initial_position+size; // move end file pointer to the end
-    open_files[fd].size = initial_position+size;
-    // load the disk sector containing the child inode
+int File_ReadView(int fd, int offset, int size, File_View *view)
+{
+    fs_log(TRACE_TEXT, "FS_ReadView\n");
+    long start = op_begin(FS_OP_READVIEW);
 
-    // update the new child inode and write to disk
+    // error checking
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_READVIEW, start, -1);
+    }
+    if(view == NULL || size < 0) {
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_READVIEW, start, -1);
+    }
+    view->count = 0;
+
+    inode_t* inode = of->ip; // file inode, pinned by File_Open()
+    // a private map cursor, as in File_PRead(): the view neither uses nor
+    // moves the descriptor's
+    extent_t extents[EXTENTS_PER_SECTOR];
+    map_cursor_t map = { -1, 0, -1, 0, extents };
+    io_begin(of, 0);
+    if(((icache_entry_t*)inode)->ndelayed > 0) {
+        // views point at sectors, so delayed blocks get theirs first
+        io_end(of);
+        io_begin(of, 1);
+        if(delalloc_flush(inode, 0) == -1) {
+            io_end(of);
+            return op_end(FS_OP_READVIEW, start, -1);
+        }
+    }
+    if(offset < 0 || offset > inode->size) {
+        io_end(of);
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        return op_end(FS_OP_READVIEW, start, -1);
+    }
+    if(size > inode->size - offset) // views stop at the end of the file
+        size = inode->size - offset;
+
+    // cached sectors may be newer than the disk, so each one gets its
+    // own segment; runs of sectors that are not cached are viewed on
+    // the disk in one piece
+    int done = 0;
+    while(done < size && view->count < FS_VIEW_SEGMENTS) {
+        int run;
+        int pos = offset + done;
+        int skip = pos % SECTOR_SIZE;
+        sector_t sector = file_bmap(inode, &map, pos / SECTOR_SIZE, &run);
+        if(sector < 0)
+            break;
 
-    child->size = initial_position+size;
-    printf("%d\n",child->size);
-    if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-    printf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-            child_inode, child->size, child->type, inode_sector);
+        char* base = Cache_Peek(sector);
+        int n;
+        view->pinned[view->count] = base;
+        if(base != NULL)
+            n = SECTOR_SIZE - skip;
+        else if(disk_backend == FS_DISK_FILE) {
+            // the disk is not in memory: bring the rest of the run the
+            // view asks for into the cache in one read (sectors already
+            // cached are skipped), so this call and the next ones find
+            // it there, and view the sector in the cache
+            int want = (skip + size - done + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            if(want > run)
+                want = run;
+            if(want > 1)
+                Cache_Prefetch(sector, want);
+            if((base = Cache_Get(sector)) == NULL)
+                break;
+            view->pinned[view->count] = base;
+            n = SECTOR_SIZE - skip;
+        }
+        else {
+            int want = (skip + size - done + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            int count = 1;
+            if(want > run)
+                want = run;
+            while(count < want) {
+                char* cached = Cache_Peek(sector + count);
+                if(cached != NULL) {
+                    Cache_Put(cached, 0);
+                    break;
+                }
+                count++;
+            }
+            if((base = Disk_View(sector, count)) == NULL)
+                break;
+            n = count * SECTOR_SIZE - skip;
+        }
+        if(n > size - done)
+            n = size - done;
+        view->iov[view->count].iov_base = base + skip;
+        view->iov[view->count].iov_len = n;
+        view->count++;
+        done += n;
+    }
+    io_end(of);
 
-    File_Seek(fd,size);
+    if(done == 0 && size > 0) {
+        File_ReleaseView(view);
+        osErrno = E_GENERAL;
+        return op_end(FS_OP_READVIEW, start, -1);
+    }
+    return op_end(FS_OP_READVIEW, start, done); // bytes covered by the view, 0 at the end of the file
+}
 
-    return size;
+void File_ReleaseView(File_View *view)
+{
+    fs_log(TRACE_TEXT, "FS_ReleaseView\n");
+    for(int i = 0; i < view->count; i++) {
+        if(view->pinned[i] != NULL)
+            Cache_Put(view->pinned[i], 0);
+    }
+    view->count = 0;
 }
 
 int File_Seek(int fd, int offset)
 {
-    printf("FS_Seek\n");
-    bool is_open = false;
-    for(int i = 0; i < MAX_OPEN_FILES; i++) {
-        if(open_files[i].inode == open_files[fd].inode) {
-            if(open_files[fd].size < offset) {
-                osErrno = E_SEEK_OUT_OF_BOUNDS;
-                return -1;
-            }
-            open_files[fd].pos = offset; //position updated
-            return open_files[fd].pos;
-        }
+    fs_log(TRACE_TEXT, "FS_Seek\n");
+    long start = op_begin(FS_OP_SEEK);
+    open_file_t* of = fd_get(fd);
+    if(of == NULL) { // if the file is not open
+        osErrno = E_BAD_FD;
+        return op_end(FS_OP_SEEK, start, -1);
     }
-    osErrno = E_BAD_FD;
-    return -1;
+    io_begin(of, 0);
+    int size = of->ip->size;
+    io_end(of);
+    if(offset < 0 || offset > size) {
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        return op_end(FS_OP_SEEK, start, -1);
+    }
+    pthread_mutex_lock(&of->lock);
+    of->pos = offset; //position updated
+    pthread_mutex_unlock(&of->lock);
+    return op_end(FS_OP_SEEK, start, offset);
 }
 
 int File_Close(int fd)
 {
-    printf("FS_Close\n");
+    fs_log(TRACE_TEXT, "FS_Close\n");
+    long start = op_begin(FS_OP_CLOSE);
     //bound check
-    if (fd < 0 || fd > MAX_OPEN_FILES) {
-        printf("___ file descriptor '%d' out of bound\n", fd);
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        fs_log(TRACE_TEXT, "___ file descriptor '%d' out of bound\n", fd);
         osErrno = E_BAD_FD;
-        return -1;
+        return op_end(FS_OP_CLOSE, start, -1);
     }
     //check if opened or not
-    if (open_files[fd].inode <= 0) {
-        printf("___ file with fd '%d' not open\n", fd);
+    pthread_mutex_lock(&fd_lock);
+    open_file_t* of = fd_get(fd);
+    if (of == NULL) {
+        pthread_mutex_unlock(&fd_lock);
+        fs_log(TRACE_TEXT, "___ file with fd '%d' not open\n", fd);
         osErrno = E_BAD_FD;
-        return -1;
+        return op_end(FS_OP_CLOSE, start, -1);
     }
     //close file
-    open_files[fd].inode = 0;
-    printf("___ file with fd '%d' closed successfully\n");
-    return 0;
+    inode_t* inode = of->ip;
+    fd_release(fd);
+    pthread_mutex_unlock(&fd_lock);
+    pthread_rwlock_rdlock(&fs_lock);
+    // delayed blocks get their sectors now; if they cannot, the data
+    // in them is lost and the close fails
+    inode_lock(inode, 1);
+    int rc = delalloc_flush(inode, 0);
+    if(rc == -1)
+        delalloc_drop(inode);
+    inode_unlock(inode);
+    __atomic_sub_fetch(&((icache_entry_t*)inode)->opens, 1, __ATOMIC_RELAXED);
+    put_inode(inode, 0);
+    pthread_rwlock_unlock(&fs_lock);
+    if(rc == -1) {
+        fs_log(TRACE_ERRORS, "___ file with fd '%d' closed, its delayed blocks could not be written\n", fd);
+        return op_end(FS_OP_CLOSE, start, -1);
+    }
+    fs_log(TRACE_TEXT, "___ file with fd '%d' closed successfully\n", fd);
+    return op_end(FS_OP_CLOSE, start, 0);
 
 }
 
-int File_Unlink(char *file)
+// File_Unlink() once fs_lock is held
+static int file_unlink(char *file)
 {
-    printf("FS_Unlink\n");
     int child_inode;
     char filename[MAX_NAME];
     int parent_inode = follow_path(file, &child_inode, filename); // finds the parent
@@ -1027,23 +4502,27 @@ int File_Unlink(char *file)
         osErrno = E_NO_SUCH_FILE;
         return -1; // file is not deleted
     }
-    bool is_open = false;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if(open_files[i].inode == child_inode) {
-            is_open = true;
-            break;
-        }
-    }
-    if(is_open){ // if file is in use
+    int rc = remove_inode(0, parent_inode, child_inode, filename); // checks it is not open
+    if(rc == -2){ // if file is in use
         osErrno = E_FILE_IN_USE;
         return -1; // file is not deleted
     }
-    if(remove_inode(0, parent_inode, child_inode) >= 0){ // file can be deleted
+    if(rc >= 0){ // file can be deleted
         return 0;
     }
     osErrno = E_GENERAL;
     return -1;
 }
+
+int File_Unlink(char *file)
+{
+    fs_log(TRACE_TEXT, "FS_Unlink\n");
+    long start = op_begin(FS_OP_UNLINK);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = file_unlink(file);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_UNLINK, start, rc);
+}
 /**********************END OF FILE FUNCTIONS********************************/
 
 
@@ -1051,88 +4530,107 @@ int File_Unlink(char *file)
 int
 Dir_Create(char *path)
 {
-    printf("Dir_Create %s\n", path);
-    return create_file_or_directory(1, path);
+    fs_log(TRACE_TEXT, "Dir_Create %s\n", path);
+    long start = op_begin(FS_OP_DIR_CREATE);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = create_file_or_directory(1, path);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_DIR_CREATE, start, rc);
 }
 
-int
-Dir_Size(char *path)
+// Dir_Size() once fs_lock is held
+static int dir_size(char *path)
 {
-    printf("Dir_Size\n");
     int byte_counter = 0;
     if(get_path_type(path)==1) { // if this is a directory
         int token;
         char filename[MAX_NAME];
         follow_path(path, &token, filename); // find the location of token
         inode_t* directory_inode = get_inode(token); // get the inode of token
+        if(directory_inode == NULL)
+            return -1;
 
-        printf("___ Inode Number received is : %d\n",token );
-        int i;
-        for(i=0; i<30; i++){ // for all 30 allocated data blocks per file
-            int sector = directory_inode->data[i]; // grab data from inode
-            char sector_buffer[SECTOR_SIZE];
-            Disk_Read(sector, sector_buffer); // save data onto sector_buffer
-
-            int j;
-            for(j=0; j<25; j++){
-                dirent_t* entry = (dirent_t*)(sector_buffer + (j*20)); // multiplied by 20 because each entry contains 16-byte names + 4-byte integer inode numbers
-                if(entry->inode>0)
-                    byte_counter+=20; // each entry is 20 bytes
-            }
-        }
-        printf("___ Byte Counter1 : %d\n", byte_counter);
+        fs_log(TRACE_TEXT, "___ Inode Number received is : %d\n",token );
+        inode_lock(directory_inode, 0);
+        byte_counter = directory_inode->size * sizeof(dirent_t); // each entry is 20 bytes, whatever the format
+        inode_unlock(directory_inode);
+        put_inode(directory_inode, 0);
+        fs_log(TRACE_TEXT, "___ Byte Counter1 : %d\n", byte_counter);
         return byte_counter; // return total byte count
     }
-    printf("___ Byte Counter2 : %d\n", byte_counter);
+    fs_log(TRACE_TEXT, "___ Byte Counter2 : %d\n", byte_counter);
     return 0; // files do not have any bytes referred to by path
 }
 
 int
-Dir_Read(char *path, void *buffer, int size)
+Dir_Size(char *path)
+{
+    fs_log(TRACE_TEXT, "Dir_Size\n");
+    long start = op_begin(FS_OP_DIR_SIZE);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = dir_size(path);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_DIR_SIZE, start, rc);
+}
+
+// Dir_Read() once fs_lock is held
+static int dir_read(char *path, void *buffer, int size)
 {
-    printf("Dir_Read\n");
-    int byte_counter = 0;
     if(get_path_type(path)==1) {
         int token;
         char filename[MAX_NAME];
         follow_path(path, &token, filename); // find location of token
 
-        int directory_size = Dir_Size(path);
-        printf("___ directory size: %d\n", directory_size);
+        inode_t* inode = get_inode(token);
+        if(inode == NULL)
+            return -1;
+        inode_lock(inode, 0); // entries cannot come or go while they are copied
+        int directory_size = inode->size * sizeof(dirent_t);
+        fs_log(TRACE_TEXT, "___ directory size: %d\n", directory_size);
 
         if(size < directory_size) { // size cannot contain all entries
+            inode_unlock(inode);
+            put_inode(inode, 0);
             osErrno = E_BUFFER_TOO_SMALL;
             return -1;
         }
 
-        printf("___ \t%-15s\t%-s\n", "NAME", "INODE");
-        inode_t* inode = get_inode(token);
-        if(inode->type == 1){ // if it's a directory
-            int i;
-            for(i=0; i<30; i++) { // for all 30 allocated data blocks per file
-                int sector =inode->data[i];
-                char sector_buffer[SECTOR_SIZE];
-                Disk_Read(sector, sector_buffer);
-
-                int j;
-                for(j=0; j<25; j++) {
-                    dirent_t* entry = (dirent_t*)(sector_buffer + (j*20));
-
-                    if(entry->inode > 0)
-                        printf("___ %-4d\t%-15s\t%-d\n", j, entry->fname, entry->inode);
-                }
-            }
+        fs_log(TRACE_TEXT, "___ \t%-15s\t%-s\n", "NAME", "INODE");
+        dir_iter_t it = {0, 0, 0};
+        dirent_t entry;
+        int count = 0, rc;
+        while((rc = dir_next(inode, &it, &entry)) > 0) { // 20-byte entries, same layout for both formats
+            memcpy((char*)buffer + count*sizeof(dirent_t), &entry, sizeof(dirent_t));
+            fs_log(TRACE_TEXT, "___ %-4d\t%-15.*s\t%-d\n", count, MAX_NAME, entry.fname, entry.inode); // a 16-byte name has no '\0'
+            count++;
+        }
+        inode_unlock(inode);
+        put_inode(inode, 0);
+        if(rc < 0) {
+            osErrno = E_GENERAL;
+            return -1;
         }
-        return byte_counter;
+        return count; // number of entries copied into the buffer
     }
+    osErrno = E_NO_SUCH_FILE;
     return -1;
 }
 
 int
-Dir_Unlink(char *path)
+Dir_Read(char *path, void *buffer, int size)
 {
-    printf("Dir_Unlink\n");
-    if(!strcmp(path, "/") != 0) { // directory does not exist
+    fs_log(TRACE_TEXT, "Dir_Read\n");
+    long start = op_begin(FS_OP_DIR_READ);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = dir_read(path, buffer, size);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_DIR_READ, start, rc);
+}
+
+// Dir_Unlink() once fs_lock is held
+static int dir_unlink(char *path)
+{
+    if(path == NULL) { // directory does not exist
         osErrno = E_GENERAL;
         return -1;
     }
@@ -1145,15 +4643,27 @@ Dir_Unlink(char *path)
         char filename[MAX_NAME];
         int parent_inode = follow_path(path, &token, filename);
 
-        inode_t* inode = get_inode(token); // get inode of token
-        if(inode->size > 0){ // there are still files within the directory
+        int rc = remove_inode(1, parent_inode, token, filename); // checks it is empty
+        if(rc == -2){ // there are still files within the directory
             osErrno = E_DIR_NOT_EMPTY;
             return -1;
         }
-        else if(remove_inode(1, parent_inode, token) >= 0){ // all clear; remove directory
+        else if(rc >= 0){ // all clear; remove directory
             return 0;
         }
     }
+    osErrno = E_NO_SUCH_FILE;
     return -1;
 }
+
+int
+Dir_Unlink(char *path)
+{
+    fs_log(TRACE_TEXT, "Dir_Unlink\n");
+    long start = op_begin(FS_OP_DIR_UNLINK);
+    pthread_rwlock_rdlock(&fs_lock);
+    int rc = dir_unlink(path);
+    pthread_rwlock_unlock(&fs_lock);
+    return op_end(FS_OP_DIR_UNLINK, start, rc);
+}
 /**********************END OF DIRECTORY FUNCTIONS********************************/
@@ -8,9 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
-// used for errors
-extern int osErrno;
+// used for errors, each thread has its own
+extern _Thread_local int osErrno;
     
 // error types - don't change anything about these!! (even the order!)
 typedef enum {
@@ -32,6 +33,166 @@ typedef enum {
 int FS_Boot(char *path);
 int FS_Sync();
 
+// tuning knobs, set them before FS_Boot()
+typedef enum {
+    FS_OPT_CACHE_SECTORS,   // capacity of the sector buffer cache
+    FS_OPT_DCACHE,          // 0 turns the path-lookup dentry cache off
+    FS_OPT_DIR_FORMAT,      // FS_Dir_Format_t given to directories made from now on
+    FS_OPT_FSYNC,           // 1 makes FS_Sync() wait for the image to reach stable storage
+    FS_OPT_FULL_SYNC,       // 1 makes FS_Sync() rewrite the whole image, not just changed sectors
+    FS_OPT_DISK_BACKEND,    // FS_Disk_Backend_t used by the next FS_Boot()
+    FS_OPT_DISK_SECTORS,    // size of the disks FS_Boot() formats (existing images keep theirs)
+    FS_OPT_INODES,          // number of inodes of the disks FS_Boot() formats
+    FS_OPT_DISK_QUEUE_DEPTH, // I/O requests FS_DISK_FILE keeps in flight
+    FS_OPT_JOURNAL_SECTORS, // size of the metadata journal of the disks FS_Boot() formats, 0 for none; only FS_DISK_MEMORY can use one, FS_Boot() fails to format it on the others and only replays the journals of existing disks there
+    FS_OPT_CHECKPOINT_MS,   // how often the journal is checkpointed in the background, 0 only when it fills
+    FS_OPT_WRITEBACK_MS,    // how often a background thread brings the image up to date, 0 for never (may change at any time)
+    FS_OPT_WRITEBACK_DIRTY, // percent of the disk the image may lack before that thread is woken, 0 for no limit (may change at any time)
+    FS_OPT_READAHEAD,       // largest window of sectors File_Read() prefetches for sequential reads, 0 for none, -1 (the default) for 64 with FS_DISK_FILE and none otherwise
+    FS_OPT_DELALLOC,        // most blocks a file grows by before they are given sectors (delayed allocation), 0 for none, 128 by default
+    FS_OPT_STATS,           // FS_GetStats() counts every call and times one in this many of each kind, 16 by default (a few percent), 1 times them all, 0 stops counting (may change at any time)
+} FS_Option_t;
+
+// on-disk directory formats
+typedef enum {
+    FS_DIR_LINEAR = 1,      // flat array of entries, at most 750 of them
+    FS_DIR_HASHED = 2,      // extendible hash table, no entry limit (the default)
+} FS_Dir_Format_t;
+
+// how FS_Boot() brings the disk image in
+typedef enum {
+    FS_DISK_MEMORY = 0,     // read the whole image into memory
+    FS_DISK_MMAP = 1,       // map the image, FS_Sync() msyncs the changed pages
+    FS_DISK_FILE = 2,       // leave the image in its file, sectors move through io_uring (or threads)
+} FS_Disk_Backend_t;
+
+int FS_SetOption(FS_Option_t option, int value);
+
+// what the background writeback thread has done since it was started
+typedef struct fs_writeback_stats {
+    long flushes;       // times it brought the image up to date
+    long timed;         // ... because FS_OPT_WRITEBACK_MS went by
+    long triggered;     // ... because FS_OPT_WRITEBACK_DIRTY was reached
+    long failed;        // ... and failed
+    long sectors;       // sectors the image lacked when they started
+    long total_us;      // time they took
+    long max_us;        // the longest one
+} FS_Writeback_Stats;
+
+void FS_GetWritebackStats(FS_Writeback_Stats *stats);
+
+// how the regular files are laid out on the disk
+#define FS_FRAG_BUCKETS 8
+typedef struct fs_frag_stats {
+    long files;         // regular files
+    long blocks;        // blocks they have sectors for
+    long delayed;       // blocks still waiting for them (FS_OPT_DELALLOC)
+    long extents;       // runs of consecutive sectors mapping the blocks
+    long max_extents;   // the most any one file needs
+    long histogram[FS_FRAG_BUCKETS]; // files by extents: 0-1, 2, 3-4, 5-8, ..., more than 64
+} FS_Frag_Stats;
+
+int FS_GetFragmentation(FS_Frag_Stats *stats);
+
+// calls counted and timed by FS_GetStats()
+typedef enum {
+    FS_OP_BOOT, FS_OP_SYNC,
+    FS_OP_CREATE, FS_OP_OPEN, FS_OP_READ, FS_OP_WRITE, FS_OP_READV, FS_OP_WRITEV,
+    FS_OP_PREAD, FS_OP_PWRITE, FS_OP_READVIEW, FS_OP_SEEK, FS_OP_CLOSE, FS_OP_UNLINK,
+    FS_OP_DIR_CREATE, FS_OP_DIR_SIZE, FS_OP_DIR_READ, FS_OP_DIR_UNLINK,
+    FS_OP_LOOKUP,           // path lookups, made by every call that takes a path
+    FS_OP_COUNT
+} FS_Op_t;
+
+// latency histogram in the style of HdrHistogram: values below 16 ns
+// have a bucket each, every power of two above is split into 8 buckets,
+// so a bucket is at most 12.5% wide. The last one also takes everything
+// above 2^41 ns (37 minutes)
+#define FS_HIST_BUCKETS 312
+typedef struct fs_histogram {
+    long count;
+    long total_ns;
+    long max_ns;
+    long buckets[FS_HIST_BUCKETS];
+} FS_Histogram;
+
+typedef struct fs_op_stats {
+    long calls;
+    long errors;            // calls that returned -1
+    FS_Histogram latency;   // of the calls that were timed (FS_OPT_STATS)
+} FS_Op_Stats;
+
+typedef struct fs_stats {
+    FS_Op_Stats ops[FS_OP_COUNT]; // indexed by FS_Op_t
+    long cache_hits;        // sector lookups the buffer cache answered
+    long cache_misses;      // ... that went to the disk
+    long cache_evictions;
+    long cache_writebacks;
+    long disk_reads;        // read requests the disk got
+    long disk_writes;       // write requests
+    long disk_sectors_read;
+    long disk_sectors_written;
+    long disk_seeks;        // requests not starting where the one before ended
+    long disk_model_ns;     // time the requests took in LibDisk's timing model (Disk_SetModel())
+} FS_Stats;
+
+// everything counted since the program started or FS_ResetStats()
+int FS_GetStats(FS_Stats *stats);
+void FS_ResetStats();
+// value (to within a bucket) that 'percentile' percent of 'hist' are at or below
+long FS_HistPercentile(const FS_Histogram *hist, double percentile);
+const char* FS_OpName(FS_Op_t op);
+// FS_GetStats() as a JSON object
+int FS_DumpStats(FILE *out);
+
+// binary trace, only recorded when LibFS.c is built with FS_TRACE_LEVEL
+// 2 or more (make TRACE=2). Its events are the calls of FS_Op_t and,
+// from level 3 on, these steps inside them
+typedef enum {
+    FS_EV_ADD_INODE = FS_OP_COUNT, // making a file or directory: parent, type / result
+    FS_EV_INODE_ALLOC,      // taking an inode number from the bitmap
+    FS_EV_INODE_LOAD,       // reading an inode into the in-core table: inode, sector
+    FS_EV_INODE_STORE,      // writing in-core inodes back to a sector of the table
+    FS_EV_DIR_ADD,          // adding an entry for the new inode to a directory
+    FS_EV_FILE_READ,        // copying out of a file: inode, first block, bytes
+    FS_EV_FILE_WRITE,       // copying into a file: inode, first block, bytes
+    FS_EV_FILE_GROW,        // giving a file's new blocks sectors: inode, blocks
+    FS_EV_SECTOR_ALLOC,     // a run of sectors from the bitmap: goal, wanted / first sector, got
+    FS_EV_DELALLOC_FLUSH,   // giving delayed blocks sectors and writing them: inode, blocks
+    FS_EV_JOURNAL_WRITE,    // writing a transaction to the log: offset, sectors
+    FS_EV_FLUSH,            // pushing all metadata and dirty buffers to the disk
+    FS_EV_COUNT
+} FS_Event_t;
+
+typedef struct fs_trace_event {
+    long ticks;             // clock ticks, FS_Trace_Header.ns_per_tick long
+    short event;            // FS_Op_t or FS_Event_t
+    char phase;             // 'B' or 'E', the begin or end of a span as in Chrome traces
+    char pad;
+    int inode;              // -1 where there is none
+    long sector;            // ditto
+    long arg;               // see FS_Event_t, what a call returned at its end
+} FS_Trace_Event;
+
+// FS_TraceSave() writes an FS_Trace_Header, then for every thread that
+// traced an FS_Trace_Thread and its last events, oldest first
+#define FS_TRACE_MAGIC "FSTRACE1"
+typedef struct fs_trace_header {
+    char magic[8];
+    int threads;
+    int ring_events;        // most events kept per thread
+    double ns_per_tick;
+} FS_Trace_Header;
+
+typedef struct fs_trace_thread {
+    int thread;             // 1 for the first thread that traced, and so on
+    int count;              // events that follow
+    long lost;              // older ones overwritten before the save
+} FS_Trace_Thread;
+
+int FS_TraceSave(const char *path);
+const char* FS_EventName(int event);
+
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
@@ -41,6 +202,34 @@ int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// positional versions of File_Read()/File_Write(): 'offset' replaces
+// the file position, which is neither used nor moved
+int File_PRead(int fd, void *buffer, int size, int offset);
+int File_PWrite(int fd, void *buffer, int size, int offset);
+
+// scatter/gather versions of File_Read()/File_Write(): the vectors are
+// filled or drained in order as if they were one buffer, with a single
+// pass over the file's sectors and one inode update per call
+#define FS_IOV_MAX 1024
+int File_Readv(int fd, const struct iovec *iov, int iovcnt);
+int File_Writev(int fd, const struct iovec *iov, int iovcnt);
+
+// zero-copy reads: the segments point straight at cached or resident
+// disk sectors. A view is a snapshot of the bytes at the call, and the
+// memory stays readable until File_ReleaseView(). It only keeps showing
+// those bytes while the range is not written, truncated or unlinked:
+// after that a segment may show the old data, the new data or, once
+// its sector is given to another file, something else entirely
+#define FS_VIEW_SEGMENTS 16
+typedef struct file_view {
+    int count;                          // segments in use
+    struct iovec iov[FS_VIEW_SEGMENTS]; // the data, in file order
+    char* pinned[FS_VIEW_SEGMENTS];     // cache buffer held for iov[i], NULL if it points at the disk
+} File_View;
+
+int File_ReadView(int fd, int offset, int size, File_View *view);
+void File_ReleaseView(File_View *view);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Size(char *path);
@@ -0,0 +1,1710 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+#include "LibCache.h"
+#include "LibAio.h"
+
+// LibFS built with TRACE=4 describes every call on stdout, so results
+// are written to a copy of the original stdout and stdout itself is sent
+// to /dev/null. With TRACE=2 or 3, BENCH_TRACE names a file the binary
+// trace is saved to at the end
+static FILE* out;
+
+static char* disk_file = "bench_disk";
+
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s <workload> [args]\n", prog);
+    fprintf(stderr, "workloads:\n");
+    fprintf(stderr, "  open-deep [depth] [opens]   File_Open latency on a deep tree, dentry cache on and off\n");
+    fprintf(stderr, "  alloc-full [rounds]         sector allocation throughput on a nearly full disk\n");
+    fprintf(stderr, "  seq-io [chunk] [reps]       sequential write/read throughput of 1 MB and 4 MB files\n");
+    fprintf(stderr, "  sync [bytes] [rounds]       FS_Sync cost after small changes, incremental vs full image\n");
+    fprintf(stderr, "  boot [boots]                FS_Boot and FS_Sync cost, in-memory vs mmap vs file disk backend\n");
+    fprintf(stderr, "  view [chunk] [reps]         sequential read of a 4 MB file, File_Read vs File_ReadView\n");
+    fprintf(stderr, "  records [count] [payload]   appending header+payload records, File_Write per part vs File_Writev\n");
+    fprintf(stderr, "  random [size] [reads]       random reads of a 4 MB file, File_Seek+File_Read vs File_PRead\n");
+    fprintf(stderr, "  threads [ops] [max]         mixed create/write/read/unlink from 1 to max (32) threads\n");
+    fprintf(stderr, "  fds [max] [pairs]           File_Open/File_Close cost with up to max descriptors already open on distinct files\n");
+    fprintf(stderr, "  qd [image] [reads]          random 4 KB reads of an image file at queue depth 1..64, io_uring vs threads\n");
+    fprintf(stderr, "  journal [ops] [max]         small metadata transactions each made durable from 1 to max threads, with and without a journal\n");
+    fprintf(stderr, "  writeback [writes] [ms] [%%]  4 KB write latency and unsaved sectors, no sync vs FS_Sync vs background writeback\n");
+    fprintf(stderr, "  readahead [delay]           4 MB file read in small chunks from a disk with delay us per request, with and without readahead\n");
+    fprintf(stderr, "  delalloc [threads] [delay]  1 MB files appended to by concurrent writers, then read back from a disk with delay us per request\n");
+    fprintf(stderr, "  model [threads] [KB]        delalloc appenders on modelled hdd and ssd disks: requests, seeks and simulated ms\n");
+    fprintf(stderr, "  suite [json|csv] [scale] [seed]  the fixed workloads of 'make bench': ops/s, p50/p99 and sector I/O per case\n");
+    fprintf(stderr, "  stats [ops] [threads] [json]  threads workload with FS_OPT_STATS 0, 1 and 16, per-call p50/p99; json names a file for FS_DumpStats\n");
+    exit(1);
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// boot a freshly formatted disk
+static void fresh_boot() {
+    unlink(disk_file);
+    if (FS_Boot(disk_file) < 0) {
+        fprintf(out, "ERROR: can't boot file system from file '%s'\n", disk_file);
+        exit(1);
+    }
+}
+
+// create /d0/d1/.../d<depth-1> and return the deepest path in 'path'
+static void make_tree(int depth, char *path) {
+    path[0] = '\0';
+    for (int i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        if (Dir_Create(path) < 0) {
+            fprintf(out, "ERROR: can't create directory '%s'\n", path);
+            exit(1);
+        }
+    }
+}
+
+static double open_deep_run(int depth, int opens, int dcache) {
+    char dir[256], path[300];
+    int files = 16;
+
+    FS_SetOption(FS_OPT_DCACHE, dcache);
+    fresh_boot();
+    make_tree(depth, dir);
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "%s/file%d", dir, i);
+        File_Create(path);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < opens; i++) {
+        sprintf(path, "%s/file%d", dir, i % files);
+        int fd = File_Open(path);
+        if (fd < 0) {
+            fprintf(out, "ERROR: can't open file '%s'\n", path);
+            exit(1);
+        }
+        File_Close(fd);
+    }
+    return (now_us() - start) / opens;
+}
+
+void open_deep(int argc, char *argv[]) {
+    int depth = argc > 0 ? atoi(argv[0]) : 8;
+    int opens = argc > 1 ? atoi(argv[1]) : 10000;
+
+    double with = open_deep_run(depth, opens, 1);
+    double without = open_deep_run(depth, opens, 0);
+    fprintf(out, "open-deep depth=%d opens=%d\n", depth, opens);
+    fprintf(out, "  dcache on : %8.2f us/open\n", with);
+    fprintf(out, "  dcache off: %8.2f us/open\n", without);
+}
+
+// write 'size' bytes of filler to a new file; returns File_Write's result
+static int write_file(char *path, int size) {
+    static char data[15 * 1024];
+    int fd, rc;
+
+    memset(data, 'x', sizeof(data));
+    if (File_Create(path) < 0 || (fd = File_Open(path)) < 0) {
+        return -1;
+    }
+    rc = File_Write(fd, data, size);
+    File_Close(fd);
+    return rc;
+}
+
+void alloc_full(int argc, char *argv[]) {
+    int rounds = argc > 0 ? atoi(argv[0]) : 2000;
+    int sectors = 29;               // sectors written per file
+    int size = sectors * 512;
+    char path[64];
+    int files = 0;
+
+    // fill the disk with 29-sector files until a write runs out of space
+    fresh_boot();
+    for (;;) {
+        sprintf(path, "/f%d", files);
+        if (write_file(path, size) != size) {
+            break;
+        }
+        files++;
+    }
+    File_Unlink(path);
+
+    // every round frees one file and allocates its sectors again, so the
+    // allocator always searches a disk with fewer than 2*29 free sectors
+    double start = now_us();
+    for (int i = 0; i < rounds; i++) {
+        sprintf(path, "/f%d", i % files);
+        File_Unlink(path);
+        if (write_file(path, size) != size) {
+            fprintf(out, "ERROR: can't rewrite file '%s'\n", path);
+            exit(1);
+        }
+    }
+    double elapsed = now_us() - start;
+
+    fprintf(out, "alloc-full files=%d rounds=%d\n", files, rounds);
+    fprintf(out, "  %10.0f sectors allocated/s (unlink + create + write of %d sectors per round)\n",
+            (double)rounds * sectors / elapsed * 1e6, sectors);
+}
+
+// write then read back a 'size'-byte file 'chunk' bytes per call, 'reps'
+// times over; throughputs in MB/s go to *write_mbs and *read_mbs
+static void seq_io_run(int size, int chunk, int reps, double *write_mbs, double *read_mbs) {
+    char *data = malloc(size);
+    double write_us = 0, read_us = 0;
+
+    if (data == NULL) {
+        fprintf(out, "ERROR: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < size; i++) {
+        data[i] = (char)i;
+    }
+
+    fresh_boot();
+    for (int r = 0; r < reps; r++) {
+        File_Unlink("/seq");
+        int fd;
+        if (File_Create("/seq") < 0 || (fd = File_Open("/seq")) < 0) {
+            fprintf(out, "ERROR: can't create file '/seq'\n");
+            exit(1);
+        }
+
+        double start = now_us();
+        for (int off = 0; off < size; off += chunk) {
+            int n = size - off < chunk ? size - off : chunk;
+            if (File_Write(fd, data + off, n) != n) {
+                fprintf(out, "ERROR: write failed at offset %d\n", off);
+                exit(1);
+            }
+        }
+        write_us += now_us() - start;
+
+        File_Seek(fd, 0);
+        start = now_us();
+        for (int off = 0; off < size; off += chunk) {
+            int n = size - off < chunk ? size - off : chunk;
+            if (File_Read(fd, data + off, n) != n) {
+                fprintf(out, "ERROR: read failed at offset %d\n", off);
+                exit(1);
+            }
+        }
+        read_us += now_us() - start;
+        File_Close(fd);
+    }
+    free(data);
+
+    *write_mbs = (double)size * reps / write_us;
+    *read_mbs = (double)size * reps / read_us;
+}
+
+void seq_io(int argc, char *argv[]) {
+    int chunk = argc > 0 ? atoi(argv[0]) : 4096;
+    int reps = argc > 1 ? atoi(argv[1]) : 20;
+    int sizes[] = {1 << 20, 4 << 20};
+
+    fprintf(out, "seq-io chunk=%d reps=%d\n", chunk, reps);
+    for (int i = 0; i < 2; i++) {
+        double w, r;
+        seq_io_run(sizes[i], chunk, reps, &w, &r);
+        fprintf(out, "  %d MB: write %8.1f MB/s  read %8.1f MB/s\n", sizes[i] >> 20, w, r);
+    }
+}
+
+// change 'bytes' bytes of a 4 MB file and FS_Sync, 'rounds' times;
+// returns the average microseconds per FS_Sync
+static double sync_run(int bytes, int rounds, int full, int fsync_on, Disk_Stats *st) {
+    static char data[4 << 20];
+    Disk_Stats before;
+
+    FS_SetOption(FS_OPT_FULL_SYNC, full);
+    FS_SetOption(FS_OPT_FSYNC, fsync_on);
+    fresh_boot();
+    int fd;
+    if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+        File_Write(fd, data, sizeof(data)) != sizeof(data) || FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't set up file '/data'\n");
+        exit(1);
+    }
+
+    srand(1);
+    Disk_GetStats(&before);
+    double elapsed = 0;
+    for (int i = 0; i < rounds; i++) {
+        File_Seek(fd, rand() % (sizeof(data) - bytes));
+        File_Write(fd, data, bytes);
+        double start = now_us();
+        if (FS_Sync() < 0) {
+            fprintf(out, "ERROR: FS_Sync failed\n");
+            exit(1);
+        }
+        elapsed += now_us() - start;
+    }
+    File_Close(fd);
+
+    Disk_GetStats(st);
+    st->sectors_saved -= before.sectors_saved;
+    st->save_writes -= before.save_writes;
+    return elapsed / rounds;
+}
+
+void sync_bench(int argc, char *argv[]) {
+    int bytes = argc > 0 ? atoi(argv[0]) : 100;
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+
+    fprintf(out, "sync bytes=%d rounds=%d\n", bytes, rounds);
+    for (int fsync_on = 0; fsync_on <= 1; fsync_on++) {
+        for (int full = 1; full >= 0; full--) {
+            Disk_Stats st;
+            double us = sync_run(bytes, rounds, full, fsync_on, &st);
+            fprintf(out, "  %-11s fsync %-3s: %10.1f us/sync  %8.1f sectors/sync  %6.1f writes/sync\n",
+                    full ? "full" : "incremental", fsync_on ? "on" : "off", us,
+                    (double)st.sectors_saved / rounds, (double)st.save_writes / rounds);
+        }
+    }
+    FS_SetOption(FS_OPT_FULL_SYNC, 0);
+    FS_SetOption(FS_OPT_FSYNC, 0);
+}
+
+// boot an existing image 'boots' times with 'backend', changing a few
+// bytes and syncing after each boot; average microseconds per call go
+// to *boot_us and *sync_us
+static void boot_run(int backend, int boots, double *boot_us, double *sync_us) {
+    char data[100];
+
+    FS_SetOption(FS_OPT_DISK_BACKEND, backend);
+    *boot_us = *sync_us = 0;
+    for (int i = 0; i < boots; i++) {
+        double start = now_us();
+        if (FS_Boot(disk_file) < 0) {
+            fprintf(out, "ERROR: can't boot file system from file '%s'\n", disk_file);
+            exit(1);
+        }
+        *boot_us += now_us() - start;
+
+        int fd = File_Open("/data");
+        File_Seek(fd, i * 4096);
+        File_Write(fd, data, sizeof(data));
+        File_Close(fd);
+        start = now_us();
+        FS_Sync();
+        *sync_us += now_us() - start;
+    }
+    *boot_us /= boots;
+    *sync_us /= boots;
+}
+
+void boot_bench(int argc, char *argv[]) {
+    static char data[4 << 20];
+    int boots = argc > 0 ? atoi(argv[0]) : 200;
+    char *names[] = {"memory", "mmap", "file"};
+    int fd;
+
+    // a 4 MB file on an otherwise empty disk
+    FS_SetOption(FS_OPT_DISK_BACKEND, FS_DISK_MEMORY);
+    fresh_boot();
+    if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+        File_Write(fd, data, sizeof(data)) != sizeof(data) || File_Close(fd) < 0 || FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't set up file '/data'\n");
+        exit(1);
+    }
+
+    fprintf(out, "boot boots=%d\n", boots);
+    for (int backend = FS_DISK_MEMORY; backend <= FS_DISK_FILE; backend++) {
+        double boot_us, sync_us;
+        boot_run(backend, boots, &boot_us, &sync_us);
+        fprintf(out, "  %-6s: %8.1f us/boot  %8.1f us/sync\n", names[backend], boot_us, sync_us);
+    }
+    FS_SetOption(FS_OPT_DISK_BACKEND, FS_DISK_MEMORY);
+}
+
+// word-at-a-time checksum standing in for whatever a reader does with
+// the data
+static unsigned long checksum(const char *p, size_t len) {
+    unsigned long sum = 0;
+    size_t i = 0;
+    for (; i + sizeof(long) <= len; i += sizeof(long)) {
+        unsigned long w;
+        memcpy(&w, p + i, sizeof(w));
+        sum += w;
+    }
+    for (; i < len; i++) {
+        sum += (unsigned char)p[i];
+    }
+    return sum;
+}
+
+// checksum a 4 MB file 'reps' times, 'chunk' bytes per call,
+// copying with File_Read or going through File_ReadView; returns MB/s
+static double view_run(int fd, int size, int chunk, int reps, int zero_copy, unsigned long *sum) {
+    char *buf = malloc(chunk);
+
+    if (buf == NULL) {
+        fprintf(out, "ERROR: out of memory\n");
+        exit(1);
+    }
+    *sum = 0;
+    double start = now_us();
+    for (int r = 0; r < reps; r++) {
+        File_Seek(fd, 0);
+        for (int off = 0; off < size; ) {
+            int n = size - off < chunk ? size - off : chunk;
+            if (zero_copy) {
+                File_View view;
+                if ((n = File_ReadView(fd, off, n, &view)) <= 0) {
+                    fprintf(out, "ERROR: read view failed at offset %d\n", off);
+                    exit(1);
+                }
+                for (int i = 0; i < view.count; i++) {
+                    *sum += checksum(view.iov[i].iov_base, view.iov[i].iov_len);
+                }
+                File_ReleaseView(&view);
+            } else {
+                if (File_Read(fd, buf, n) != n) {
+                    fprintf(out, "ERROR: read failed at offset %d\n", off);
+                    exit(1);
+                }
+                *sum += checksum(buf, n);
+            }
+            off += n;
+        }
+    }
+    double elapsed = now_us() - start;
+    free(buf);
+    return (double)size * reps / elapsed;
+}
+
+void view_bench(int argc, char *argv[]) {
+    static char data[4 << 20];
+    int chunk = argc > 0 ? atoi(argv[0]) : 65536;
+    int reps = argc > 1 ? atoi(argv[1]) : 50;
+    char *names[] = {"memory", "mmap", "file"};
+
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (char)(i * 7);
+    }
+
+    fprintf(out, "view chunk=%d reps=%d\n", chunk, reps);
+    for (int backend = FS_DISK_MEMORY; backend <= FS_DISK_FILE; backend++) {
+        int fd;
+        FS_SetOption(FS_OPT_DISK_BACKEND, backend);
+        fresh_boot();
+        if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+            File_Write(fd, data, sizeof(data)) != sizeof(data)) {
+            fprintf(out, "ERROR: can't set up file '/data'\n");
+            exit(1);
+        }
+
+        unsigned long copy_sum, view_sum;
+        double copy_mbs = view_run(fd, sizeof(data), chunk, reps, 0, &copy_sum);
+        double view_mbs = view_run(fd, sizeof(data), chunk, reps, 1, &view_sum);
+        fprintf(out, "  %-6s: File_Read %8.1f MB/s  File_ReadView %8.1f MB/s%s\n", names[backend],
+                copy_mbs, view_mbs, copy_sum == view_sum ? "" : "  (CHECKSUM MISMATCH)");
+        File_Close(fd);
+    }
+    FS_SetOption(FS_OPT_DISK_BACKEND, FS_DISK_MEMORY);
+}
+
+// append 'count' records of a 16-byte header and a 'payload'-byte body,
+// then read them back the same way; returns the records per second of
+// the writes and the reads
+static void records_run(int count, int payload, int vectored, double *write_rps, double *read_rps) {
+    char header[16], *body = malloc(payload);
+    struct iovec iov[2] = {{header, sizeof(header)}, {body, payload}};
+    int fd;
+
+    if (body == NULL) {
+        fprintf(out, "ERROR: out of memory\n");
+        exit(1);
+    }
+    memset(body, 'x', payload);
+    fresh_boot();
+    if (File_Create("/log") < 0 || (fd = File_Open("/log")) < 0) {
+        fprintf(out, "ERROR: can't create file '/log'\n");
+        exit(1);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < count; i++) {
+        snprintf(header, sizeof(header), "rec %011d", i);
+        int ok = vectored ? File_Writev(fd, iov, 2) == (int)sizeof(header) + payload
+                          : File_Write(fd, header, sizeof(header)) == sizeof(header) &&
+                            File_Write(fd, body, payload) == payload;
+        if (!ok) {
+            fprintf(out, "ERROR: write of record %d failed\n", i);
+            exit(1);
+        }
+    }
+    *write_rps = count / (now_us() - start) * 1e6;
+
+    File_Seek(fd, 0);
+    start = now_us();
+    for (int i = 0; i < count; i++) {
+        int ok = vectored ? File_Readv(fd, iov, 2) == (int)sizeof(header) + payload
+                          : File_Read(fd, header, sizeof(header)) == sizeof(header) &&
+                            File_Read(fd, body, payload) == payload;
+        if (!ok) {
+            fprintf(out, "ERROR: read of record %d failed\n", i);
+            exit(1);
+        }
+    }
+    *read_rps = count / (now_us() - start) * 1e6;
+    File_Close(fd);
+    free(body);
+}
+
+void records(int argc, char *argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 10000;
+    int payload = argc > 1 ? atoi(argv[1]) : 200;
+
+    fprintf(out, "records count=%d payload=%d\n", count, payload);
+    for (int vectored = 0; vectored <= 1; vectored++) {
+        double w, r;
+        records_run(count, payload, vectored, &w, &r);
+        fprintf(out, "  %-11s: write %10.0f records/s  read %10.0f records/s\n",
+                vectored ? "File_Writev" : "File_Write", w, r);
+    }
+}
+
+// 'reads' reads of 'size' bytes at random offsets of a 4 MB file, with
+// File_Seek + File_Read or File_PRead; returns reads per second
+static double random_run(int fd, int file_size, int size, int reads, int positional) {
+    char *buf = malloc(size);
+
+    if (buf == NULL) {
+        fprintf(out, "ERROR: out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    double start = now_us();
+    for (int i = 0; i < reads; i++) {
+        int off = rand() % (file_size - size + 1);
+        int n = positional ? File_PRead(fd, buf, size, off)
+                           : (File_Seek(fd, off) < 0 ? -1 : File_Read(fd, buf, size));
+        if (n != size) {
+            fprintf(out, "ERROR: read failed at offset %d\n", off);
+            exit(1);
+        }
+    }
+    double elapsed = now_us() - start;
+    free(buf);
+    return reads / elapsed * 1e6;
+}
+
+void random_bench(int argc, char *argv[]) {
+    static char data[4 << 20];
+    int size = argc > 0 ? atoi(argv[0]) : 4096;
+    int reads = argc > 1 ? atoi(argv[1]) : 100000;
+    int fd;
+
+    fresh_boot();
+    if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+        File_Write(fd, data, sizeof(data)) != sizeof(data)) {
+        fprintf(out, "ERROR: can't set up file '/data'\n");
+        exit(1);
+    }
+
+    fprintf(out, "random size=%d reads=%d\n", size, reads);
+    fprintf(out, "  File_Seek+File_Read: %10.0f reads/s\n", random_run(fd, sizeof(data), size, reads, 0));
+    fprintf(out, "  File_PRead         : %10.0f reads/s\n", random_run(fd, sizeof(data), size, reads, 1));
+    File_Close(fd);
+}
+
+typedef struct stress_arg {
+    int id;
+    int ops;
+    int errors;
+} stress_arg_t;
+
+// 'ops' rounds over 8 files, half in the thread's own directory and half
+// in one shared by every thread: even passes create and write a file,
+// odd ones read it back and unlink it. Each round is 4 LibFS calls
+static void *stress_thread(void *p) {
+    stress_arg_t *arg = p;
+    char path[64], buf[2048], expect[2048];
+
+    for (int i = 0; i < arg->ops; i++) {
+        int slot = i % 8, fd;
+        if (slot < 4) {
+            snprintf(path, sizeof(path), "/d%d/f%d", arg->id, slot);
+        } else {
+            snprintf(path, sizeof(path), "/shared/t%ds%d", arg->id, slot);
+        }
+        memset(expect, 'a' + (arg->id + slot) % 26, sizeof(expect));
+        if ((i / 8) % 2 == 0) {
+            if (File_Create(path) < 0 || (fd = File_Open(path)) < 0) {
+                arg->errors++;
+                continue;
+            }
+            if (File_Write(fd, expect, sizeof(expect)) != sizeof(expect)) {
+                arg->errors++;
+            }
+            File_Close(fd);
+        } else {
+            if ((fd = File_Open(path)) < 0) {
+                arg->errors++;
+                continue;
+            }
+            if (File_PRead(fd, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, expect, sizeof(buf)) != 0) {
+                arg->errors++;
+            }
+            File_Close(fd);
+            if (File_Unlink(path) < 0) {
+                arg->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// run the stress workload on 'threads' threads; returns LibFS calls per
+// second and adds the failed checks to *errors
+static double stress_run(int threads, int ops, int *errors) {
+    pthread_t tid[32];
+    stress_arg_t args[32];
+    char path[64];
+
+    fresh_boot();
+    Dir_Create("/shared");
+    for (int t = 0; t < threads; t++) {
+        snprintf(path, sizeof(path), "/d%d", t);
+        Dir_Create(path);
+        args[t].id = t;
+        args[t].ops = ops;
+        args[t].errors = 0;
+    }
+
+    double start = now_us();
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&tid[t], NULL, stress_thread, &args[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tid[t], NULL);
+        *errors += args[t].errors;
+    }
+    double elapsed = now_us() - start;
+
+    // every file made was unlinked again
+    if (Dir_Size("/shared") != 0) {
+        (*errors)++;
+    }
+    return 4.0 * ops * threads / elapsed * 1e6;
+}
+
+void threads_bench(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 4000;
+    int max = argc > 1 ? atoi(argv[1]) : 32;
+    double base = 0;
+
+    if (max > 32) {
+        max = 32;
+    }
+    if (ops < 16) {
+        fprintf(out, "ERROR: threads needs at least 16 ops per thread, got %d\n", ops);
+        exit(1);
+    }
+    ops -= ops % 16; // whole create/unlink cycles
+    fprintf(out, "threads ops=%d per thread, %ld cpus\n", ops, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int threads = 1; threads <= max; threads *= 2) {
+        int errors = 0;
+        double rate = stress_run(threads, ops, &errors);
+        if (threads == 1) {
+            base = rate;
+        }
+        fprintf(out, "  %2d threads: %10.0f ops/s  x%5.2f%s\n", threads, rate, rate / base,
+                errors ? "  (ERRORS)" : "");
+    }
+}
+
+// hold 'held' descriptors open on files of their own (/f0, /f1, ...),
+// then time 'pairs' File_Open/File_Close of the 64 files after them
+// ('max' on); returns microseconds per pair
+static double fds_run(int held, int max, int pairs) {
+    static int fds[1 << 20];
+    char path[32];
+
+    for (int i = 0; i < held; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        if ((fds[i] = File_Open(path)) < 0) {
+            fprintf(out, "ERROR: can't open descriptor %d\n", i);
+            exit(1);
+        }
+    }
+
+    double start = now_us();
+    for (int i = 0; i < pairs; i++) {
+        snprintf(path, sizeof(path), "/f%d", max + i % 64);
+        int fd = File_Open(path);
+        if (fd < 0 || File_Close(fd) < 0) {
+            fprintf(out, "ERROR: open/close failed with %d descriptors open\n", held);
+            exit(1);
+        }
+    }
+    double elapsed = now_us() - start;
+
+    for (int i = 0; i < held; i++) {
+        File_Close(fds[i]);
+    }
+    return elapsed / pairs;
+}
+
+void fds_bench(int argc, char *argv[]) {
+    int max = argc > 0 ? atoi(argv[0]) : 100000;
+    int pairs = argc > 1 ? atoi(argv[1]) : 100000;
+    char path[32];
+
+    if (max > (1 << 20) - 1) {
+        max = (1 << 20) - 1;
+    }
+    // every descriptor held has a file and so an in-core inode of its own
+    FS_SetOption(FS_OPT_INODES, max + 65);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS + max + 65);
+    fresh_boot();
+    for (int i = 0; i < max + 64; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        if (File_Create(path) < 0) {
+            fprintf(out, "ERROR: can't create '%s'\n", path);
+            exit(1);
+        }
+    }
+
+    fprintf(out, "fds pairs=%d, each descriptor held on a file of its own\n", pairs);
+    for (int held = 0; held <= max; held = held ? held * 10 : 10) {
+        fprintf(out, "  %7d open: %6.2f us/open+close\n", held, fds_run(held, max, pairs));
+    }
+    FS_SetOption(FS_OPT_INODES, 1000);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS);
+}
+
+// 'reads' random 4 KB reads of the file 'fd' ('blocks' blocks long)
+// with 'depth' of them in flight; returns reads per second and the mean
+// latency of one read
+static double qd_run(int fd, long blocks, int engine, int depth, int reads, char *buffers, double *lat_us) {
+    static Aio_Request reqs[64];
+    static double started[64];
+    Aio_Request *done[64];
+    int free_slots[64], nfree = depth; // requests not in flight
+    unsigned long long seed = 42; // same offsets for every run
+    int submitted = 0, completed = 0;
+    double total_lat = 0;
+
+    for (int i = 0; i < depth; i++) {
+        free_slots[i] = i;
+    }
+    if (Aio_Open(fd, engine, depth) != engine) {
+        Aio_Close();
+        return -1;
+    }
+    double start = now_us();
+    while (completed < reads) {
+        // keep the queue full
+        while (nfree > 0 && submitted < reads) {
+            int slot = free_slots[--nfree];
+            Aio_Request *req = &reqs[slot];
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            req->write = 0;
+            req->offset = (off_t)((seed >> 33) % blocks) * 4096;
+            req->len = 4096;
+            req->buffer = buffers + slot * 4096;
+            started[slot] = now_us();
+            if (Aio_Submit(req) < 0) {
+                fprintf(out, "ERROR: can't submit a read\n");
+                exit(1);
+            }
+            submitted++;
+        }
+        int n = Aio_Reap(done, 64, 1);
+        if (n < 0) {
+            fprintf(out, "ERROR: reaping reads failed\n");
+            exit(1);
+        }
+        double now = now_us();
+        for (int i = 0; i < n; i++) {
+            if (done[i]->result != 4096) {
+                fprintf(out, "ERROR: read returned %ld\n", (long)done[i]->result);
+                exit(1);
+            }
+            total_lat += now - started[done[i] - reqs];
+            free_slots[nfree++] = done[i] - reqs;
+        }
+        completed += n;
+    }
+    double elapsed = now_us() - start;
+    Aio_Close();
+    *lat_us = total_lat / reads;
+    return reads / (elapsed / 1e6);
+}
+
+void qd_bench(int argc, char *argv[]) {
+    char *image = argc > 0 ? argv[0] : "bench_qd";
+    int reads = argc > 1 ? atoi(argv[1]) : 20000;
+    char *names[] = {"", "io_uring", "threads"};
+    char *buffers;
+    int fd, direct = 1;
+
+    if (posix_memalign((void **)&buffers, 4096, 64 * 4096) != 0) {
+        fprintf(out, "ERROR: out of memory\n");
+        exit(1);
+    }
+    // a 64 MB image unless the one named already exists
+    if (access(image, F_OK) != 0) {
+        memset(buffers, 0x5a, 64 * 4096);
+        if ((fd = open(image, O_WRONLY | O_CREAT, 0644)) < 0) {
+            fprintf(out, "ERROR: can't create '%s'\n", image);
+            exit(1);
+        }
+        for (int i = 0; i < 256; i++) {
+            if (write(fd, buffers, 64 * 4096) != 64 * 4096) {
+                fprintf(out, "ERROR: can't write '%s'\n", image);
+                exit(1);
+            }
+        }
+        fsync(fd);
+        close(fd);
+    }
+    // bypass the page cache where the file system allows it
+    if ((fd = open(image, O_RDONLY | O_DIRECT)) < 0) {
+        direct = 0;
+        fd = open(image, O_RDONLY);
+    }
+    long blocks = fd < 0 ? 0 : lseek(fd, 0, SEEK_END) / 4096;
+    if (blocks <= 0) {
+        fprintf(out, "ERROR: can't read '%s'\n", image);
+        exit(1);
+    }
+
+    fprintf(out, "qd image=%s (%ld MB, %s) reads=%d\n", image, blocks / 256,
+            direct ? "O_DIRECT" : "page cache", reads);
+    for (int engine = AIO_URING; engine <= AIO_THREADS; engine++) {
+        for (int depth = 1; depth <= 64; depth *= 2) {
+            double lat_us;
+            double iops = qd_run(fd, blocks, engine, depth, reads, buffers, &lat_us);
+            if (iops < 0) {
+                fprintf(out, "  %-8s: not available\n", names[engine]);
+                break;
+            }
+            fprintf(out, "  %-8s qd %2d: %9.0f reads/s  %7.1f MB/s  %7.1f us/read\n",
+                    names[engine], depth, iops, iops * 4096 / 1e6, lat_us);
+        }
+    }
+    close(fd);
+    free(buffers);
+}
+
+typedef struct journal_worker {
+    int id, ops;
+    double elapsed;
+} journal_worker_t;
+
+// 'ops' metadata transactions (create a small file, then unlink the one
+// created 16 transactions earlier), each followed by FS_Sync
+static void *journal_thread(void *p) {
+    journal_worker_t *w = p;
+    char data[200], path[32];
+    int keep = 16;
+
+    for (int i = 0; i < w->ops; i++) {
+        snprintf(path, sizeof(path), "/t%dx%d", w->id, i);
+        int fd;
+        if (File_Create(path) < 0 || (fd = File_Open(path)) < 0 ||
+            File_Write(fd, data, sizeof(data)) != sizeof(data) || File_Close(fd) < 0) {
+            fprintf(out, "ERROR: can't create file '%s'\n", path);
+            exit(1);
+        }
+        if (i >= keep) {
+            snprintf(path, sizeof(path), "/t%dx%d", w->id, i - keep);
+            File_Unlink(path);
+        }
+        double start = now_us();
+        if (FS_Sync() < 0) {
+            fprintf(out, "ERROR: FS_Sync failed\n");
+            exit(1);
+        }
+        w->elapsed += now_us() - start;
+    }
+    return NULL;
+}
+
+// 'ops' transactions spread over 'threads' threads with a journal of
+// 'journal_sectors' (0 for none); returns the average microseconds per
+// FS_Sync and the cost of booting the image afterwards without a final
+// checkpoint
+static double journal_run(int journal_sectors, int threads, int ops, Disk_Stats *st, double *boot_us) {
+    journal_worker_t w[threads];
+    pthread_t tid[threads];
+    Disk_Stats before;
+
+    FS_SetOption(FS_OPT_JOURNAL_SECTORS, journal_sectors);
+    FS_SetOption(FS_OPT_CHECKPOINT_MS, 0);
+    FS_SetOption(FS_OPT_FSYNC, 1);
+    fresh_boot();
+
+    Disk_GetStats(&before);
+    double elapsed = 0;
+    for (int i = 0; i < threads; i++) {
+        w[i].id = i;
+        w[i].ops = ops / threads;
+        w[i].elapsed = 0;
+        pthread_create(&tid[i], NULL, journal_thread, &w[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+        elapsed += w[i].elapsed;
+    }
+    ops = ops / threads * threads;
+    Disk_GetStats(st);
+    st->sectors_saved -= before.sectors_saved;
+    st->save_writes -= before.save_writes;
+
+    // "crash": boot again without checkpointing what is in the log, and
+    // check that the last file made durable is there
+    char path[32];
+    snprintf(path, sizeof(path), "/t0x%d", w[0].ops - 1);
+    double start = now_us();
+    if (FS_Boot(disk_file) < 0 || File_Open(path) < 0) {
+        fprintf(out, "ERROR: recovery lost file '%s'\n", path);
+        exit(1);
+    }
+    *boot_us = now_us() - start;
+    return elapsed / ops;
+}
+
+void journal_bench(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 512;
+    int max = argc > 1 ? atoi(argv[1]) : 8;
+    int sizes[] = {0, 64, 1024};
+
+    fprintf(out, "journal ops=%d\n", ops);
+    for (int threads = 1; threads <= max; threads *= 2) {
+        for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            Disk_Stats st;
+            double boot_us;
+            double us = journal_run(sizes[i], threads, ops, &st, &boot_us);
+            fprintf(out, "  %2d threads, journal %4d: %8.1f us/sync  %6.1f sectors/sync  %5.2f writes/sync  %8.1f us boot\n",
+                    threads, sizes[i], us, (double)st.sectors_saved / ops, (double)st.save_writes / ops, boot_us);
+        }
+    }
+    FS_SetOption(FS_OPT_JOURNAL_SECTORS, 0);
+    FS_SetOption(FS_OPT_CHECKPOINT_MS, 1000);
+    FS_SetOption(FS_OPT_FSYNC, 0);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 'writes' random 4 KB File_PWrite calls into a 4 MB file with fsync on,
+// one every 'gap' microseconds.
+// mode 0 leaves the image alone, mode 1 calls FS_Sync every 'every'
+// writes, mode 2 has the background thread flush every 'ms' or once
+// 'pct' percent of the disk is unsaved. Write latencies (FS_Sync time
+// included) go to 'lat', sorted; returns the most sectors the image
+// lacked after any write
+static long writeback_run(int mode, int writes, int gap, int every, int ms, int pct, double *lat) {
+    static char data[4 << 20];
+    char block[4096];
+    int fd;
+
+    FS_SetOption(FS_OPT_FSYNC, 1);
+    fresh_boot();
+    if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+        File_Write(fd, data, sizeof(data)) != sizeof(data) || FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't set up file '/data'\n");
+        exit(1);
+    }
+    if (mode == 2) {
+        FS_SetOption(FS_OPT_WRITEBACK_MS, ms);
+        FS_SetOption(FS_OPT_WRITEBACK_DIRTY, pct);
+    }
+
+    srand(1);
+    long lag = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < writes; i++) {
+        int offset = rand() % (sizeof(data) / sizeof(block)) * sizeof(block);
+        next.tv_nsec += gap * 1000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        double start = now_us();
+        if (File_PWrite(fd, block, sizeof(block), offset) != sizeof(block) ||
+            (mode == 1 && (i + 1) % every == 0 && FS_Sync() < 0)) {
+            fprintf(out, "ERROR: write failed\n");
+            exit(1);
+        }
+        lat[i] = now_us() - start;
+        long unsaved = Cache_Unsaved();
+        if (unsaved > lag) {
+            lag = unsaved;
+        }
+    }
+    File_Close(fd);
+    FS_SetOption(FS_OPT_WRITEBACK_MS, 0);
+    FS_SetOption(FS_OPT_WRITEBACK_DIRTY, 0);
+    FS_SetOption(FS_OPT_FSYNC, 0);
+    qsort(lat, writes, sizeof(double), cmp_double);
+    return lag;
+}
+
+void writeback_bench(int argc, char *argv[]) {
+    int writes = argc > 0 ? atoi(argv[0]) : 20000;
+    int ms = argc > 1 ? atoi(argv[1]) : 50;
+    int pct = argc > 2 ? atoi(argv[2]) : 5;
+    int gap = 50;
+    int every = 256;
+    char *names[] = {"no sync", "FS_Sync", "background"};
+    double *lat = malloc(writes * sizeof(double));
+
+    fprintf(out, "writeback writes=%d (one per %d us) FS_Sync every %d writes, background every %d ms or at %d%% unsaved\n",
+            writes, gap, every, ms, pct);
+    for (int mode = 0; mode <= 2; mode++) {
+        long lag = writeback_run(mode, writes, gap, every, ms, pct, lat);
+        fprintf(out, "  %-10s: p50 %6.1f us  p99 %7.1f us  p99.9 %8.1f us  max %8.1f us  at most %5ld sectors unsaved\n",
+                names[mode], lat[writes / 2], lat[writes * 99 / 100], lat[writes * 999 / 1000], lat[writes - 1], lag);
+        if (mode == 2) {
+            FS_Writeback_Stats st;
+            FS_GetWritebackStats(&st);
+            fprintf(out, "  %-10s  %ld flushes (%ld timed, %ld at the threshold), %.1f us avg, %ld us max\n", "",
+                    st.flushes, st.timed, st.triggered, st.flushes ? (double)st.total_us / st.flushes : 0.0, st.max_us);
+        }
+    }
+    free(lat);
+}
+
+// read the 4 MB file '/data' in 'chunk' byte File_Read calls, in order
+// or (with 'random') at random chunk-aligned offsets, from a cold cache
+// on a disk that takes 'delay' microseconds per request, with readahead
+// windows of up to 'window' sectors; returns MB/s
+static double readahead_run(int window, int delay, int chunk, int random, Cache_Stats *st) {
+    static char buffer[1 << 16];
+    int size = 4 << 20;
+
+    FS_SetOption(FS_OPT_READAHEAD, window);
+    Disk_SetDelay(0);
+    if (FS_Boot(disk_file) < 0) {
+        fprintf(out, "ERROR: can't boot file system from file '%s'\n", disk_file);
+        exit(1);
+    }
+    int fd = File_Open("/data");
+    Disk_SetDelay(delay);
+
+    srand(1);
+    double start = now_us();
+    for (int done = 0; done < size; done += chunk) {
+        if (random) {
+            File_Seek(fd, rand() % (size / chunk) * chunk);
+        }
+        if (File_Read(fd, buffer, chunk) != chunk) {
+            fprintf(out, "ERROR: read failed\n");
+            exit(1);
+        }
+    }
+    double elapsed = now_us() - start;
+    Disk_SetDelay(0);
+    File_Close(fd);
+    Cache_GetStats(st);
+    return size / elapsed;
+}
+
+void readahead_bench(int argc, char *argv[]) {
+    static char data[4 << 20];
+    int delay = argc > 0 ? atoi(argv[0]) : 100;
+    int chunks[] = {512, 4096, 16384};
+    int fd;
+
+    fresh_boot();
+    if (File_Create("/data") < 0 || (fd = File_Open("/data")) < 0 ||
+        File_Write(fd, data, sizeof(data)) != sizeof(data) || File_Close(fd) < 0 || FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't set up file '/data'\n");
+        exit(1);
+    }
+
+    fprintf(out, "readahead delay=%d us per disk request\n", delay);
+    for (int random = 0; random <= 1; random++) {
+        for (int i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+            Cache_Stats off, on;
+            double off_mbs = readahead_run(0, delay, chunks[i], random, &off);
+            double on_mbs = readahead_run(64, delay, chunks[i], random, &on);
+            fprintf(out, "  %-10s %5d B reads: %8.2f MB/s without, %8.2f MB/s with readahead"
+                    "  (%ld sectors prefetched, %ld hit, %ld unused)\n",
+                    random ? "random" : "sequential", chunks[i], off_mbs, on_mbs,
+                    on.prefetched, on.prefetch_hits, on.prefetch_unused);
+        }
+    }
+    FS_SetOption(FS_OPT_READAHEAD, -1);
+}
+
+typedef struct append_worker {
+    int id, size;
+} append_worker_t;
+
+// append to '/a<id>' in records of 100 to 1000 bytes until it holds
+// 'size' bytes, yielding after each one so that the writers take turns
+// even on a single CPU
+static void *append_thread(void *p) {
+    append_worker_t *w = p;
+    static char data[1000];
+    char path[32];
+    int fd;
+
+    snprintf(path, sizeof(path), "/a%d", w->id);
+    if (File_Create(path) < 0 || (fd = File_Open(path)) < 0) {
+        fprintf(out, "ERROR: can't create file '%s'\n", path);
+        exit(1);
+    }
+    for (int done = 0, i = 0; done < w->size; i++) {
+        int n = 100 + (i * 397 + w->id * 131) % 901;
+        if (n > w->size - done) {
+            n = w->size - done;
+        }
+        if (File_Write(fd, data, n) != n) {
+            fprintf(out, "ERROR: append to '%s' failed\n", path);
+            exit(1);
+        }
+        done += n;
+        sched_yield();
+    }
+    if (File_Close(fd) < 0) {
+        fprintf(out, "ERROR: can't close '%s'\n", path);
+        exit(1);
+    }
+    return NULL;
+}
+
+// 'threads' writers append a 'size' byte file each, taking turns
+static void append_files(int threads, int size) {
+    append_worker_t w[threads];
+    pthread_t tid[threads];
+
+    for (int i = 0; i < threads; i++) {
+        w[i].id = i;
+        w[i].size = size;
+        pthread_create(&tid[i], NULL, append_thread, &w[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+// read back every file append_files() made, in 64 KB calls
+static void read_appended(int threads, int size) {
+    static char buffer[1 << 16];
+
+    for (int i = 0; i < threads; i++) {
+        char path[32];
+        int fd, n, done = 0;
+        snprintf(path, sizeof(path), "/a%d", i);
+        if ((fd = File_Open(path)) < 0) {
+            fprintf(out, "ERROR: can't open '%s'\n", path);
+            exit(1);
+        }
+        while ((n = File_Read(fd, buffer, sizeof(buffer))) > 0) {
+            done += n;
+        }
+        if (done != size) {
+            fprintf(out, "ERROR: read %d of %d bytes of '%s'\n", done, size, path);
+            exit(1);
+        }
+        File_Close(fd);
+    }
+}
+
+// 'threads' writers each append a 'size' byte file with delayed
+// allocation of up to 'delalloc' blocks (0 for none), then every file is
+// read in 64 KB calls from a cold cache on a disk that takes 'delay'
+// microseconds per request; sets the append and read MB/s
+static void delalloc_run(int delalloc, int threads, int size, int delay, double *append_mbs, double *read_mbs,
+                         FS_Frag_Stats *st) {
+    FS_SetOption(FS_OPT_DELALLOC, delalloc);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS + threads * (size / SECTOR_SIZE));
+    fresh_boot();
+    double start = now_us();
+    append_files(threads, size);
+    *append_mbs = (double)threads * size / (now_us() - start);
+    if (FS_Sync() < 0 || FS_GetFragmentation(st) < 0 || FS_Boot(disk_file) < 0) {
+        fprintf(out, "ERROR: can't sync and boot '%s' again\n", disk_file);
+        exit(1);
+    }
+
+    Disk_SetDelay(delay);
+    start = now_us();
+    read_appended(threads, size);
+    *read_mbs = (double)threads * size / (now_us() - start);
+    Disk_SetDelay(0);
+}
+
+void delalloc_bench(int argc, char *argv[]) {
+    int threads = argc > 0 ? atoi(argv[0]) : 8;
+    int delay = argc > 1 ? atoi(argv[1]) : 100;
+    int size = 1 << 20;
+    int limits[] = {0, 16, 128};
+
+    fprintf(out, "delalloc %d writers, %d KB each, delay=%d us per disk request\n", threads, size >> 10, delay);
+    for (int i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        FS_Frag_Stats st;
+        double append_mbs, read_mbs;
+        delalloc_run(limits[i], threads, size, delay, &append_mbs, &read_mbs, &st);
+        fprintf(out, "  delayed blocks %3d: append %8.2f MB/s  %7.1f extents/file (max %ld)  read %8.2f MB/s\n",
+                limits[i], append_mbs, (double)st.extents / st.files, st.max_extents, read_mbs);
+    }
+    FS_SetOption(FS_OPT_DELALLOC, 128);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS);
+}
+
+void stats_bench(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 4000;
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    char *json = argc > 2 ? argv[2] : NULL;
+    int every[] = {0, 1, 16};
+    double rate[3] = {0, 0, 0};
+    int errors = 0;
+    FS_Stats st;
+
+    if (threads > 32) {
+        threads = 32;
+    }
+    ops -= ops % 16;
+    fprintf(out, "stats ops=%d per thread, %d threads\n", ops, threads);
+    // alternate so that every setting sees the same disk and cache noise,
+    // keeping the best rate; the calls reported are those of the last run
+    // that timed all of them
+    for (int rep = 0; rep < 9; rep++) {
+        int i = rep % 3;
+        FS_SetOption(FS_OPT_STATS, every[i]);
+        FS_ResetStats();
+        double r = stress_run(threads, ops, &errors);
+        if (r > rate[i]) {
+            rate[i] = r;
+        }
+        if (every[i] == 1) {
+            FS_GetStats(&st);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        fprintf(out, "  FS_OPT_STATS %2d: %10.0f ops/s  overhead %6.2f%%%s\n", every[i], rate[i],
+                (rate[0] / rate[i] - 1) * 100, errors ? "  (ERRORS)" : "");
+    }
+    fprintf(out, "  %-14s %8s %7s %10s %10s %10s\n", "call", "calls", "errors", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        FS_Op_Stats *s = &st.ops[op];
+        if (s->calls == 0) {
+            continue;
+        }
+        fprintf(out, "  %-14s %8ld %7ld %10.2f %10.2f %10.2f\n", FS_OpName(op), s->calls, s->errors,
+                FS_HistPercentile(&s->latency, 50) / 1e3, FS_HistPercentile(&s->latency, 99) / 1e3,
+                s->latency.max_ns / 1e3);
+    }
+    long lookups = st.cache_hits + st.cache_misses;
+    fprintf(out, "  cache hit rate %.2f%% of %ld lookups, disk %ld reads (%ld sectors) %ld writes (%ld sectors)\n",
+            lookups ? 100.0 * st.cache_hits / lookups : 0.0, lookups, st.disk_reads, st.disk_sectors_read,
+            st.disk_writes, st.disk_sectors_written);
+    FS_SetOption(FS_OPT_STATS, 16);
+    if (json != NULL) {
+        FILE *f = fopen(json, "w");
+        if (f == NULL || FS_DumpStats(f) < 0 || fclose(f) != 0) {
+            fprintf(out, "ERROR: can't write '%s'\n", json);
+            exit(1);
+        }
+    }
+}
+
+// the appenders of the delalloc workload on a disk costed by 'model',
+// with delayed allocation of up to 'delalloc' blocks; sets the disk's
+// counters for the appends (with the FS_Sync() that ends them) and for
+// reading the files back from a cold cache
+static void model_run(Disk_Model *model, int delalloc, int threads, int size, Disk_Stats *write, Disk_Stats *read) {
+    Disk_Stats before;
+
+    FS_SetOption(FS_OPT_DELALLOC, delalloc);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS + threads * (size / SECTOR_SIZE));
+    fresh_boot();
+    Disk_SetModel(model);
+    Disk_GetStats(&before);
+    append_files(threads, size);
+    if (FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't sync '%s'\n", disk_file);
+        exit(1);
+    }
+    Disk_GetStats(write);
+    write->reads -= before.reads;
+    write->writes -= before.writes;
+    write->seeks -= before.seeks;
+    write->model_ns -= before.model_ns;
+
+    Disk_SetModel(NULL);
+    if (FS_Boot(disk_file) < 0) {
+        fprintf(out, "ERROR: can't boot '%s' again\n", disk_file);
+        exit(1);
+    }
+    Disk_SetModel(model);
+    Disk_GetStats(&before);
+    read_appended(threads, size);
+    Disk_GetStats(read);
+    read->reads -= before.reads;
+    read->writes -= before.writes;
+    read->seeks -= before.seeks;
+    read->model_ns -= before.model_ns;
+    Disk_SetModel(NULL);
+}
+
+void model_bench(int argc, char *argv[]) {
+    int threads = argc > 0 ? atoi(argv[0]) : 8;
+    int size = (argc > 1 ? atoi(argv[1]) : 1024) << 10;
+    int types[] = {DISK_MODEL_HDD, DISK_MODEL_SSD};
+    char *names[] = {"hdd", "ssd"};
+    int limits[] = {0, 128};
+
+    fprintf(out, "model %d writers, %d KB each, simulated time of the appends + FS_Sync and of a cold read\n", threads,
+            size >> 10);
+    for (int m = 0; m < 2; m++) {
+        Disk_Model model;
+        Disk_ModelDefaults(types[m], &model);
+        for (int i = 0; i < 2; i++) {
+            Disk_Stats write, read;
+            model_run(&model, limits[i], threads, size, &write, &read);
+            fprintf(out, "  %s delayed blocks %3d: write %6ld requests %6ld seeks %9.1f ms  "
+                    "read %6ld requests %6ld seeks %9.1f ms\n", names[m], limits[i],
+                    write.reads + write.writes, write.seeks, write.model_ns / 1e6,
+                    read.reads + read.writes, read.seeks, read.model_ns / 1e6);
+        }
+    }
+    FS_SetOption(FS_OPT_DELALLOC, 128);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS);
+}
+
+// the suite: a fixed list of workloads, each on a fresh disk with the
+// same options and a seeded generator, so that two builds make the same
+// calls on the same layout and their rows can be compared one by one.
+// A row is about one kind of call: how many were made and failed, their
+// rate over the wall time of the loop and p50/p99/max from FS_GetStats().
+// The disk counters also include the FS_Sync() that ends the rows that
+// write, which the time does not
+#define SUITE_ROWS 32
+#define SUITE_DISK_SECTORS 32768    // 16 MB, room for the 4 MB files and the full image
+#define SUITE_FILE_SIZE (4 << 20)
+
+typedef struct {
+    const char *name;
+    int param;          // bytes per call for I/O, depth for trees, entries for listings, files on full images
+    long ops, errors;
+    double seconds;
+    long p50_ns, p99_ns, max_ns;
+    long disk_reads, disk_writes, sectors_read, sectors_written, seeks;
+    long cache_hits, cache_misses;
+} suite_row_t;
+
+static suite_row_t suite_rows[SUITE_ROWS];
+static int suite_nrows;
+static unsigned long suite_seed, suite_state;
+static char suite_data[1 << 20];
+
+// xorshift64: the same sequence everywhere, unlike rand()
+static unsigned suite_rand() {
+    suite_state ^= suite_state << 13;
+    suite_state ^= suite_state >> 7;
+    suite_state ^= suite_state << 17;
+    return suite_state >> 32;
+}
+
+// a formatted disk of the suite's size with room for 'inodes' files and
+// the generator back at the seed, so no case depends on the ones before
+static void suite_boot(int inodes) {
+    FS_SetOption(FS_OPT_DISK_SECTORS, SUITE_DISK_SECTORS);
+    FS_SetOption(FS_OPT_INODES, inodes);
+    fresh_boot();
+    suite_state = suite_seed;
+}
+
+// the FS_Boot() of the same image that the reading rows start with, so
+// they find the cache cold
+static void suite_reboot() {
+    if (FS_Boot(disk_file) < 0) {
+        fprintf(out, "ERROR: can't boot '%s' again\n", disk_file);
+        exit(1);
+    }
+}
+
+static void suite_sync() {
+    if (FS_Sync() < 0) {
+        fprintf(out, "ERROR: can't sync '%s'\n", disk_file);
+        exit(1);
+    }
+}
+
+// clears the counters and returns when the timed loop starts
+static double suite_start() {
+    FS_ResetStats();
+    return now_us();
+}
+
+// adds the row of the 'op' calls made since suite_start(), which took 'us'
+static void suite_row(const char *name, int param, FS_Op_t op, double us) {
+    suite_row_t *r = &suite_rows[suite_nrows++];
+    FS_Stats st;
+
+    FS_GetStats(&st);
+    r->name = name;
+    r->param = param;
+    r->ops = st.ops[op].calls;
+    r->errors = st.ops[op].errors;
+    r->seconds = us / 1e6;
+    r->p50_ns = FS_HistPercentile(&st.ops[op].latency, 50);
+    r->p99_ns = FS_HistPercentile(&st.ops[op].latency, 99);
+    r->max_ns = st.ops[op].latency.max_ns;
+    r->disk_reads = st.disk_reads;
+    r->disk_writes = st.disk_writes;
+    r->sectors_read = st.disk_sectors_read;
+    r->sectors_written = st.disk_sectors_written;
+    r->seeks = st.disk_seeks;
+    r->cache_hits = st.cache_hits;
+    r->cache_misses = st.cache_misses;
+}
+
+static int open_or_die(char *path) {
+    int fd = File_Open(path);
+    if (fd < 0) {
+        fprintf(out, "ERROR: can't open '%s'\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+// 'files' empty files made in one directory, the directory listed
+// 'lists' times, then the files unlinked in a shuffled order
+static void suite_files(int files, int lists) {
+    char path[64];
+    int *order = malloc(sizeof(int) * files);
+    double t;
+
+    suite_boot(files + 16);
+    if (Dir_Create("/flat") < 0) {
+        fprintf(out, "ERROR: can't create directory '/flat'\n");
+        exit(1);
+    }
+    t = suite_start();
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/flat/f%d", i);
+        File_Create(path);
+    }
+    t = now_us() - t;
+    suite_sync();
+    suite_row("create", 0, FS_OP_CREATE, t);
+
+    int size = Dir_Size("/flat");
+    char *entries = malloc(size > 0 ? size : 1);
+    t = suite_start();
+    for (int i = 0; i < lists; i++) {
+        Dir_Read("/flat", entries, size);
+    }
+    suite_row("dir-list", files, FS_OP_DIR_READ, now_us() - t);
+    free(entries);
+
+    for (int i = 0; i < files; i++) {
+        order[i] = i;
+    }
+    for (int i = files - 1; i > 0; i--) {
+        int j = suite_rand() % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    t = suite_start();
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/flat/f%d", order[i]);
+        File_Unlink(path);
+    }
+    t = now_us() - t;
+    suite_sync();
+    suite_row("unlink", 0, FS_OP_UNLINK, t);
+    free(order);
+}
+
+// /t<tree>/d0/d1/.../d<level-1>
+static void deep_path(int tree, int level, char *path) {
+    sprintf(path, "/t%d", tree);
+    for (int i = 0; i < level; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+    }
+}
+
+// 'trees' directory trees 'depth' deep, then 'opens' File_Open/File_Close
+// pairs of the files at their bottoms, trees picked at random
+static void suite_deep(int trees, int depth, int opens) {
+    char path[512];
+    double t;
+
+    suite_boot(trees * (depth + 2) + 16);
+    t = suite_start();
+    for (int tr = 0; tr < trees; tr++) {
+        for (int level = 0; level <= depth; level++) {
+            deep_path(tr, level, path);
+            Dir_Create(path);
+        }
+    }
+    t = now_us() - t;
+    suite_sync();
+    suite_row("create-deep", depth, FS_OP_DIR_CREATE, t);
+
+    for (int tr = 0; tr < trees; tr++) {
+        deep_path(tr, depth, path);
+        strcat(path, "/f");
+        File_Create(path);
+    }
+    t = suite_start();
+    for (int i = 0; i < opens; i++) {
+        deep_path(suite_rand() % trees, depth, path);
+        strcat(path, "/f");
+        File_Close(File_Open(path));
+    }
+    suite_row("open-deep", depth, FS_OP_OPEN, now_us() - t);
+}
+
+// a 4 MB file written 'passes' times front to back in 'chunk' byte
+// calls, then read the same way from a cold cache
+static void suite_seq(int chunk, int passes) {
+    double t;
+    int fd;
+
+    suite_boot(64);
+    File_Create("/seq");
+    fd = open_or_die("/seq");
+    t = suite_start();
+    for (int p = 0; p < passes; p++) {
+        File_Seek(fd, 0);
+        for (int off = 0; off < SUITE_FILE_SIZE; off += chunk) {
+            File_Write(fd, suite_data, chunk);
+        }
+    }
+    File_Close(fd);
+    t = now_us() - t;
+    suite_sync();
+    suite_row("seq-write", chunk, FS_OP_WRITE, t);
+
+    suite_reboot();
+    fd = open_or_die("/seq");
+    t = suite_start();
+    for (int p = 0; p < passes; p++) {
+        File_Seek(fd, 0);
+        for (int off = 0; off < SUITE_FILE_SIZE; off += chunk) {
+            File_Read(fd, suite_data, chunk);
+        }
+    }
+    suite_row("seq-read", chunk, FS_OP_READ, now_us() - t);
+    File_Close(fd);
+}
+
+// 'calls' File_PWrite calls of 'size' bytes at random size-aligned
+// offsets of a 4 MB file, then as many File_PRead calls from a cold cache
+static void suite_random(int size, int calls) {
+    int blocks = SUITE_FILE_SIZE / size;
+    double t;
+    int fd;
+
+    suite_boot(64);
+    File_Create("/rand");
+    fd = open_or_die("/rand");
+    for (int off = 0; off < SUITE_FILE_SIZE; off += sizeof(suite_data)) {
+        File_Write(fd, suite_data, sizeof(suite_data));
+    }
+    suite_sync();
+    t = suite_start();
+    for (int i = 0; i < calls; i++) {
+        File_PWrite(fd, suite_data, size, suite_rand() % blocks * size);
+    }
+    File_Close(fd);
+    t = now_us() - t;
+    suite_sync();
+    suite_row("rand-write", size, FS_OP_PWRITE, t);
+
+    suite_reboot();
+    fd = open_or_die("/rand");
+    t = suite_start();
+    for (int i = 0; i < calls; i++) {
+        File_PRead(fd, suite_data, size, suite_rand() % blocks * size);
+    }
+    suite_row("rand-read", size, FS_OP_PREAD, now_us() - t);
+    File_Close(fd);
+}
+
+// a disk filled to 90% with 256 KB files, then 'rounds' FS_Sync() calls
+// after a 512 byte change each, incremental and rewriting the whole
+// image, and 'rounds' FS_Boot() calls of it
+static void suite_full(int rounds) {
+    int size = 256 << 10;
+    int files = (long)SUITE_DISK_SECTORS * SECTOR_SIZE * 9 / 10 / size;
+    char path[32];
+    double t;
+
+    suite_boot(files + 16);
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/full%d", i);
+        File_Create(path);
+        int fd = open_or_die(path);
+        if (File_Write(fd, suite_data, size) != size) {
+            fprintf(out, "ERROR: can't fill '%s'\n", path);
+            exit(1);
+        }
+        File_Close(fd);
+    }
+    suite_sync();
+    for (int full = 0; full <= 1; full++) {
+        FS_SetOption(FS_OPT_FULL_SYNC, full);
+        t = suite_start();
+        for (int r = 0; r < rounds; r++) {
+            sprintf(path, "/full%d", suite_rand() % files);
+            int fd = open_or_die(path);
+            File_PWrite(fd, suite_data, 512, suite_rand() % (size / 512) * 512);
+            File_Close(fd);
+            FS_Sync();
+        }
+        suite_row(full ? "sync-full" : "sync", files, FS_OP_SYNC, now_us() - t);
+    }
+    FS_SetOption(FS_OPT_FULL_SYNC, 0);
+
+    t = suite_start();
+    for (int r = 0; r < rounds; r++) {
+        FS_Boot(disk_file);
+    }
+    suite_row("boot-full", files, FS_OP_BOOT, now_us() - t);
+}
+
+static void suite_print(int csv, int scale) {
+    if (csv) {
+        fprintf(out, "case,param,ops,errors,seconds,ops_per_s,p50_us,p99_us,max_us,"
+                "disk_reads,disk_writes,sectors_read,sectors_written,seeks,cache_hits,cache_misses\n");
+    } else {
+        fprintf(out, "{\"scale\": %d, \"seed\": %lu, \"disk_sectors\": %d, \"results\": [\n", scale, suite_seed,
+                SUITE_DISK_SECTORS);
+    }
+    for (int i = 0; i < suite_nrows; i++) {
+        suite_row_t *r = &suite_rows[i];
+        double rate = r->seconds > 0 ? r->ops / r->seconds : 0;
+        if (csv) {
+            fprintf(out, "%s,%d,%ld,%ld,%.6f,%.1f,%.3f,%.3f,%.3f,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n", r->name, r->param,
+                    r->ops, r->errors, r->seconds, rate, r->p50_ns / 1e3, r->p99_ns / 1e3, r->max_ns / 1e3,
+                    r->disk_reads, r->disk_writes, r->sectors_read, r->sectors_written, r->seeks, r->cache_hits,
+                    r->cache_misses);
+        } else {
+            fprintf(out, "  {\"case\": \"%s\", \"param\": %d, \"ops\": %ld, \"errors\": %ld, \"seconds\": %.6f, "
+                    "\"ops_per_s\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+                    "\"disk_reads\": %ld, \"disk_writes\": %ld, \"sectors_read\": %ld, \"sectors_written\": %ld, "
+                    "\"seeks\": %ld, \"cache_hits\": %ld, \"cache_misses\": %ld}%s\n", r->name, r->param, r->ops,
+                    r->errors, r->seconds, rate, r->p50_ns / 1e3, r->p99_ns / 1e3, r->max_ns / 1e3, r->disk_reads,
+                    r->disk_writes, r->sectors_read, r->sectors_written, r->seeks, r->cache_hits, r->cache_misses,
+                    i + 1 < suite_nrows ? "," : "");
+        }
+    }
+    if (!csv) {
+        fprintf(out, "]}\n");
+    }
+}
+
+void suite_bench(int argc, char *argv[]) {
+    int csv = argc > 0 && strcmp(argv[0], "csv") == 0;
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    int seq_chunks[] = {512, 4096, 65536, 1 << 20};
+    int rand_sizes[] = {512, 4096, 65536};
+
+    if (argc > 0 && !csv && strcmp(argv[0], "json") != 0) {
+        fprintf(stderr, "suite: the format is json or csv\n");
+        exit(1);
+    }
+    if (scale < 1) {
+        scale = 1;
+    }
+    suite_seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    if (suite_seed == 0) {
+        suite_seed = 1; // xorshift stays at 0
+    }
+    suite_state = suite_seed;
+    for (int i = 0; i < (int)sizeof(suite_data); i++) {
+        suite_data[i] = suite_rand();
+    }
+    FS_SetOption(FS_OPT_STATS, 1); // some rows have only 10 calls to take p50/p99 of
+
+    suite_files(500 * scale, 200 * scale);
+    suite_deep(8 * scale, 32, 2000 * scale);
+    for (int i = 0; i < 4; i++) {
+        suite_seq(seq_chunks[i], scale);
+    }
+    for (int i = 0; i < 3; i++) {
+        suite_random(rand_sizes[i], 2000 * scale);
+    }
+    suite_full(10 * scale);
+    suite_print(csv, scale);
+
+    FS_SetOption(FS_OPT_STATS, 16);
+    FS_SetOption(FS_OPT_DISK_SECTORS, NUM_SECTORS);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("bench");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "open-deep") == 0) {
+        open_deep(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "alloc-full") == 0) {
+        alloc_full(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "seq-io") == 0) {
+        seq_io(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "sync") == 0) {
+        sync_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "boot") == 0) {
+        boot_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "view") == 0) {
+        view_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "records") == 0) {
+        records(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "random") == 0) {
+        random_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "threads") == 0) {
+        threads_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "fds") == 0) {
+        fds_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "qd") == 0) {
+        qd_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "journal") == 0) {
+        journal_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "writeback") == 0) {
+        writeback_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "readahead") == 0) {
+        readahead_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "delalloc") == 0) {
+        delalloc_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "stats") == 0) {
+        stats_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "model") == 0) {
+        model_bench(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "suite") == 0) {
+        suite_bench(argc - 2, argv + 2);
+    } else {
+        usage(argv[0]);
+    }
+
+    if (getenv("BENCH_TRACE") != NULL && FS_TraceSave(getenv("BENCH_TRACE")) < 0) {
+        fprintf(out, "ERROR: can't save the trace to '%s'\n", getenv("BENCH_TRACE"));
+    }
+    unlink(disk_file);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// turns a binary trace written by FS_TraceSave() into the JSON of the
+// Chrome trace event format, which chrome://tracing and Perfetto open,
+// and prints how long each kind of span took in total to stderr
+
+#define MAX_DEPTH 64 // spans open at once on one thread
+
+typedef struct {
+    long count;
+    double total_us; // inclusive, spans inside it count too
+    double max_us;
+} summary_t;
+
+static summary_t summary[FS_EV_COUNT];
+
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s <trace file> [json file]\n", prog);
+    fprintf(stderr, "  writes the trace as Chrome trace JSON to the json file (default stdout)\n");
+    exit(1);
+}
+
+// the events of one thread, oldest first; spans whose beginning was
+// overwritten in the ring have their end dropped
+static void dump_thread(FILE *out, FS_Trace_Thread *thread, FS_Trace_Event *events, long base, double ns_per_tick,
+                        int *first) {
+    FS_Trace_Event *open[MAX_DEPTH];
+    int depth = 0;
+
+    fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"thread %d\"}}", *first ? "" : ",\n", thread->thread, thread->thread);
+    *first = 0;
+    for (int i = 0; i < thread->count; i++) {
+        FS_Trace_Event *e = &events[i];
+        if (e->event < 0 || e->event >= FS_EV_COUNT || (e->phase != 'B' && e->phase != 'E')) {
+            continue;
+        }
+        if (e->phase == 'B') {
+            if (depth < MAX_DEPTH) {
+                open[depth] = e;
+            }
+            depth++;
+        } else {
+            if (depth == 0) {
+                continue;
+            }
+            depth--;
+            if (depth < MAX_DEPTH && open[depth]->event == e->event) {
+                double us = (e->ticks - open[depth]->ticks) * ns_per_tick / 1e3;
+                summary_t *s = &summary[e->event];
+                s->count++;
+                s->total_us += us;
+                if (us > s->max_us) {
+                    s->max_us = us;
+                }
+            }
+        }
+        fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"inode\": %d, \"sector\": %ld, \"arg\": %ld}}",
+                FS_EventName(e->event), e->event < FS_OP_COUNT ? "call" : "step", e->phase,
+                (e->ticks - base) * ns_per_tick / 1e3, thread->thread, e->inode, e->sector, e->arg);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    FS_Trace_Header header;
+    FILE *in, *out = stdout;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+    if ((in = fopen(argv[1], "rb")) == NULL || fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, FS_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "ERROR: '%s' is not a trace written by FS_TraceSave()\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2 && (out = fopen(argv[2], "w")) == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    // every thread is read first, so times can start at the earliest event
+    FS_Trace_Thread *threads = calloc(header.threads, sizeof(FS_Trace_Thread));
+    FS_Trace_Event **events = calloc(header.threads, sizeof(FS_Trace_Event *));
+    long base = -1, lost = 0;
+    for (int t = 0; t < header.threads; t++) {
+        if (fread(&threads[t], sizeof(FS_Trace_Thread), 1, in) != 1 || threads[t].count < 0 ||
+            threads[t].count > header.ring_events ||
+            (events[t] = malloc(sizeof(FS_Trace_Event) * (threads[t].count + 1))) == NULL ||
+            fread(events[t], sizeof(FS_Trace_Event), threads[t].count, in) != (size_t)threads[t].count) {
+            fprintf(stderr, "ERROR: '%s' is cut short\n", argv[1]);
+            return 1;
+        }
+        if (threads[t].count > 0 && (base == -1 || events[t][0].ticks < base)) {
+            base = events[t][0].ticks;
+        }
+        lost += threads[t].lost;
+    }
+    fclose(in);
+
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (int t = 0; t < header.threads; t++) {
+        dump_thread(out, &threads[t], events[t], base, header.ns_per_tick, &first);
+        free(events[t]);
+    }
+    fprintf(out, "\n]}\n");
+    if (ferror(out) || (out != stdout && fclose(out) != 0)) {
+        fprintf(stderr, "ERROR: can't write the JSON\n");
+        return 1;
+    }
+
+    fprintf(stderr, "%d threads, %ld events lost to the ring size\n", header.threads, lost);
+    fprintf(stderr, "  %-16s %9s %12s %10s %10s\n", "span", "count", "total us", "mean us", "max us");
+    for (int ev = 0; ev < FS_EV_COUNT; ev++) {
+        summary_t *s = &summary[ev];
+        if (s->count > 0) {
+            fprintf(stderr, "  %-16s %9ld %12.1f %10.3f %10.3f\n", FS_EventName(ev), s->count, s->total_us,
+                    s->total_us / s->count, s->max_us);
+        }
+    }
+    free(threads);
+    free(events);
+    return 0;
+}